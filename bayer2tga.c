@@ -1,199 +1,4940 @@
-/*
-    This is an example of converting a single frame from an IMX477 camera
-    to an RGB frame (saved back to disk as a TGA file). The camera sensor
-    provides an image in the following format (in this case):
-    
-    * Resolution: 1920x1080
-    * The pixel format is Bayer RG10, meaning:
-        * Each pixel color is max 10 bits wide saved in a 16 bit integer,
-          i.e. the values range from 0 to 1023
-        * The color format is R G G B, placed in the following way:
-          +----+----+----+----+----+----+----+----+----+----+
-          | R  | Gr | R  | Gr | R  | Gr | R  | Gr | R  | Gr |
-          +----+----+----+----+----+----+----+----+----+----+
-          | Gb | B  | Gb | B  | Gb | B  | Gb | B  | Gb | B  |
-          +----+----+----+----+----+----+----+----+----+----+
-          | R  | Gr | R  | Gr | R  | Gr | R  | Gr | R  | Gr |
-          +----+----+----+----+----+----+----+----+----+----+
-          | Gb | B  | Gb | B  | Gb | B  | Gb | B  | Gb | B  |
-          +----+----+----+----+----+----+----+----+----+----+
-        * Gr are green pixels in the red rows, and Gb in the blue rows
-        * The output format is a simple G B R, 8-bit per color, not including
-          the header:
-          +---+---+---+---+---+---+---+---+---+
-          | G | B | R | G | B | R | G | B | R |
-          +---+---+---+---+---+---+---+---+---+
-          | G | B | R | G | B | R | G | B | R |
-          +---+---+---+---+---+---+---+---+---+
-    
-    Since there are two greens for each output pixel, a simple average is
-    performed between them, while the red and the blue ones remain their
-    value. This will not produce the best results, there are better methods
-    out there. Check out this paper:
-    https://www.researchgate.net/publication/227014366_Real-time_GPU_color-based_segmentation_of_football_players
-    
-    The output format is simple BGR bitmap with 8 bits per color. When
-    the file is saved, a small TGA header is added so it can be opened in
-    any picture viewer or editor.
-
-    Between reading a frame and saving it there's an additional step of
-    normalizing it. It should not be necessary, check how it works with
-    your images. You can skip this step by removing the call to the
-    normalize_frame() function.
-*/
-
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <math.h>
-
-#define WIDTH           (1920)                   // Pixels width
-#define HEIGHT          (1080)                   // Pixels height
-
-#define RG10_BITS       (10)                     // Bits (max) per input RG10 color, practically will be 16 bits
-#define RGB_BITS        (8)                      // Bits per output RGB color
-#define MAX_RG10        ((1<<RG10_BITS)-1)       // Max color value
-#define MAX_RGB         ((1<<RGB_BITS)-1)        // Max color value
-
-#define RG10_COLOR_SIZE (2)                      // Bytes per RG10 color
-#define RGB_COLOR_SIZE  (1)                      // Bytes per RGB color
-#define RG10_COLORS     (4)                      // Colors in a RG10 pixel
-#define RGB_COLORS      (3)                      // Colors in an RGB pixel
-
-#define RG10_R          (0)                      // Location of the red color in an RG10 pixel
-#define RG10_Gr         (RG10_R+1)               // Location of the green color of red row in an RG10 pixel
-#define RG10_Gb         (WIDTH*RG10_COLOR_SIZE)  // Location of the green color of blue row in an RG10 pixel
-#define RG10_B          (RG10_Gb+1)              // Location of the blue color in an RG10 pixel
-
-#define RGB_R           (2)                      // Location of the red color in an RGB pixel
-#define RGB_G           (1)                      // Location of the green color in an RGB pixel
-#define RGB_B           (0)                      // Location of the blue color in an RGB pixel
-
-#define RG10_SIZE       (WIDTH*HEIGHT*RG10_COLORS*RG10_COLOR_SIZE) // Total RG10 input frame size
-#define RGB_SIZE        (WIDTH*HEIGHT*RGB_COLORS*RGB_COLOR_SIZE) // Total RGB output image size
-
-#define NORM(V)         (V*((float)MAX_RGB/MAX_RG10)) // Normilize a color (V for value) to output size
-
-#define RG10_LOCATION(X, Y, COLOR) (Y*WIDTH*RG10_COLORS+X*RG10_COLOR_SIZE+COLOR) // Location of a pixel in an RG10 frame
-#define RGB_LOCATION(X, Y, COLOR)  (Y*WIDTH*RGB_COLORS+X*RGB_COLORS+COLOR) // Location of a pixel in an RGB frame
-
-// Read the file from disk. Doesn't check the file size, using
-// a preset frame size of 1920x1080x2x4=16,588,800 bytes.
-uint16_t *read_file(char *name)
-{
-    FILE *file;
-    uint16_t *buff;
-
-    buff = (uint16_t *)malloc(RG10_SIZE);
-
-    file = fopen(name, "rb");
-    if (!file)
-    {
-        fprintf(stderr, "Unable to open file %s for reading.\n", name);
-        exit(-1);
-    }
-    fread(buff, 1, RG10_SIZE, file);
-    fclose(file);
-    return buff;
-}
-
-//  Save the output RGB image file with a simple TGA header.
-void write_tga(char *name, uint8_t *buff)
-{
-    FILE *file;
-    unsigned char tga_header[18] = {0};
-
-    tga_header[2] = 2;
-    tga_header[12] = 255 & WIDTH;
-    tga_header[13] = 255 & (WIDTH >> 8);
-    tga_header[14] = 255 & HEIGHT;
-    tga_header[15] = 255 & (HEIGHT >> 8);
-    tga_header[16] = 24;
-    tga_header[17] = 32;
-
-    file = fopen(name, "wb");
-    if (!file)
-    {
-        fprintf(stderr, "Unable to open file %s for writing.\n", name);
-        exit(-1);
-    }
-    fwrite(tga_header, sizeof(tga_header), 1, file);
-    fwrite(buff, 1, RGB_SIZE, file);
-    fclose(file);
-}
-
-// Find the min and max values for any of the colors.
-void min_max_frame(uint16_t *buffer, uint16_t *min, uint16_t *max)
-{
-    *max = 0;
-    *min = 65535;
-    for(int y = 0; y < HEIGHT; y++)
-    {
-        for(int x = 0; x < WIDTH; x++)
-        {
-            uint16_t Gb = *(buffer + RG10_LOCATION(x, y, RG10_Gb));
-            uint16_t Gr = *(buffer + RG10_LOCATION(x, y, RG10_Gr));
-            uint16_t B = *(buffer + RG10_LOCATION(x, y, RG10_B));
-            uint16_t R = *(buffer + RG10_LOCATION(x, y, RG10_R));
-            if(*max < Gb) *max = Gb;
-            if(*max < Gr) *max = Gr;
-            if(*max < B) *max = B;
-            if(*max < R) *max = R;
-            if(*min > Gb) *min = Gb;
-            if(*min > Gr) *min = Gr;
-            if(*min > B) *min = B;
-            if(*min > R) *min = R;           
-        }
-    }
-}
-
-// Normalize the Bayer RG10 frame with min = 0 and max = 1023.
-void normalize_frame(uint16_t *buffer)
-{
-    uint16_t min, max;
-    unsigned int location;
-    min_max_frame(buffer, &min, &max);
-    float mult = 1023 / ((float)max - (float)min);
- 
-    for(int y = 0; y < HEIGHT; y++)
-    {
-        for(int x = 0; x < WIDTH; x++)
-        {
-            location = RG10_LOCATION(x, y, RG10_Gb); *(buffer + location) = round((*(buffer + location) - min) * mult);
-            location = RG10_LOCATION(x, y, RG10_Gr); *(buffer + location) = round((*(buffer + location) - min) * mult);
-            location = RG10_LOCATION(x, y, RG10_R);  *(buffer + location) = round((*(buffer + location) - min) * mult);
-            location = RG10_LOCATION(x, y, RG10_B);  *(buffer + location) = round((*(buffer + location) - min) * mult);
-        }
-    }
-}
-
-// Perform the actual de-Bayering, coverting RGGB to RGB image.
-uint8_t *debayer(uint16_t *buffer)
-{
-    uint8_t *image = malloc(RGB_SIZE);
-    for(int y = 0; y < HEIGHT; y++)
-    {
-        for(int x = 0; x < WIDTH; x++)
-        {
-            *(image + RGB_LOCATION(x, y, RGB_R)) =  NORM(*(buffer + RG10_LOCATION(x, y, RG10_R)));
-            *(image + RGB_LOCATION(x, y, RGB_B)) =  NORM(*(buffer + RG10_LOCATION(x, y, RG10_B)));
-            *(image + RGB_LOCATION(x, y, RGB_G)) = NORM((*(buffer + RG10_LOCATION(x, y, RG10_Gb)) +
-                                                         *(buffer + RG10_LOCATION(x, y, RG10_Gr))) / 2);
-        }
-    }
-    return image;
-}
-
-// The first argument is the input raw file name, the second is the
-// output file to save to disk.
-int main(int argc, char *argv[])
-{
-    uint16_t *buffer = read_file(argv[1]);  // Read the frame
-    normalize_frame(buffer);                // Normalize it (optional step)
-    uint8_t *image = debayer(buffer);       // Debayer
-    write_tga(argv[2], image);              // Save back to the disk
-
-    free(buffer);
-    free(image);
-    return 0;
-}
+/*
+    This is an example of converting a single frame from an IMX477 camera
+    to an RGB frame (saved back to disk as a TGA file). The camera sensor
+    provides an image in the following format (in this case):
+    
+    * Resolution: 1920x1080
+    * The pixel format is Bayer RG10, meaning:
+        * Each pixel color is max 10 bits wide saved in a 16 bit integer,
+          i.e. the values range from 0 to 1023
+        * The color format is R G G B, placed in the following way:
+          +----+----+----+----+----+----+----+----+----+----+
+          | R  | Gr | R  | Gr | R  | Gr | R  | Gr | R  | Gr |
+          +----+----+----+----+----+----+----+----+----+----+
+          | Gb | B  | Gb | B  | Gb | B  | Gb | B  | Gb | B  |
+          +----+----+----+----+----+----+----+----+----+----+
+          | R  | Gr | R  | Gr | R  | Gr | R  | Gr | R  | Gr |
+          +----+----+----+----+----+----+----+----+----+----+
+          | Gb | B  | Gb | B  | Gb | B  | Gb | B  | Gb | B  |
+          +----+----+----+----+----+----+----+----+----+----+
+        * Gr are green pixels in the red rows, and Gb in the blue rows
+        * The output format is a simple G B R, 8-bit per color, not including
+          the header:
+          +---+---+---+---+---+---+---+---+---+
+          | G | B | R | G | B | R | G | B | R |
+          +---+---+---+---+---+---+---+---+---+
+          | G | B | R | G | B | R | G | B | R |
+          +---+---+---+---+---+---+---+---+---+
+    
+    Since there are two greens for each output pixel, a simple average is
+    performed between them, while the red and the blue ones remain their
+    value. This will not produce the best results, there are better methods
+    out there. Check out this paper:
+    https://www.researchgate.net/publication/227014366_Real-time_GPU_color-based_segmentation_of_football_players
+    
+    The output format is simple BGR bitmap with 8 bits per color. When
+    the file is saved, a small TGA header is added so it can be opened in
+    any picture viewer or editor.
+
+    Between reading a frame and saving it there's an additional step of
+    normalizing it. It should not be necessary, check how it works with
+    your images. You can skip this step with -n none.
+
+    The conversion runs as a pipeline of stages (normalize, demosaic,
+    pack to 8 bits, ...) over bands of rows, each band on its own thread.
+    Point-wise stages run one after the other on a row while it's still
+    in the cache, and known sequences of them are replaced by a single
+    fused kernel. A stage that needs the rows around it gets them from a
+    small rolling buffer kept by the stages before it, so no stage ever
+    makes a separate pass over the whole frame.
+
+    With -j the fused kernels are compiled at run time (x86-64 only) for
+    the exact frame width, Bayer pattern and stages, a straight line of
+    SSE4.1 code with no per-pixel branches or table lookups. The kernels
+    are cached and reused by every pipeline of the same format, and the
+    generic ones are used when they can't be compiled.
+
+    The best band size, thread count and kernels depend on the host, so
+    --autotune benchmarks them on a synthetic frame (and the input frame
+    when given) and saves the fastest to a profile, ~/.bayer2tga unless
+    --profile says otherwise. Every run loads the profile on start, and
+    the command line options take precedence over it.
+
+    The SIMD kernels (min and max, normalize, grayscale) are written once
+    against the thin vector layer of simd.h, in kernels.h, which is
+    compiled for the base vector width of the target and on x86-64 also
+    for AVX2 and AVX-512. The widest one the CPU supports is picked on
+    first use, and all of them give the same results as the plain C code.
+    On CPUs with AVX-512 VBMI the demosaic and pack to BGR, the grading
+    with a 3D LUT, the false color suppression and unpacking packed RAW10
+    input (--packed, 4 samples in 5 bytes as sent by MIPI CSI-2 cameras)
+    have dedicated kernels: byte permutes across the whole register do the
+    3 byte interleave and the 5 byte groups, gathers fetch the nodes of
+    the LUT, and masked loads and stores handle the tail of a row of any
+    width.
+
+    For fixed deployments the configuration can be built in with -D:
+    the default geometry and pattern (WIDTH, HEIGHT, PATTERN), the black
+    and white levels of -n fixed (LEVELS_MIN, LEVELS_MAX), the tuning
+    (BAND_ROWS, THREADS, USE_JIT, and BUILTIN_TUNING to skip the profile)
+    and the SIMD kernels (SIMD_KERNELS, e.g. simd_avx2). The normalizing
+    and packing tables of -n fixed are filled by the compiler, so such a
+    run starts converting right away, with no min and max pass over the
+    frame and no arithmetic per color.
+
+    The converter can also be linked into other programs as a library,
+    compiling this file with -DBAYER2TGA_LIBRARY to leave out main and
+    keep everything but its API local, with the C declarations in
+    bayer2tga.h and a header-only C++20 interface in bayer2tga.hpp:
+    spans over the frames and images, move-only frames and images in
+    pooled buffers, and an input range over the frames of a stream that
+    reuses their buffers. bayer2tga_async.hpp adds a C++20 coroutine
+    pipeline over it, reading and writing on an I/O thread and
+    converting on a pool of workers, with a bounded number of frames in
+    flight and cancellation by a stop token.
+
+    Long exposures and low light need the fixed-pattern noise removed:
+    a master dark frame (--dark) is subtracted from every frame and the
+    master flat field gains (--flat, 16 bit fixed point with 12 fraction
+    bits) multiply it. Both are RG10 frames of the same geometry, mapped
+    from their files, and the calibration is a stage of the conversion
+    pipeline, so it runs on each row right before its normalization
+    instead of as separate passes over the frame. The min and max of the
+    normalization are those of the calibrated frame. Only the RGB
+    conversion of whole frames is calibrated.
+
+    The master frames are made by stacking (--stack) any number of
+    frames, from files holding one or more each, into an RG10 frame of
+    the mean, the sigma-clipped mean or the median of every sample, or
+    the flat field gains of it (--gains). The stack is combined a tile
+    of rows at a time, read from all the frames, with the tiles spread
+    over the threads and sized to a memory budget, so it never holds
+    more than a tile of each frame per thread.
+
+    The pass over a frame finding its min and max for the normalization
+    also sums every row of blocks, for finding the flicker of mains
+    lighting (--flicker): a rolling shutter turns it into bands along
+    the rows, whose frequency and amplitude are found in the profile of
+    the row sums from the sensor line time (--line-us), and reported for
+    every frame. The library gathers the sums when given a struct stats.
+
+    The sharpness of the RGB images, for autofocus and rejecting blurred
+    frames, can be measured in the conversion pass (--focus): a stage on
+    the calibrated rows computes the variance of the Laplacian and the
+    Tenengrad (mean squared Sobel gradient) of the plane of the greens of
+    the blocks, for the whole frame and each zone of a grid, saved to a
+    JSON file next to the image.
+
+    The same pass can also bin the frame into a plane of the mean sample
+    of every 8x8 blocks, for finding motion in streams (--motion): each
+    bin is compared to a running average of it, the background, and the
+    share of the bins that changed is the motion score of the frame,
+    reported with a mask of those bins saved next to the output. The
+    frames can be converted only when in motion (--gate), e.g. to record
+    events.
+
+    The pass also estimates the noise of the frame, which grows with the
+    gain of the sensor, from the median absolute difference of the
+    neighbours of each color along a subset of the rows. The normalized
+    RGB images can be denoised by a stage ahead of the normalization
+    (--denoise), averaging each sample with the neighbours of its color
+    within a threshold set by the noise of the frame, so the edges are
+    kept, and skipping the frames with too little noise. The tiers of
+    the scheduler below the full one aren't normalized, nor denoised.
+
+    The samples at the clip level (--clip) are counted by color in the
+    same pass, listing the rows holding any. The normalization maps the
+    max to white whatever clipped, which tints the highlights where only
+    some colors clipped, e.g. a bright sky. Their reconstruction
+    (--highlights) gives the blocks with clipped samples the color of
+    the nearest one along the row without any, at the clip level, or
+    makes them white. It's a stage on the listed rows only, and the
+    frames without clipping don't have it at all.
+
+    The RGB images can be graded with the 3D LUT of a .cube file (--lut),
+    such as a look made in a grading tool, from 17 to 65 nodes per axis.
+    Each pixel is interpolated in fixed point between the 4 corners of
+    the one of the 6 tetrahedra of its cell it falls in, by a kernel
+    fused with the normalization and demosaicing that writes the output
+    in place of packing it to 8 bits, so grading needs no pass of its
+    own.
+
+    The false colors the demosaic leaves at the edges, where the red and
+    blue samples of a block fall on either side of one, can be suppressed
+    (--chroma): the differences of the reds and blues from the greens are
+    replaced by their medians over 3x3 pixels, which drops a lone fringe
+    of color while the edges, carried by the greens, stay sharp. The
+    demosaic writes the greens and the differences as planes, and the
+    medians are taken by SIMD sorting networks on the rolling rows of
+    the pipeline, in a stage fused with the packing to 8 bits, so there's
+    no extra pass over the frame.
+
+    The lateral chromatic aberration of the lens, its red and blue images
+    being slightly larger or smaller than the green one, is corrected
+    with a lens profile (--lens), a key=value file of the scales of the
+    red and blue images of each lens and its optical center. The reds
+    and blues of the mosaic are resampled radially from the center,
+    bilinearly in fixed point, by a stage of the rows of blocks around
+    each one after the denoising and ahead of the normalization, so the
+    bands of the pipeline are the tiles of the resampling and no other
+    frame is made. The scaling is separable, so a row of a color comes
+    from the same two rows, and a vector of it from two loads of each
+    nearly everywhere. A stage reaches 8 rows of blocks on either side,
+    enough for scales up to 1.3% off 1 on a 1080 row frame, and the
+    lenses needing more are refused.
+
+
+    In streaming mode (-s) the input holds consecutive frames (or "-" to
+    read them from stdin, e.g. piped from the capture process), and the
+    output name is a printf pattern receiving the frame number. With a
+    per-frame deadline (-d) a small scheduler keeps the latency bounded:
+    when a frame is running late it steps down from normalize + debayer,
+    to debayer only, to a binned half-size preview, and depending on the
+    drop policy (-D) skips frames whose deadline has already passed.
+
+    Several cameras can be served by a single process (-c, once per
+    camera), each stream with its own geometry, Bayer pattern,
+    normalization and deadline. The streams share a pool of worker
+    threads (-t), and a weighted fair scheduler hands the next free
+    worker to the stream that received the least processing time
+    relative to its weight.
+
+    The cameras can also be composited into a video wall (-w), a grid of
+    tiles in a single output image. Every refresh reads one frame from
+    each camera and bins it (-b) straight into its tile, without any
+    intermediate full size image.
+
+    For event recording (-r) a stream is only captured into a RAM ring
+    holding the last seconds of frames, losslessly compressed, within a
+    memory budget. A trigger (SIGUSR1, a datagram on a UNIX socket, or a
+    file appearing) hands the ring and the frames following it to the
+    worker threads for conversion, while the capture goes on. The frames
+    waiting for conversion count against the same budget: when it's used
+    up the capture waits for the workers, or with -D late drops the
+    frames that don't fit.
+
+    Instead of an image, the output can be a model input tensor (-T),
+    built in a single pass straight from the Bayer frame: binned to the
+    model size, letterboxed, normalized by the per channel mean and std
+    and laid out as NCHW or NHWC floats or bytes, in RGB order. In
+    streaming mode several frames can be batched into one tensor file.
+
+    When only the brightness is needed (-g), an 8 bit grayscale TGA, or
+    a bare plane (--plane), is made of either the average of the two
+    greens or the luma of each block. The min and max for normalizing it
+    are then only searched in the colors it uses.
+
+    A single run can also fan out to several outputs (-o, once per
+    output), each with its own binning, region and color, sharing the
+    reading and the normalization of the frame, and each made and saved
+    by its own thread.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "bayer2tga.h"
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT
+#include <stddef.h>
+#endif
+
+// Built as a library, everything but the API of bayer2tga.h is local to
+// this file, so none of its names clash with those of the program it's
+// linked into. The ones only the command line uses are left unused.
+#ifdef BAYER2TGA_LIBRARY
+#define INTERNAL static __attribute__((unused))
+#else
+#define INTERNAL
+#endif
+
+// The defaults below can be built in differently with -D, e.g. for a
+// fixed deployment -DWIDTH=2028 -DHEIGHT=1520 -DPATTERN=PATTERN_BGGR.
+#ifndef WIDTH
+#define WIDTH           (1920)                   // Default pixels width
+#endif
+#ifndef HEIGHT
+#define HEIGHT          (1080)                   // Default pixels height
+#endif
+#ifndef PATTERN
+#define PATTERN         (PATTERN_RGGB)           // Default Bayer pattern
+#endif
+#ifndef LEVELS_MIN
+#define LEVELS_MIN      (0)                      // Levels normalized to with -n fixed
+#endif
+#ifndef LEVELS_MAX
+#define LEVELS_MAX      (MAX_RG10)
+#endif
+
+#define LUMA_R          (0.299f)                 // BT.601 luma weights
+#define LUMA_G          (0.587f)
+#define LUMA_B          (0.114f)
+
+#define EMA_WEIGHT      (0.25)                   // Weight of the latest sample in the running averages
+#define MAX_STREAMS     (64)                     // Max cameras served by one process
+#define MAX_OUTPUTS     (16)                     // Max outputs of a fan-out
+#define MAX_STAGES      (16)                     // Max stages in a pipeline
+#define MAX_FUSED       (4)                      // Max stages replaced by a fused kernel
+#define MAX_HALO        (8)                      // Max rows of blocks a stage needs on each side of a row
+#define CACHE_LINE      (64)                     // Bytes of a cache line, no two buffers of the bands share one
+#ifndef BAND_ROWS
+#define BAND_ROWS       (16)                     // Default rows of blocks in a band of a pipeline
+#endif
+#ifndef THREADS
+#define THREADS         (0)                      // Default threads converting a frame, 0 for one per core
+#endif
+#ifndef USE_JIT
+#define USE_JIT         (0)                      // Compile the fused kernels at run time by default
+#endif
+#define FPS             (30)                     // Default frame rate, for converting seconds to frames
+#define RING_MB         (1024)                   // Default memory budget of the pre-trigger ring
+#define JIT_KERNELS     (16)                     // Max kernels compiled at run time
+#define JIT_CODE_SIZE   (4096)                   // Bytes of code and constants of a compiled kernel
+#define TUNE_REPEATS    (5)                      // Conversions of each frame timed per configuration, the fastest counts
+#define PROFILE         ".bayer2tga"             // Default tuning profile, in the home directory
+#define STACK_MB        (256)                    // Default memory budget of the stacking tiles
+#define SIGMA           (3.0)                    // Default outlier threshold of a clipped stack, in std
+#define CLIP_ROUNDS     (5)                      // Max rounds of clipping the outliers of a sample
+#define LINE_US         (15.0)                   // Default sensor line time, in microseconds
+#define FLICKER_MIN     (80)                     // Lowest flicker frequency searched, in Hz
+#define FLICKER_MAX     (500)                    // Highest flicker frequency searched, in Hz
+#define FLICKER_LEVEL   (0.002)                  // Least amplitude reported as flicker, relative to the mean
+#define FOCUS_SUMS      (3)                      // Sums of a zone measuring the focus of a row
+#define MOTION_THRESHOLD (0.1)                   // Default change of a bin from its background that is motion
+#define MOTION_FLOOR    (16)                     // Added to the background of a bin when judging a change
+#define MOTION_WEIGHT   (0.05f)                  // Weight of the latest frame in the background
+#define NOISE_STEP      (128)                    // Rows of blocks from one sampled for the noise to the next
+#define NOISE_LEVELS    (1024)                   // Differences of neighbours counted, the larger ones as the largest
+#define NOISE_SCALE     (1.0484)                 // Std of a normal noise over the MAD of differences, 1/(0.6745*sqrt(2))
+#define DENOISE_STRENGTH (3.0)                   // Default neighbours averaged by the denoising, within K std of the noise
+#define DENOISE_MIN     (1.0)                    // Least std of the noise of a frame that is denoised
+#define HIGHLIGHT_REACH (32)                     // Blocks searched on each side of a clipped one for its color
+#define LUT_FRACTION    (10)                     // Bits of the position of a value in a cell of a 3D LUT
+#define LUT_ONE         (1<<LUT_FRACTION)        // Position at the end of a cell
+#define LUT_CELL        (LUT_FRACTION + 1)       // Shift of the first node of a cell, past the position in it
+#define LUT_BITS        (4)                      // Fraction bits of the 8 bit outputs of the nodes of a 3D LUT
+#define LATERAL_FRACTION (16)                    // Fraction bits of the positions the lateral CA is corrected from
+#define LATERAL_BITS    (7)                      // Bits of the weights of its bilinear interpolation
+#define LATERAL_ONE     (1<<LATERAL_BITS)        // Weight of a whole sample
+
+#define ROUND_CLIP(V)   ((V) > 0 ? (int)((double)(V) + 0.5) : 0) // Round a positive value, and clip negative ones to 0
+#define CACHE_LINES(N)  (((N) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1)) // Round bytes up to whole cache lines
+
+#define NORM(V)         ((V)*((float)MAX_RGB/MAX_RG10)) // Normilize a color (V for value) to output size
+
+#if LEVELS_MAX > MAX_RG10 || LEVELS_MIN >= LEVELS_MAX
+#error "The built in levels must be within the 10 bits range"
+#endif
+#define FIXED_MULT      (MAX_RG10 / ((float)LEVELS_MAX - (float)LEVELS_MIN))
+#define FIXED_VALUE(V)  ROUND_CLIP(((V) - (float)LEVELS_MIN) * FIXED_MULT)
+#define FIXED_NORM(V)   (FIXED_VALUE(V) > MAX_RG10 ? MAX_RG10 : FIXED_VALUE(V)) // A color normalized to the built in levels
+#define PACK(V)         ((uint8_t)NORM(V))
+
+#define TABLE4(F, V)    F(V), F((V)+1), F((V)+2), F((V)+3) // Entries of a table of F from V on, for the compiler to fill
+#define TABLE16(F, V)   TABLE4(F, V), TABLE4(F, (V)+4), TABLE4(F, (V)+8), TABLE4(F, (V)+12)
+#define TABLE64(F, V)   TABLE16(F, V), TABLE16(F, (V)+16), TABLE16(F, (V)+32), TABLE16(F, (V)+48)
+#define TABLE256(F, V)  TABLE64(F, V), TABLE64(F, (V)+64), TABLE64(F, (V)+128), TABLE64(F, (V)+192)
+#define TABLE1024(F)    TABLE256(F, 0), TABLE256(F, 256), TABLE256(F, 512), TABLE256(F, 768)
+
+#define RG10_LOCATION(X, Y, W, COLOR) ((Y)*(W)*RG10_COLORS+(X)*RG10_COLOR_SIZE+(COLOR)) // Location of a pixel in an RG10 frame
+#define RGB_LOCATION(X, Y, W, COLOR)  ((Y)*(W)*RGB_COLORS+(X)*RGB_COLORS+(COLOR)) // Location of a pixel in an RGB frame
+
+INTERNAL const char *pattern_names[PATTERNS] = {"rggb", "grbg", "gbrg", "bggr"};
+
+// Position of R, Gr, Gb and B inside the 2x2 block of each pattern,
+// numbered 0 and 1 on the first row, 2 and 3 on the second.
+INTERNAL const int pattern_positions[PATTERNS][RG10_COLORS] =
+{
+    {0, 1, 2, 3},
+    {1, 0, 3, 2},
+    {2, 3, 0, 1},
+    {3, 2, 1, 0}
+};
+
+INTERNAL const char *norm_names[] = {"none", "frame", "smooth", "fixed"};
+
+INTERNAL const char *gray_names[] = {"none", "green", "luma"};
+
+enum tier                                        // Processing tiers, from the best quality to the cheapest
+{
+    TIER_FULL,                                   // Normalize and debayer
+    TIER_FAST,                                   // Debayer only
+    TIER_PREVIEW,                                // Binned debayer, half the width and height
+    TIERS
+};
+
+enum drop                                        // What to do with a frame whose deadline has passed
+{
+    DROP_NEVER,                                  // Always convert it, at the cheapest tier
+    DROP_LATE                                    // Skip it
+};
+
+INTERNAL const char *tier_names[TIERS] = {"full", "fast", "preview"};
+
+// The deadline scheduler state of a stream. A frame's deadline is the
+// stream's start time plus (frame number + 1) periods, so a late frame
+// eats into the time of the frames after it until the stream catches up.
+struct scheduler
+{
+    double period;                               // Seconds per frame, 0 disables the scheduler
+    enum drop drop;                              // Policy for frames already past their deadline
+    double start;                                // Time the first frame was read
+    double cost[TIERS];                          // Moving average of seconds per frame for each tier
+    unsigned long frames[TIERS];                 // Frames converted at each tier
+    unsigned long dropped;                       // Frames skipped
+    unsigned long missed;                        // Frames finished after their deadline
+    double max_late;                             // Worst lateness seen, in seconds
+};
+
+// A stream of frames from a single camera.
+struct stream
+{
+    int id;
+    char *input;                                 // File name, "-" for stdin
+    char *output;                                // printf pattern of the output file names
+    FILE *file;
+    struct format fmt;
+    struct norm norm;
+    struct scheduler sched;
+    double weight;                               // Share of the workers relative to the other streams
+    double vtime;                                // Worker time received divided by the weight
+    double busy;                                 // Total worker time received, in seconds
+    double max_cost;                             // Longest time a frame took
+    unsigned long frame;                         // Next frame number
+    int running;                                 // Whether a worker is on it
+    int done;                                    // Whether the input ended
+    struct tensor *tensor;                       // Tensor output instead of images
+    enum gray gray;                              // Grayscale output instead of RGB
+    int plane;                                   // Save grayscale without the TGA header
+    struct output *outputs;                      // Fan-out outputs instead of the above
+    int outputs_count;
+    int threads;                                 // Threads for the outputs of a frame
+    double line;                                 // Seconds between sensor lines for finding flicker, 0 for not
+    struct stats stats;                          // Of the last frame, when finding flicker
+    struct focus *focus;                         // Measured along the RGB conversion, NULL for not
+    struct motion *motion;                       // Found in the statistics, NULL for not
+    float gate;                                  // Least motion score of the frames converted
+    struct workspace workspace;                  // Memory reused by the conversions of its frames
+    char *dark, *flat;                           // Files of the master calibration frames, NULL for none
+    char *lens;                                  // Lens profile, as FILE[:NAME], NULL for none
+    char *lut;                                   // .cube file of the 3D LUT, NULL for none
+    struct options options;                      // Processing of the frames, with the files above loaded
+};
+
+enum domain                                      // What the rows passed between pipeline stages hold
+{
+    DOMAIN_MOSAIC,                               // A row of Bayer blocks, its two color rows one after the other
+    DOMAIN_RGB,                                  // 16 bit RGB pixels, in the order of RGB_LOCATION
+    DOMAIN_CHROMA,                               // 16 bit planes of the greens, then of the reds and blues less them
+    DOMAIN_BGR8,                                 // 8 bit output pixels
+    DOMAINS
+};
+
+struct stage;
+
+// Process row y of a stage. A point-wise stage gets the row in in[0],
+// and may be run in place. A neighbourhood stage gets the 2*halo+1
+// rows around it, repeating the edge rows of the frame.
+typedef void (*stage_fn)(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y);
+
+// A stage of a pipeline.
+struct stage
+{
+    const char *name;
+    enum domain in, out;                         // What the input and output rows hold
+    int halo;                                    // Rows of blocks needed above and below, 0 for point-wise
+    stage_fn run;
+    const void *data;                            // Parameters of the stage
+    const void *code;                            // Compiled kernel of the stage, when run by stage_jit
+    int measures;                                // Only measures the rows it passes on, so a band
+                                                 // passes on those of its neighbours without it
+};
+
+// A pipeline of stages from Bayer rows to output rows, run over the
+// frame in bands of rows, each band by a single thread.
+struct pipeline
+{
+    const struct format *fmt;
+    struct stage stages[MAX_STAGES];
+    int count;
+    int band;                                    // Rows of blocks per band
+    int threads;
+};
+
+// The sums of the focus stage, for every row of blocks and column of
+// zones.
+struct focus_sums
+{
+    int columns;
+    double *sums;                                // FOCUS_SUMS per zone, row after row
+};
+
+// Levels of the normalization stage.
+struct levels
+{
+    float min, mult;
+};
+
+// Parameters of the 3D LUT stage: the LUT, and the levels of the
+// normalization ahead of it for the kernel fusing the two, NULL for
+// none.
+struct grading
+{
+    const struct lut *lut;
+    const struct levels *levels;
+};
+
+// An output of a fan-out.
+struct output
+{
+    char *name;                                  // File name, a printf pattern in streaming mode
+    int bin;                                     // Binning factor
+    int x, y, width, height;                     // Region of the frame, all of it when the width is 0
+    enum gray gray;                              // Grayscale instead of RGB
+    int plane;                                   // Save grayscale without the TGA header
+    uint8_t *image;                              // Buffer of the output
+    struct workspace workspace;                  // Memory reused by the conversions of the output
+};
+
+// The outputs of a frame, made in parallel.
+struct fan_out
+{
+    struct output *outputs;
+    uint16_t *buffer;
+    const struct format *fmt;
+    const struct norm *norm;                     // Prepared normalization shared by the outputs
+    const struct options *options;               // Processing of the frame
+    long frame;                                  // Frame number for the output names, -1 when not streaming
+};
+
+// The streams and the workers sharing them.
+struct pool
+{
+    struct stream *streams;
+    int count;
+    int verbose;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;                         // Signalled when a stream is released
+    size_t raw_size, rgb_size;                   // Buffer sizes fitting the largest stream
+};
+
+// A video wall, compositing synchronized streams into the tiles of a
+// single image.
+struct wall
+{
+    struct stream *streams;
+    int count;
+    int threads;
+    int columns, rows;                           // Tiles in the grid
+    int bin;                                     // Binning factor of the streams
+    int tile_width, tile_height;                 // Size of a tile, fitting the largest binned stream
+    int width, height;                           // Size of the whole image
+    size_t raw_size;                             // Buffer size fitting the largest stream
+    uint8_t *image;
+    pthread_barrier_t barrier;
+};
+
+// A worker of a video wall and the tiles it handles.
+struct wall_worker
+{
+    struct wall *wall;
+    int index;
+};
+
+// The event recording setup of a stream.
+struct trigger
+{
+    double pre;                                  // Seconds kept before a trigger
+    double post;                                 // Seconds converted after a trigger
+    double fps;                                  // Frame rate of the stream
+    size_t budget;                               // Max bytes held by the ring
+    char *file;                                  // A trigger file, deleted when seen
+    char *socket;                                // A UNIX datagram socket receiving triggers
+};
+
+// A losslessly compressed frame, in the ring or waiting for conversion.
+struct packed
+{
+    uint8_t *data;
+    size_t size;                                 // Bytes, the RG10 frame size when stored as is
+    unsigned long frame;                         // Frame number in the stream
+    struct packed *next;                         // Next in the conversion queue
+};
+
+// The pre-trigger ring and the conversion queue fed from it.
+struct ring
+{
+    struct stream *stream;
+    struct packed *frames;                       // Circular buffer of the frames before a trigger
+    int capacity, first, count;
+    size_t bytes;                                // Bytes held by the ring
+    struct packed *head, *tail;                  // Frames queued for conversion
+    size_t queued_bytes;                         // Bytes of the frames queued or being converted
+    size_t budget;                               // Max bytes of the ring and the queue together
+    int ended;                                   // Set when the input ended
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t freed;                        // Signaled when a converted frame is freed
+};
+
+enum layout                                      // Order of a tensor's dimensions
+{
+    LAYOUT_NCHW,
+    LAYOUT_NHWC
+};
+
+enum dtype                                       // Type of a tensor's elements
+{
+    DTYPE_F32,                                   // Floats, normalized by the mean and std
+    DTYPE_U8                                     // Bytes, as the 8 bit RGB values
+};
+
+INTERNAL const char *layout_names[] = {"nchw", "nhwc"};
+INTERNAL const char *dtype_names[] = {"f32", "u8"};
+
+// A model input tensor output, and the batch of a stream being filled.
+struct tensor
+{
+    int width, height;                           // Model input size
+    enum layout layout;
+    enum dtype dtype;
+    float mean[RGB_COLORS], std[RGB_COLORS];     // Per R, G and B, in 0-1 units
+    int pad;                                     // Letterbox color, 0-255
+    int batch;                                   // Frames per tensor file
+    int threads;
+    int count;                                   // Frames in the current batch
+    unsigned long index;                         // Number of the current batch
+    uint8_t *data;                               // The current batch
+};
+
+enum stack_mode                                  // How the frames of a stack are combined, sample by sample
+{
+    STACK_NONE,
+    STACK_MEAN,                                  // Their mean
+    STACK_CLIP,                                  // Their mean without the outliers, sigma std away from it
+    STACK_MEDIAN                                 // Their median
+};
+
+INTERNAL const char *stack_names[] = {"none", "mean", "clip", "median"};
+
+// A stack of frames from any number of files, combined a tile of rows of
+// blocks at a time.
+struct stack
+{
+    enum stack_mode mode;
+    float sigma;                                 // Outliers threshold, in std
+    int gains;                                   // Save the flat field gains of the result
+    const uint16_t *dark;                        // Subtracted from the result before its gains, NULL for none
+    size_t budget;                               // Memory of the tiles of all the threads
+    const struct format *fmt;
+    int count;                                   // Frames
+    int *fds;                                    // File of each frame
+    off_t *offsets;                              // and its offset in it
+    int rows;                                    // Rows of blocks per tile
+    uint16_t *result;
+};
+
+// A tensor conversion of a frame, split by output rows over threads.
+struct tensor_job
+{
+    const uint16_t *buffer;
+    const struct format *fmt;
+    const struct tensor *tensor;
+    void *out;                                   // The tensor of this frame in the batch
+    float min, mult;                             // Normalization of the frame
+    int left, top;                               // Letterbox offsets
+    int width, height;                           // Size of the frame in the tensor
+    int *x0;                                     // First frame column of every tensor column, and the end
+    int *y0;                                     // First frame row of every tensor row, and the end
+};
+
+INTERNAL volatile sig_atomic_t triggered;                 // Set by SIGUSR1
+// The tuning of the conversion for the host, from its profile or the
+// command line.
+INTERNAL struct tuning
+{
+    int band;                                    // Rows of blocks in a band of a pipeline
+    int threads;                                 // Threads converting a frame, 0 for a thread per core
+    int jit;                                     // Compile the fused kernels at run time
+} tuning = {BAND_ROWS, THREADS, USE_JIT};
+
+// The reconstruction of the clipped highlights of a normalized frame,
+// on the rows listed in its statistics.
+struct highlights
+{
+    const int *rows;                             // Rows of blocks holding clipped samples, in order
+    int count;
+    int top;                                     // Row of the frame of the first row converted
+    uint16_t clip;                               // Level of the clipped samples
+};
+
+// The resampling of the reds and blues of a frame correcting the lateral
+// CA: the block a red or blue of a block is taken from is, along the
+// rows and the columns alike, its index times the step plus the origin,
+// in LATERAL_FRACTION fixed point.
+struct lateral
+{
+    int32_t steps[2];                            // Red and blue
+    int32_t origins[2][2];                       // Red and blue, along the rows and the columns
+    int halo;                                    // Rows of blocks they're taken from on each side
+};
+
+// A 3D LUT grading the RGB images, from a .cube file. Every node holds
+// its 3 outputs next to each other, padded to 8 bytes, so each corner of
+// a cell is a single load, and adjacent pixels mostly share their cells.
+struct lut
+{
+    int size;                                    // Nodes along each axis
+    uint16_t (*nodes)[4];                        // R, G and B of the nodes, red along the rows, then green and blue
+    int32_t cells[RGB_COLORS][MAX_RG10 + 1];     // First node of the cell of each value along each axis, shifted
+                                                 // by LUT_CELL, and the value's position in it, 0 to LUT_ONE
+};
+
+INTERNAL const struct options no_options;        // Options processing nothing, for none given
+
+// The SIMD kernels compiled for an instruction set, from kernels.h.
+struct simd
+{
+    const char *name;
+    void (*min_max)(const uint16_t *buffer, const struct format *fmt, unsigned int colors, uint16_t *min, uint16_t *max,
+                    uint32_t *sums, uint32_t *bins, uint16_t clip, uint32_t *clipped);
+    void (*normalize)(const uint16_t *src, uint16_t *dst, int count, float min, float mult);
+    void (*calibrate)(const uint16_t *src, uint16_t *dst, const uint16_t *dark, const uint16_t *gain, int count);
+    void (*denoise)(const uint16_t *const *rows, uint16_t *out, int width, int threshold);
+    void (*lateral)(const uint16_t *const *rows, uint16_t *out, const struct format *fmt, const struct lateral *lateral,
+                    int y);
+    void (*chroma_planes)(const uint16_t *src, uint16_t *dst, const struct format *fmt, const struct levels *levels);
+    void (*chroma)(const uint16_t *const *rows, uint16_t *out, uint8_t *packed, int width);
+    void (*gray)(const uint16_t *top, const uint16_t *bottom, uint8_t *out, int width, const float *weights, float offset);
+    void (*focus)(const uint16_t *const *rows, const struct format *fmt, int columns, double *sums);
+    void (*demosaic_pack)(const uint16_t *src, uint8_t *dst, const struct format *fmt, const struct levels *levels);
+    void (*lut)(const uint16_t *src, uint8_t *dst, const struct format *fmt, const struct levels *levels,
+                const struct lut *lut);
+    void (*unpack)(const uint8_t *src, uint16_t *dst, size_t count);
+};
+
+// Set up the format of the given geometry and pattern.
+void set_format(struct format *fmt, int width, int height, enum pattern pattern)
+{
+    const int *position = pattern_positions[pattern];
+    int *location[RG10_COLORS] = {&fmt->r, &fmt->gr, &fmt->gb, &fmt->b};
+
+    fmt->width = width;
+    fmt->height = height;
+    fmt->stride = width;
+    fmt->x = fmt->y = 0;
+    fmt->frame_height = height;
+    fmt->pattern = pattern;
+    for(int color = 0; color < RG10_COLORS; color++)
+        *location[color] = (position[color] & 1) + (position[color] >> 1)*width*RG10_COLOR_SIZE;
+}
+
+// The tables of normalizing to the built in levels and of packing to 8
+// bits, filled by the compiler, so a run with -n fixed doesn't compute
+// anything but the frame.
+INTERNAL const struct levels fixed_levels = {LEVELS_MIN, FIXED_MULT};
+INTERNAL const uint16_t fixed_table[MAX_RG10 + 1] = {TABLE1024(FIXED_NORM)};
+INTERNAL const uint8_t pack_table[MAX_RG10 + 1] = {TABLE1024(PACK)};
+
+// Demosaic a row of blocks and pack it to 8 bits, normalizing it first
+// when given the levels.
+INTERNAL void demosaic_pack_row(const uint16_t *src, uint8_t *dst, const struct format *fmt,
+                                const struct levels *levels)
+{
+    if(!levels)
+    {
+        for(int x = 0; x < fmt->width; x++)
+        {
+            dst[RGB_LOCATION(x, 0, 0, RGB_R)] = NORM(src[RG10_LOCATION(x, 0, 0, fmt->r)]);
+            dst[RGB_LOCATION(x, 0, 0, RGB_B)] = NORM(src[RG10_LOCATION(x, 0, 0, fmt->b)]);
+            dst[RGB_LOCATION(x, 0, 0, RGB_G)] = NORM((src[RG10_LOCATION(x, 0, 0, fmt->gb)] + src[RG10_LOCATION(x, 0, 0, fmt->gr)]) / 2);
+        }
+        return;
+    }
+    if(levels == &fixed_levels)
+    {
+        const int locations[RG10_COLORS] = {fmt->r, fmt->gr, fmt->gb, fmt->b};
+        for(int x = 0; x < fmt->width; x++)
+        {
+            uint16_t colors[RG10_COLORS];
+            for(int color = 0; color < RG10_COLORS; color++)
+            {
+                uint16_t value = src[RG10_LOCATION(x, 0, 0, locations[color])];
+                colors[color] = fixed_table[value > MAX_RG10 ? MAX_RG10 : value];
+            }
+            dst[RGB_LOCATION(x, 0, 0, RGB_R)] = pack_table[colors[0]];
+            dst[RGB_LOCATION(x, 0, 0, RGB_B)] = pack_table[colors[3]];
+            dst[RGB_LOCATION(x, 0, 0, RGB_G)] = pack_table[(colors[1] + colors[2]) / 2];
+        }
+        return;
+    }
+    for(int x = 0; x < fmt->width; x++)
+    {
+        uint16_t colors[RG10_COLORS];
+        const int locations[RG10_COLORS] = {fmt->r, fmt->gr, fmt->gb, fmt->b};
+        for(int color = 0; color < RG10_COLORS; color++)
+        {
+            int normalized = ROUND_CLIP((src[RG10_LOCATION(x, 0, 0, locations[color])] - levels->min) * levels->mult);
+            colors[color] = normalized > MAX_RG10 ? MAX_RG10 : normalized;
+        }
+        dst[RGB_LOCATION(x, 0, 0, RGB_R)] = pack_table[colors[0]];
+        dst[RGB_LOCATION(x, 0, 0, RGB_B)] = pack_table[colors[3]];
+        dst[RGB_LOCATION(x, 0, 0, RGB_G)] = pack_table[(colors[1] + colors[2]) / 2];
+    }
+}
+
+// The 10 bit colors of a pixel of a row of blocks, normalized first like
+// demosaic_pack_row when given the levels, and clipped for the 3D LUT.
+static inline void demosaic_pixel(const uint16_t *src, int x, const struct format *fmt, const struct levels *levels,
+                                  int *rgb)
+{
+    const int locations[RG10_COLORS] = {fmt->r, fmt->gr, fmt->gb, fmt->b};
+    int colors[RG10_COLORS];
+
+    for(int color = 0; color < RG10_COLORS; color++)
+    {
+        int value = src[RG10_LOCATION(x, 0, 0, locations[color])];
+        if(levels == &fixed_levels)
+            value = fixed_table[value > MAX_RG10 ? MAX_RG10 : value];
+        else if(levels)
+            value = ROUND_CLIP((value - levels->min) * levels->mult);
+        colors[color] = value > MAX_RG10 ? MAX_RG10 : value;
+    }
+    rgb[RGB_R] = colors[0];
+    rgb[RGB_G] = (colors[1] + colors[2]) / 2;
+    rgb[RGB_B] = colors[3];
+}
+
+// Grade a pixel of 10 bit colors with the 3D LUT into the 8 bits output,
+// by tetrahedral interpolation in fixed point. Of the 6 tetrahedra of
+// its cell, sharing its first and last corners, the pixel's is the one
+// along the axes in the order of its positions in the cell, and its
+// corners are weighted by the differences of those.
+static inline void lut_pixel(const struct lut *lut, const int *rgb, uint8_t *dst)
+{
+    const int n = lut->size, mask = (1 << LUT_CELL) - 1;
+    const int r = lut->cells[RGB_R][rgb[RGB_R]], g = lut->cells[RGB_G][rgb[RGB_G]], b = lut->cells[RGB_B][rgb[RGB_B]];
+    const int fr = r & mask, fg = g & mask, fb = b & mask;
+    const int base = (r >> LUT_CELL) + (g >> LUT_CELL) + (b >> LUT_CELL);
+    const int rg = fr >= fg, gb = fg >= fb, rb = fr >= fb;
+
+    // The axes of the largest and the smallest positions
+    const int first = rg && rb ? 1 : !rg && gb ? n : n*n;
+    const int last = rb && gb ? n*n : rg && !gb ? n : 1;
+    const int high = fr > fg ? (fr > fb ? fr : fb) : (fg > fb ? fg : fb);
+    const int low = fr < fg ? (fr < fb ? fr : fb) : (fg < fb ? fg : fb);
+    const int middle = fr + fg + fb - high - low;
+    const int corners[4] = {base, base + first, base + 1 + n + n*n - last, base + 1 + n + n*n};
+    const int weights[4] = {LUT_ONE - high, high - middle, middle - low, low};
+    const int outputs[RGB_COLORS] = {RGB_R, RGB_G, RGB_B};
+
+    for(int c = 0; c < RGB_COLORS; c++)
+    {
+        int sum = 1 << (LUT_FRACTION + LUT_BITS - 1);
+        for(int k = 0; k < 4; k++)
+            sum += weights[k]*lut->nodes[corners[k]][c];
+        dst[outputs[c]] = sum >> (LUT_FRACTION + LUT_BITS);
+    }
+}
+
+// Unpack count samples of packed RAW10, where every 5 bytes hold the high
+// 8 bits of 4 samples and then their low 2 bits, the first sample's in
+// the lowest bits. The source may end where the samples end, so each
+// group is read before it's written.
+INTERNAL void unpack_raw10(const uint8_t *src, uint16_t *dst, size_t count)
+{
+    for(size_t i = 0; i < count; i += 4, src += 5)
+    {
+        uint8_t group[5];
+        memcpy(group, src, sizeof(group));
+        for(int k = 0; k < 4; k++)
+            dst[i+k] = group[k] << 2 | (group[4] >> 2*k & 3);
+    }
+}
+
+// The SIMD kernels, compiled once for every instruction set: the
+// vector width of the compiler's target, and on x86-64 AVX2 and AVX-512.
+// Contracting to FMA is off, since it would round differently from the
+// plain C code.
+#define SIMD(NAME)      NAME##_base
+#define SIMD_NAME       "base"
+#define SIMD_BYTES      (16)
+#include "simd.h"
+#include "kernels.h"
+#undef SIMD
+#undef SIMD_NAME
+#undef SIMD_BYTES
+
+#ifdef __x86_64__
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC target("avx2")
+#define SIMD(NAME)      NAME##_avx2
+#define SIMD_NAME       "avx2"
+#define SIMD_BYTES      (32)
+#include "simd.h"
+#include "kernels.h"
+#undef SIMD
+#undef SIMD_NAME
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#pragma GCC target("avx512bw")
+#define SIMD(NAME)      NAME##_avx512
+#define SIMD_NAME       "avx512"
+#define SIMD_BYTES      (64)
+#include "simd.h"
+#include "kernels.h"
+#undef SIMD
+#undef SIMD_NAME
+#undef SIMD_BYTES
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512vbmi,avx512bw")
+// Normalize 16 colors in 32 bit lanes, the same as demosaic_pack_row.
+static inline __m512i normalize_vbmi(__m512i v, const struct levels *levels)
+{
+    __m512 x = _mm512_mul_ps(_mm512_sub_ps(_mm512_cvtepi32_ps(v), _mm512_set1_ps(levels->min)),
+                             _mm512_set1_ps(levels->mult));
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-1)), _mm512_set1_ps(MAX_RG10 + 1));
+    __m512 rounded = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512i n = _mm512_cvtps_epi32(rounded);
+
+    // ROUND_CLIP rounds halves up, and not to even
+    __mmask16 tie = _mm512_cmp_ps_mask(_mm512_sub_ps(x, rounded), _mm512_set1_ps(0.5f), _CMP_EQ_OQ);
+    n = _mm512_mask_add_epi32(n, tie, n, _mm512_set1_epi32(1));
+    return _mm512_min_epi32(_mm512_max_epi32(n, _mm512_setzero_si512()), _mm512_set1_epi32(MAX_RG10));
+}
+
+// Pack 16 colors in 32 bit lanes to 8 bits, the same as NORM.
+static inline __m512i pack_vbmi(__m512i v)
+{
+    return _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(v), _mm512_set1_ps((float)MAX_RGB/MAX_RG10)));
+}
+
+// Demosaic a row of blocks and pack it to 8 bits like demosaic_pack_row,
+// 16 blocks at a time. Two byte permutes across the whole register
+// interleave the low bytes of the B, G and R lanes into 48 bytes of BGR
+// pixels, and the row's tail is loaded and stored with masks.
+INTERNAL void demosaic_pack_vbmi(const uint16_t *src, uint8_t *dst, const struct format *fmt,
+                                 const struct levels *levels)
+{
+    const uint16_t *rows[2] = {src, src + fmt->stride*RG10_COLOR_SIZE};
+    const int *position = pattern_positions[fmt->pattern];
+    uint8_t first[64], second[64];
+
+    // B and G to bytes 0 and 1 of each pixel, then R to byte 2
+    for(int i = 0; i < 64; i++)
+    {
+        int pixel = i / RGB_COLORS < 16 ? i / RGB_COLORS : 0;
+        first[i] = (i % RGB_COLORS == RGB_G ? 64 : 0) + pixel*4;
+        second[i] = i % RGB_COLORS == RGB_R ? 64 + pixel*4 : i;
+    }
+    const __m512i bg = _mm512_loadu_si512(first), bgr = _mm512_loadu_si512(second);
+    const __m512i low = _mm512_set1_epi32(0xffff);
+
+    for(int x = 0; x < fmt->width; x += 16)
+    {
+        int blocks = fmt->width - x < 16 ? fmt->width - x : 16;
+        __m512i samples[RG10_COLORS], colors[RG10_COLORS];
+        for(int row = 0; row < 2; row++)
+        {
+            __m512i v = _mm512_maskz_loadu_epi16((__mmask32)((1ull << 2*blocks) - 1), rows[row] + 2*x);
+            samples[row*2] = _mm512_and_si512(v, low);
+            samples[row*2 + 1] = _mm512_srli_epi32(v, 16);
+        }
+        for(int color = 0; color < RG10_COLORS; color++)
+            colors[color] = levels ? normalize_vbmi(samples[position[color]], levels) : samples[position[color]];
+
+        __m512i r = pack_vbmi(colors[0]);
+        __m512i g = pack_vbmi(_mm512_srli_epi32(_mm512_add_epi32(colors[1], colors[2]), 1));
+        __m512i b = pack_vbmi(colors[3]);
+        __m512i pixels = _mm512_permutex2var_epi8(_mm512_permutex2var_epi8(b, bg, g), bgr, r);
+        _mm512_mask_storeu_epi8(dst + x*RGB_COLORS, (__mmask64)((1ull << blocks*RGB_COLORS) - 1), pixels);
+    }
+}
+
+// Pack 16 pixels of 10 bit colors, the B, G and R lanes of the 16 bit
+// halves, to 48 bytes of BGR with the byte permutes of demosaic_pack_vbmi.
+static inline void pack_pixels_vbmi(uint8_t *dst, __m256i r, __m256i g, __m256i b, __m512i bg, __m512i bgr)
+{
+    __m512i pixels = _mm512_permutex2var_epi8(_mm512_permutex2var_epi8(pack_vbmi(_mm512_cvtepu16_epi32(b)), bg,
+                                                                       pack_vbmi(_mm512_cvtepu16_epi32(g))),
+                                              bgr, pack_vbmi(_mm512_cvtepu16_epi32(r)));
+    _mm512_mask_storeu_epi8(dst, (__mmask64)((1ull << 16*RGB_COLORS) - 1), pixels);
+}
+
+// Suppress the false colors of a row like chroma_kernel, with its
+// medians, packing the pixels to 8 bits by the byte permutes of
+// demosaic_pack_vbmi, 32 at a time. The RGB pixels are written by the
+// AVX-512 kernel.
+INTERNAL void chroma_vbmi(const uint16_t *const *rows, uint16_t *out, uint8_t *packed, int width)
+{
+    const uint16_t *reds[3] = {rows[0] + width, rows[1] + width, rows[2] + width};
+    const uint16_t *blues[3] = {rows[0] + 2*width, rows[1] + 2*width, rows[2] + 2*width};
+    uint8_t first[64], second[64];
+
+    if(!packed || width < 32 + 2)
+    {
+        chroma_kernel_avx512(rows, out, packed, width);
+        return;
+    }
+    for(int i = 0; i < 64; i++)
+    {
+        int pixel = i / RGB_COLORS < 16 ? i / RGB_COLORS : 0;
+        first[i] = (i % RGB_COLORS == RGB_G ? 64 : 0) + pixel*4;
+        second[i] = i % RGB_COLORS == RGB_R ? 64 + pixel*4 : i;
+    }
+    const __m512i bg = _mm512_loadu_si512(first), bgr = _mm512_loadu_si512(second);
+    const __m512i max = _mm512_set1_epi16(MAX_RG10);
+
+    chroma_pixel_avx512(out, packed, rows[1], reds, blues, 0, width);
+    for(int x = 1; x < width - 1; x += 32)
+    {
+        if(x + 32 > width - 1)
+            x = width - 1 - 32;                  // The last vector overlapping the one before
+        __m512i g = _mm512_loadu_si512(rows[1] + x);
+        __m512i r = _mm512_add_epi16(g, (__m512i)chroma_medians_avx512(reds, x));
+        __m512i b = _mm512_add_epi16(g, (__m512i)chroma_medians_avx512(blues, x));
+        r = _mm512_min_epu16(_mm512_sub_epi16(_mm512_max_epu16(r, max), max), max);
+        b = _mm512_min_epu16(_mm512_sub_epi16(_mm512_max_epu16(b, max), max), max);
+        pack_pixels_vbmi(packed + x*RGB_COLORS, _mm512_castsi512_si256(r), _mm512_castsi512_si256(g),
+                         _mm512_castsi512_si256(b), bg, bgr);
+        pack_pixels_vbmi(packed + (x + 16)*RGB_COLORS, _mm512_extracti64x4_epi64(r, 1),
+                         _mm512_extracti64x4_epi64(g, 1), _mm512_extracti64x4_epi64(b, 1), bg, bgr);
+    }
+    chroma_pixel_avx512(out, packed, rows[1], reds, blues, width - 1, width);
+}
+
+// Demosaic a row of blocks and grade it with the 3D LUT like lut_kernel,
+// 16 blocks at a time. The cells of the colors and the corners of their
+// tetrahedra are gathered, the red and green of a node in one 32 bit
+// gather and its blue in another, and the outputs are interleaved into
+// BGR pixels by the byte permutes of demosaic_pack_vbmi.
+INTERNAL void lut_vbmi(const uint16_t *src, uint8_t *dst, const struct format *fmt, const struct levels *levels,
+                       const struct lut *lut)
+{
+    const uint16_t *rows[2] = {src, src + fmt->stride*RG10_COLOR_SIZE};
+    const int *position = pattern_positions[fmt->pattern];
+    const int n = lut->size;
+    uint8_t first[64], second[64];
+
+    for(int i = 0; i < 64; i++)
+    {
+        int pixel = i / RGB_COLORS < 16 ? i / RGB_COLORS : 0;
+        first[i] = (i % RGB_COLORS == RGB_G ? 64 : 0) + pixel*4;
+        second[i] = i % RGB_COLORS == RGB_R ? 64 + pixel*4 : i;
+    }
+    const __m512i bg = _mm512_loadu_si512(first), bgr = _mm512_loadu_si512(second);
+    const __m512i low = _mm512_set1_epi32(0xffff), cell = _mm512_set1_epi32((1 << LUT_CELL) - 1);
+    const __m512i one = _mm512_set1_epi32(1), row = _mm512_set1_epi32(n), plane = _mm512_set1_epi32(n*n);
+
+    for(int x = 0; x < fmt->width; x += 16)
+    {
+        int blocks = fmt->width - x < 16 ? fmt->width - x : 16;
+        __m512i samples[RG10_COLORS], colors[RG10_COLORS];
+        for(int r = 0; r < 2; r++)
+        {
+            __m512i v = _mm512_maskz_loadu_epi16((__mmask32)((1ull << 2*blocks) - 1), rows[r] + 2*x);
+            samples[r*2] = _mm512_and_si512(v, low);
+            samples[r*2 + 1] = _mm512_srli_epi32(v, 16);
+        }
+        for(int color = 0; color < RG10_COLORS; color++)
+        {
+            colors[color] = samples[position[color]];
+            if(levels == &fixed_levels || !levels)      // Clipped before the table of the fixed levels
+                colors[color] = _mm512_min_epi32(colors[color], _mm512_set1_epi32(MAX_RG10));
+            if(levels)
+                colors[color] = normalize_vbmi(colors[color], levels);
+        }
+
+        __m512i r = _mm512_i32gather_epi32(colors[0], lut->cells[RGB_R], 4);
+        __m512i g = _mm512_i32gather_epi32(_mm512_srli_epi32(_mm512_add_epi32(colors[1], colors[2]), 1),
+                                           lut->cells[RGB_G], 4);
+        __m512i b = _mm512_i32gather_epi32(colors[3], lut->cells[RGB_B], 4);
+        __m512i fr = _mm512_and_si512(r, cell), fg = _mm512_and_si512(g, cell), fb = _mm512_and_si512(b, cell);
+        __m512i base = _mm512_add_epi32(_mm512_add_epi32(_mm512_srli_epi32(r, LUT_CELL), _mm512_srli_epi32(g, LUT_CELL)),
+                                        _mm512_srli_epi32(b, LUT_CELL));
+
+        // The axes of the largest and the smallest positions, as in lut_pixel
+        __mmask16 rg = _mm512_cmpge_epi32_mask(fr, fg), gb = _mm512_cmpge_epi32_mask(fg, fb);
+        __mmask16 rb = _mm512_cmpge_epi32_mask(fr, fb);
+        __m512i along = _mm512_mask_mov_epi32(_mm512_mask_mov_epi32(plane, ~rg & gb, row), rg & rb, one);
+        __m512i across = _mm512_mask_mov_epi32(_mm512_mask_mov_epi32(one, rg & ~gb, row), rb & gb, plane);
+        __m512i high = _mm512_max_epi32(_mm512_max_epi32(fr, fg), fb), least = _mm512_min_epi32(_mm512_min_epi32(fr, fg), fb);
+        __m512i middle = _mm512_sub_epi32(_mm512_add_epi32(_mm512_add_epi32(fr, fg), fb), _mm512_add_epi32(high, least));
+        __m512i opposite = _mm512_add_epi32(base, _mm512_set1_epi32(1 + n + n*n));
+        __m512i corners[4] = {base, _mm512_add_epi32(base, along), _mm512_sub_epi32(opposite, across), opposite};
+        __m512i weights[4] = {_mm512_sub_epi32(_mm512_set1_epi32(LUT_ONE), high), _mm512_sub_epi32(high, middle),
+                              _mm512_sub_epi32(middle, least), least};
+
+        __m512i sums[3];
+        for(int c = 0; c < 3; c++)
+            sums[c] = _mm512_set1_epi32(1 << (LUT_FRACTION + LUT_BITS - 1));
+        for(int corner = 0; corner < 4; corner++)
+        {
+            __m512i red_green = _mm512_i32gather_epi32(corners[corner], lut->nodes, sizeof(*lut->nodes));
+            __m512i blue = _mm512_i32gather_epi32(corners[corner], lut->nodes[0] + 2, sizeof(*lut->nodes));
+            sums[0] = _mm512_add_epi32(sums[0], _mm512_mullo_epi32(weights[corner], _mm512_and_si512(red_green, low)));
+            sums[1] = _mm512_add_epi32(sums[1], _mm512_mullo_epi32(weights[corner], _mm512_srli_epi32(red_green, 16)));
+            sums[2] = _mm512_add_epi32(sums[2], _mm512_mullo_epi32(weights[corner], _mm512_and_si512(blue, low)));
+        }
+        for(int c = 0; c < 3; c++)
+            sums[c] = _mm512_srli_epi32(sums[c], LUT_FRACTION + LUT_BITS);
+        __m512i pixels = _mm512_permutex2var_epi8(_mm512_permutex2var_epi8(sums[2], bg, sums[1]), bgr, sums[0]);
+        _mm512_mask_storeu_epi8(dst + x*RGB_COLORS, (__mmask64)((1ull << blocks*RGB_COLORS) - 1), pixels);
+    }
+}
+
+// Unpack count samples of packed RAW10 like unpack_raw10, 32 at a time:
+// a byte permute places the high bits and the low bits byte of every
+// sample in its 16 bit lane, and a variable shift picks its low bits.
+// The tail is loaded and stored with masks.
+INTERNAL void unpack_vbmi(const uint8_t *src, uint16_t *dst, size_t count)
+{
+    uint8_t spread[64];
+    uint16_t shifts[32];
+
+    for(int i = 0; i < 32; i++)
+    {
+        spread[2*i] = i/4*5 + 4;
+        spread[2*i + 1] = i/4*5 + i%4;
+        shifts[i] = i%4*2;
+    }
+    const __m512i bytes = _mm512_loadu_si512(spread), shift = _mm512_loadu_si512(shifts);
+
+    for(size_t i = 0; i < count; i += 32)
+    {
+        size_t n = count - i < 32 ? count - i : 32;
+        __m512i packed = _mm512_maskz_loadu_epi8((__mmask64)((1ull << n*5/4) - 1), src + i*5/4);
+        __m512i v = _mm512_permutexvar_epi8(bytes, packed);
+        __m512i high = _mm512_and_si512(_mm512_srli_epi16(v, 6), _mm512_set1_epi16(0x3fc));
+        __m512i low = _mm512_and_si512(_mm512_srlv_epi16(v, shift), _mm512_set1_epi16(3));
+        _mm512_mask_storeu_epi16(dst + i, (__mmask32)((1ull << n) - 1), _mm512_or_si512(high, low));
+    }
+}
+#pragma GCC pop_options
+
+// The AVX-512 kernels, with the VBMI byte permutes for the stages that
+// have them.
+INTERNAL const struct simd simd_vbmi =
+{
+    "avx512vbmi",
+    min_max_kernel_avx512,
+    normalize_kernel_avx512,
+    calibrate_kernel_avx512,
+    denoise_kernel_avx512,
+    lateral_kernel_avx512,
+    chroma_planes_kernel_avx512,
+    chroma_vbmi,
+    gray_kernel_avx512,
+    focus_kernel_avx512,
+    demosaic_pack_vbmi,
+    lut_vbmi,
+    unpack_vbmi
+};
+#endif
+
+INTERNAL const struct simd *simd_selected;
+INTERNAL pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+// Pick the kernels of the widest instruction set the CPU supports.
+INTERNAL void select_simd(void)
+{
+    simd_selected = &simd_base;
+#ifdef __x86_64__
+    if(__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+        simd_selected = &simd_vbmi;
+    else if(__builtin_cpu_supports("avx512bw"))
+        simd_selected = &simd_avx512;
+    else if(__builtin_cpu_supports("avx2"))
+        simd_selected = &simd_avx2;
+#endif
+}
+
+// The SIMD kernels to run.
+INTERNAL const struct simd *simd(void)
+{
+#ifdef SIMD_KERNELS
+    return &SIMD_KERNELS;                        // Built in, e.g. -DSIMD_KERNELS=simd_avx2
+#else
+    pthread_once(&simd_once, select_simd);
+    return simd_selected;
+#endif
+}
+
+// Monotonic time in seconds.
+INTERNAL double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read a single frame from an open file. Returns 0 at the end of the
+// input, when there isn't a complete frame left.
+int read_frame(FILE *file, uint16_t *buff, const struct format *fmt)
+{
+    size_t size = RG10_SIZE(fmt->width, fmt->height);
+
+    if(fmt->packed)
+    {
+        // Read to the end of the buffer and unpack in place, the samples
+        // are always written behind the bytes still to be read
+        size_t packed = RAW10_SIZE(fmt->width, fmt->height);
+        uint8_t *src = (uint8_t *)buff + size - packed;
+        if(fread(src, 1, packed, file) != packed)
+            return 0;
+        simd()->unpack(src, buff, size / sizeof(uint16_t));
+        return 1;
+    }
+    return fread(buff, 1, size, file) == size;
+}
+
+// Read the file from disk. Doesn't check the file size, using
+// the frame size of the format, e.g. 1920x1080x2x4=16,588,800 bytes.
+INTERNAL uint16_t *read_file(char *name, const struct format *fmt)
+{
+    FILE *file;
+    uint16_t *buff;
+
+    buff = (uint16_t *)malloc(RG10_SIZE(fmt->width, fmt->height));
+
+    file = fopen(name, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open file %s for reading.\n", name);
+        exit(-1);
+    }
+    read_frame(file, buff, fmt);
+    fclose(file);
+    return buff;
+}
+
+// Write an RGB image with a simple TGA header to an open file. Returns
+// 0 when it couldn't be written completely.
+int put_tga(FILE *file, const uint8_t *buff, int width, int height)
+{
+    unsigned char tga_header[18] = {0};
+
+    tga_header[2] = 2;
+    tga_header[12] = 255 & width;
+    tga_header[13] = 255 & (width >> 8);
+    tga_header[14] = 255 & height;
+    tga_header[15] = 255 & (height >> 8);
+    tga_header[16] = 24;
+    tga_header[17] = 32;
+
+    return fwrite(tga_header, sizeof(tga_header), 1, file) == 1 &&
+           fwrite(buff, 1, RGB_SIZE(width, height), file) == (size_t)RGB_SIZE(width, height);
+}
+
+// Map a master calibration frame of the format from its file, read only,
+// so it's paged in on first use and shared by all the threads.
+INTERNAL const uint16_t *map_frame(char *name, const struct format *fmt)
+{
+    struct stat st;
+    void *frame;
+    int fd = open(name, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Unable to open file %s for reading.\n", name);
+        exit(-1);
+    }
+    if(st.st_size != RG10_SIZE(fmt->width, fmt->height))
+    {
+        fprintf(stderr, "%s isn't a %dx%d frame.\n", name, fmt->width, fmt->height);
+        exit(-1);
+    }
+    frame = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(frame == MAP_FAILED)
+    {
+        fprintf(stderr, "Unable to map file %s.\n", name);
+        exit(-1);
+    }
+    return frame;
+}
+
+// Parse a 3D LUT from a .cube file: its LUT_3D_SIZE, the DOMAIN_MIN and
+// DOMAIN_MAX (or LUT_3D_INPUT_RANGE) of its inputs if not 0 and 1, and
+// the R G B outputs of its
+// nodes, from 0 to 1, red changing fastest. The 10 bit colors are mapped
+// to their cells along each axis once, by the domain. Returns 0 when
+// it isn't a 3D LUT of up to LUT_MAX nodes per axis.
+INTERNAL int parse_lut(FILE *file, struct lut *lut)
+{
+    char line[1024];
+    float low[RGB_COLORS] = {0, 0, 0}, high[RGB_COLORS] = {1, 1, 1};
+    const int inputs[RGB_COLORS] = {RGB_R, RGB_G, RGB_B};
+    int count = 0, nodes = 0;
+
+    lut->size = 0;
+    lut->nodes = NULL;
+    while(fgets(line, sizeof(line), file))
+    {
+        float r, g, b;
+        if(sscanf(line, "LUT_3D_SIZE %d", &lut->size) == 1)
+        {
+            if(lut->size < 2 || lut->size > LUT_MAX || nodes)
+                break;
+            nodes = lut->size*lut->size*lut->size;
+            if(!(lut->nodes = malloc(nodes*sizeof(*lut->nodes))))
+                return 0;
+        }
+        else if(sscanf(line, "DOMAIN_MIN %f %f %f", &low[0], &low[1], &low[2]) == 3 ||
+                sscanf(line, "DOMAIN_MAX %f %f %f", &high[0], &high[1], &high[2]) == 3)
+            continue;
+        else if(sscanf(line, "LUT_3D_INPUT_RANGE %f %f", &r, &g) == 2)
+        {
+            low[0] = low[1] = low[2] = r;
+            high[0] = high[1] = high[2] = g;
+        }
+        else if(sscanf(line, "%f %f %f", &r, &g, &b) == 3)
+        {
+            const float outputs[RGB_COLORS] = {r, g, b};
+            if(count == nodes)
+                break;
+            for(int c = 0; c < RGB_COLORS; c++)
+            {
+                float value = outputs[c] < 0 ? 0 : outputs[c] > 1 ? 1 : outputs[c];
+                lut->nodes[count][c] = lrintf(value*MAX_RGB*(1 << LUT_BITS));
+            }
+            lut->nodes[count++][3] = 0;
+        }
+    }
+    if(!nodes || count != nodes || high[0] <= low[0] || high[1] <= low[1] || high[2] <= low[2])
+    {
+        free(lut->nodes);
+        return 0;
+    }
+
+    const int strides[RGB_COLORS] = {1, lut->size, lut->size*lut->size};
+    for(int c = 0; c < RGB_COLORS; c++)
+        for(int value = 0; value <= MAX_RG10; value++)
+        {
+            double position = ((double)value/MAX_RG10 - low[c]) / (high[c] - low[c]);
+            position = (position < 0 ? 0 : position > 1 ? 1 : position)*(lut->size - 1);
+            int cell = position < lut->size - 1 ? (int)position : lut->size - 2;
+            lut->cells[inputs[c]][value] = cell*strides[c] << LUT_CELL | lrint((position - cell)*LUT_ONE);
+        }
+    return 1;
+}
+
+// Read a 3D LUT from a .cube file. Returns NULL when it can't be read,
+// or isn't a 3D LUT of up to LUT_MAX nodes per axis.
+struct lut *read_lut(const char *name)
+{
+    FILE *file = fopen(name, "r");
+    struct lut *lut = file ? malloc(sizeof(struct lut)) : NULL;
+
+    if(lut && !parse_lut(file, lut))
+    {
+        free(lut);
+        lut = NULL;
+    }
+    if(file)
+        fclose(file);
+    return lut;
+}
+
+// Free a 3D LUT of read_lut().
+void free_lut(struct lut *lut)
+{
+    if(lut)
+        free(lut->nodes);
+    free(lut);
+}
+
+// The resampling correcting the lateral CA of a lens on a frame, or on a
+// region of it with the optical center still that of the whole frame,
+// with the rows it needs around each row of blocks, as many as the
+// largest shift of a red or blue along the columns. A halo of 0 when
+// there's no lens profile, and over MAX_HALO when the shifts are larger
+// than a stage can reach.
+INTERNAL struct lateral lateral_resampling(const struct lens *lens, const struct format *fmt)
+{
+    const double center[2] = {lens->center[0]*(fmt->stride - 1), lens->center[1]*(fmt->frame_height - 1)};
+    const double reach = fmax(fabs(center[1] - fmt->y), fabs(fmt->y + fmt->height - 1 - center[1]));
+    struct lateral lateral = {{0}, {{0}}, 0};
+
+    if(!lens->scales[0])
+        return lateral;
+    for(int c = 0; c < 2; c++)
+    {
+        const double scale = lens->scales[c];
+        const int halo = (int)ceil(fabs(scale - 1)*reach) + 1;
+        lateral.steps[c] = lrint(scale*(1 << LATERAL_FRACTION));
+        // Of the frame, moved to the region exactly so it's resampled alike
+        lateral.origins[c][0] = lrint(center[0]*(1 - scale)*(1 << LATERAL_FRACTION)) +
+                                fmt->x*(lateral.steps[c] - (1 << LATERAL_FRACTION));
+        lateral.origins[c][1] = lrint(center[1]*(1 - scale)*(1 << LATERAL_FRACTION)) +
+                                fmt->y*(lateral.steps[c] - (1 << LATERAL_FRACTION));
+        if(lateral.halo < halo)
+            lateral.halo = halo;
+    }
+    return lateral;
+}
+
+// Parse the lateral chromatic aberration of a lens from a lens profile,
+// of the lens named, or of its first one when not. Lines of the profile
+// are key=value: lens=NAME starts the parameters of a lens, red=SCALE
+// and blue=SCALE are the sizes of its red and blue images relative to
+// the green one, e.g. 1.0006 for a red image 0.06% larger, and the
+// optional center=X,Y is its optical center in fractions of the frame.
+// The keys it doesn't know are skipped. Returns 0 when there's no such
+// lens with scales within LENS_SCALE_MAX of 1.
+INTERNAL int parse_lens(FILE *file, const char *model, struct lens *lens)
+{
+    char line[256], found[64];
+    int selected = 0, lenses = 0;
+
+    lens->scales[0] = lens->scales[1] = 0;
+    lens->center[0] = lens->center[1] = 0.5;
+    while(fgets(line, sizeof(line), file))
+    {
+        float x, y;
+        if(sscanf(line, "lens=%63s", found) == 1)
+        {
+            lenses++;
+            selected = model ? !strcmp(found, model) : lenses == 1;
+        }
+        else if(!selected && (lenses || model))
+            continue;
+        else if(sscanf(line, "red=%f", &x) == 1)
+            lens->scales[0] = x;
+        else if(sscanf(line, "blue=%f", &x) == 1)
+            lens->scales[1] = x;
+        else if(sscanf(line, "center=%f,%f", &x, &y) == 2)
+        {
+            lens->center[0] = x;
+            lens->center[1] = y;
+        }
+    }
+    for(int c = 0; c < 2; c++)
+        if(fabsf(lens->scales[c] - 1) > LENS_SCALE_MAX || lens->center[c] < 0 || lens->center[c] > 1)
+            return 0;
+    return 1;
+}
+
+// Read the lateral chromatic aberration of a lens from a lens profile.
+// Returns 0 when it can't be read, or has no such lens.
+int read_lens(const char *name, const char *model, struct lens *lens)
+{
+    FILE *file = fopen(name, "r");
+    int found = file && parse_lens(file, model, lens);
+
+    if(file)
+        fclose(file);
+    return found;
+}
+
+// Whether the options can process frames of the format: the shifts of
+// the colors by the lens within the MAX_HALO rows of blocks a stage
+// reaches, and a denoising strength that isn't negative.
+int check_options(const struct options *options, const struct format *fmt)
+{
+    return lateral_resampling(&options->lens, fmt).halo <= MAX_HALO && options->denoise >= 0;
+}
+
+// Load a 3D LUT from a .cube file for the command line.
+INTERNAL const struct lut *load_lut(const char *name)
+{
+    FILE *file = fopen(name, "r");
+    struct lut *lut = malloc(sizeof(struct lut));
+
+    if(!file)
+    {
+        fprintf(stderr, "Unable to open file %s for reading.\n", name);
+        exit(-1);
+    }
+    if(!lut || !parse_lut(file, lut))
+    {
+        fprintf(stderr, "%s isn't a 3D LUT of up to %d nodes per axis.\n", name, LUT_MAX);
+        exit(-1);
+    }
+    fclose(file);
+    return lut;
+}
+
+// Load the lateral chromatic aberration of a lens for the command line,
+// from FILE[:NAME], the lens named in the profile or its first one. A
+// lens whose shifts are larger than the MAX_HALO rows of blocks a stage
+// reaches, on frames of the format, is refused.
+INTERNAL void load_lens(const char *profile, struct lens *lens, const struct format *fmt)
+{
+    char name[4096], *model;
+    FILE *file;
+
+    snprintf(name, sizeof(name), "%s", profile);
+    if((model = strrchr(name, ':')))
+        *model++ = 0;
+    if(!(file = fopen(name, "r")))
+    {
+        fprintf(stderr, "Unable to open file %s for reading.\n", name);
+        exit(-1);
+    }
+    if(!parse_lens(file, model, lens))
+    {
+        fprintf(stderr, "%s has no lens %s with red and blue scales within %g of 1.\n", name,
+                model ? model : "", LENS_SCALE_MAX);
+        exit(-1);
+    }
+    fclose(file);
+    if(lateral_resampling(lens, fmt).halo > MAX_HALO)
+    {
+        fprintf(stderr, "The lens of %s shifts the colors of %dx%d frames by over %d rows of blocks.\n", name,
+                fmt->width, fmt->height, MAX_HALO - 1);
+        exit(-1);
+    }
+}
+
+//  Save the output RGB image file with a simple TGA header.
+INTERNAL void write_tga(char *name, uint8_t *buff, int width, int height)
+{
+    FILE *file;
+
+    file = fopen(name, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open file %s for writing.\n", name);
+        exit(-1);
+    }
+    put_tga(file, buff, width, height);
+    fclose(file);
+}
+
+//  Save a grayscale plane, as an 8 bit TGA or without any header.
+INTERNAL void write_gray(char *name, uint8_t *buff, int width, int height, int header)
+{
+    FILE *file;
+    unsigned char tga_header[18] = {0};
+
+    tga_header[2] = 3;
+    tga_header[12] = 255 & width;
+    tga_header[13] = 255 & (width >> 8);
+    tga_header[14] = 255 & height;
+    tga_header[15] = 255 & (height >> 8);
+    tga_header[16] = 8;
+    tga_header[17] = 32;
+
+    file = fopen(name, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open file %s for writing.\n", name);
+        exit(-1);
+    }
+    if(header)
+        fwrite(tga_header, sizeof(tga_header), 1, file);
+    fwrite(buff, 1, (size_t)width*height, file);
+    fclose(file);
+}
+
+// Save the focus of an image to a JSON file next to it, of its name and
+// ".json".
+INTERNAL void write_focus(char *name, const struct focus *focus)
+{
+    char sidecar[4096];
+    FILE *file;
+
+    snprintf(sidecar, sizeof(sidecar), "%s.json", name);
+    if(!(file = fopen(sidecar, "w")))
+    {
+        fprintf(stderr, "Unable to open file %s for writing.\n", sidecar);
+        exit(-1);
+    }
+    fprintf(file, "{\"laplacian\": %.3f, \"tenengrad\": %.3f, \"columns\": %d, \"rows\": %d, \"zones\": [",
+            focus->frame.laplacian, focus->frame.tenengrad, focus->columns, focus->rows);
+    for(int zone = 0; zone < focus->columns*focus->rows; zone++)
+        fprintf(file, "%s\n  {\"laplacian\": %.3f, \"tenengrad\": %.3f}", zone ? "," : "",
+                focus->zones[zone].laplacian, focus->zones[zone].tenengrad);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+// Whether the frames of the format are calibrated by the options, with
+// master calibration frames and whole frames rather than regions.
+INTERNAL int calibrated(const struct format *fmt, const struct options *options)
+{
+    return (options->dark || options->gain) && fmt->stride == fmt->width && fmt->height == fmt->frame_height;
+}
+
+// Count the absolute differences of the neighbours of a color along a
+// row of the sensor, 2 samples apart, by their value, the larger ones
+// as the largest counted.
+INTERNAL void count_differences(const uint16_t *row, int samples, uint32_t *counts)
+{
+    for(int i = 0; i + 2 < samples; i++)
+    {
+        int difference = abs(row[i] - row[i+2]);
+        counts[difference < NOISE_LEVELS ? difference : NOISE_LEVELS - 1]++;
+    }
+}
+
+// Estimate the std of the noise from the counts of the differences of
+// neighbours: their median, interpolated within its count, is the
+// median absolute deviation (MAD) of the differences, as those of flat
+// neighbours are centered on 0, and scaled to the std of a normal noise.
+// Edges and details only make a few of the differences large, so they
+// hardly move the median.
+INTERNAL float noise_level(const uint32_t *counts)
+{
+    uint64_t total = 0, below = 0;
+    int i = 0;
+
+    for(int level = 0; level < NOISE_LEVELS; level++)
+        total += counts[level];
+    if(!total)
+        return 0;
+    while(below + counts[i] < total/2.0)
+        below += counts[i++];
+    double median = (i ? i - 0.5 : 0) + (total/2.0 - below)/counts[i]*(i ? 1 : 0.5);
+    return NOISE_SCALE*median;
+}
+
+// Total the clipped samples counted at each position of the blocks of
+// every row of a frame by their color, and list the rows holding any.
+INTERNAL void list_clipped(struct stats *stats, const struct format *fmt, const uint32_t *clipped)
+{
+    const int *position = pattern_positions[fmt->pattern];
+
+    memset(stats->clipped, 0, sizeof(stats->clipped));
+    stats->clipped_count = 0;
+    for(int y = 0; y < fmt->height; y++)
+    {
+        uint32_t row = 0;
+        for(int color = 0; color < RG10_COLORS; color++)
+        {
+            stats->clipped[color] += clipped[y*RG10_COLORS + position[color]];
+            row += clipped[y*RG10_COLORS + position[color]];
+        }
+        if(row && stats->clipped_rows)
+            stats->clipped_rows[stats->clipped_count++] = y;
+    }
+}
+
+// Find the min and max values for any of the given colors, of the frame
+// as it's converted, i.e. after its calibration by the options,
+// gathering the statistics of the frame in the same pass when given. The
+// noise is estimated on a sensor row of every NOISE_STEP rows of blocks
+// only, the top and bottom ones in turn for all the colors.
+INTERNAL void min_max_frame(uint16_t *buffer, const struct format *fmt, unsigned int colors, uint16_t *min,
+                            uint16_t *max, struct stats *stats, const struct options *options)
+{
+    uint32_t *sums = stats ? stats->rows : NULL, *bins = stats ? stats->bins : NULL;
+    uint32_t *clipped = stats && stats->clip ? malloc((size_t)fmt->height*RG10_COLORS*sizeof(uint32_t)) : NULL;
+    uint16_t clip = stats ? stats->clip : 0;
+    uint32_t counts[NOISE_LEVELS] = {0};
+    const int columns = STATS_BINS(fmt->width);
+    const int first = (fmt->height < NOISE_STEP ? fmt->height : NOISE_STEP)/2;   // Of the rows sampled for the noise
+
+    if(bins)
+        memset(bins, 0, (size_t)columns*STATS_BINS(fmt->height)*sizeof(uint32_t));
+    if(!calibrated(fmt, options))
+    {
+        simd()->min_max(buffer, fmt, colors, min, max, sums, bins, clip, clipped);
+        for(int y = first; stats && y < fmt->height; y += NOISE_STEP)
+            count_differences(buffer + RG10_LOCATION(0, y, fmt->stride, 0) +
+                              (y / NOISE_STEP & 1)*fmt->stride*RG10_COLOR_SIZE, fmt->width*RG10_COLOR_SIZE, counts);
+    }
+    else
+    {
+        // Calibrating a row of blocks at a time
+        const int samples = fmt->width*RG10_COLORS;
+        uint16_t *row = malloc(samples*sizeof(uint16_t));
+        struct format line = {0};
+        set_format(&line, fmt->width, 1, fmt->pattern);
+        *min = 65535;
+        *max = 0;
+        for(int y = 0; y < fmt->height; y++)
+        {
+            uint16_t row_min, row_max;
+            int offset = RG10_LOCATION(0, y, fmt->width, 0);
+            simd()->calibrate(buffer + offset, row, options->dark ? options->dark + offset : NULL,
+                              options->gain ? options->gain + offset : NULL, samples);
+            simd()->min_max(row, &line, colors, &row_min, &row_max, sums ? sums + y : NULL,
+                            bins ? bins + (size_t)(y / STATS_BIN)*columns : NULL, clip,
+                            clipped ? clipped + (size_t)y*RG10_COLORS : NULL);
+            if(*min > row_min) *min = row_min;
+            if(*max < row_max) *max = row_max;
+            if(stats && y % NOISE_STEP == first)
+                count_differences(row + (y / NOISE_STEP & 1)*fmt->width*RG10_COLOR_SIZE, fmt->width*RG10_COLOR_SIZE,
+                                  counts);
+        }
+        free(row);
+    }
+
+    if(!stats)
+        return;
+    stats->noise = noise_level(counts);
+    if(clipped)
+        list_clipped(stats, fmt, clipped);
+    stats->gathered = 1;
+    free(clipped);
+}
+
+// Update the normalization state of a stream with the min and max of a
+// frame, considering only the given colors. In the smooth mode the min
+// and max are a running average over the frames of the stream. Returns
+// 0 if the frame can't be normalized.
+INTERNAL int update_norm(uint16_t *buffer, const struct format *fmt, unsigned int colors, struct norm *norm,
+                         const struct options *options)
+{
+    uint16_t frame_min, frame_max;
+    min_max_frame(buffer, fmt, colors, &frame_min, &frame_max, norm->stats, options);
+
+    if(norm->mode == NORM_SMOOTH && norm->valid)
+    {
+        norm->min += EMA_WEIGHT*(frame_min - norm->min);
+        norm->max += EMA_WEIGHT*(frame_max - norm->max);
+    }
+    else
+    {
+        norm->min = frame_min;
+        norm->max = frame_max;
+        norm->valid = 1;
+    }
+    return norm->max > norm->min;
+}
+
+// A thread working on a range of tasks of a parallel_for().
+struct task_range
+{
+    void (*fn)(void *, int, int);
+    void *arg;
+    int begin, end;
+};
+
+INTERNAL void *task_thread(void *arg)
+{
+    struct task_range *range = arg;
+    range->fn(range->arg, range->begin, range->end);
+    return NULL;
+}
+
+// Run fn(arg, begin, end) over the tasks from 0 to count, split into a
+// contiguous range per thread. The calling thread takes the first one.
+INTERNAL void parallel_for(int threads, int count, void (*fn)(void *, int, int), void *arg)
+{
+    if(threads > count)
+        threads = count;
+    if(threads <= 1)
+    {
+        fn(arg, 0, count);
+        return;
+    }
+
+    pthread_t ids[threads];
+    struct task_range ranges[threads];
+    for(int i = 0; i < threads; i++)
+    {
+        ranges[i] = (struct task_range){fn, arg, count*i / threads, count*(i+1) / threads};
+        if(i)
+            pthread_create(&ids[i], NULL, task_thread, &ranges[i]);
+    }
+    fn(arg, ranges[0].begin, ranges[0].end);
+    for(int i = 1; i < threads; i++)
+        pthread_join(ids[i], NULL);
+}
+
+// Prepare the normalization of a frame, updating the state of its
+// stream, on the frame as calibrated by the options. Returns the state
+// to normalize with, or NULL when the frame isn't normalized.
+const struct norm *prepare_norm(uint16_t *buffer, const struct format *fmt, unsigned int colors, struct norm *norm,
+                                const struct options *options)
+{
+    if(!options)
+        options = &no_options;
+    if(norm && norm->stats && (norm->mode == NORM_NONE || norm->mode == NORM_FIXED))
+    {
+        // The pass is only for the statistics
+        uint16_t min, max;
+        min_max_frame(buffer, fmt, colors, &min, &max, norm->stats, options);
+    }
+    if(norm && norm->mode == NORM_FIXED)
+    {
+        norm->min = LEVELS_MIN;
+        norm->max = LEVELS_MAX;
+        norm->valid = 1;
+        return norm;
+    }
+    if(!norm || norm->mode == NORM_NONE || !update_norm(buffer, fmt, colors, norm, options))
+        return NULL;
+    return norm;
+}
+
+// Find the flicker of mains lighting in the row sums of a frame. A
+// rolling shutter reads the rows of blocks 2 lines apart, so the light
+// flickering makes bands along the rows: their profile, relative to the
+// mean and without its linear trend, is matched against the frequencies
+// from FLICKER_MIN to FLICKER_MAX (Goertzel), and the strongest one is
+// the flicker, unless its amplitude is under FLICKER_LEVEL.
+int detect_flicker(const struct stats *stats, const struct format *fmt, double line, struct flicker *flicker)
+{
+    const int height = fmt->height;
+    double mean = 0, slope = 0, squares = 0, best = 0;
+
+    if(!stats || !stats->gathered || !stats->rows)
+        return 0;
+    flicker->frequency = flicker->amplitude = 0;
+    for(int y = 0; y < height; y++)
+        mean += stats->rows[y];
+    mean /= height;
+    if(mean <= 0 || height < 4)
+        return 1;
+
+    double *profile = malloc(height*sizeof(double));
+    for(int y = 0; y < height; y++)
+    {
+        profile[y] = stats->rows[y]/mean - 1;
+        slope += (y - (height - 1)/2.0)*profile[y];
+        squares += (y - (height - 1)/2.0)*(y - (height - 1)/2.0);
+    }
+    for(int y = 0; y < height; y++)
+        profile[y] -= slope/squares*(y - (height - 1)/2.0);
+
+    for(int hz = FLICKER_MIN; hz <= FLICKER_MAX; hz++)
+    {
+        double coeff = 2*cos(2*M_PI*hz*2*line), s1 = 0, s2 = 0;
+        for(int y = 0; y < height; y++)
+        {
+            double s = profile[y] + coeff*s1 - s2;
+            s2 = s1;
+            s1 = s;
+        }
+        double power = s1*s1 + s2*s2 - coeff*s1*s2;
+        if(power > best)
+        {
+            best = power;
+            flicker->frequency = hz;
+        }
+    }
+    free(profile);
+
+    flicker->amplitude = 2*sqrt(best)/height;
+    if(flicker->amplitude < FLICKER_LEVEL)
+        flicker->frequency = flicker->amplitude = 0;
+    return 1;
+}
+
+// Find the motion in the bins of a frame: the bins whose mean sample
+// changed from their background by more than the threshold, relative to
+// the background and MOTION_FLOOR above it so the dark bins' noise isn't
+// motion. The background then moves towards the frame by MOTION_WEIGHT.
+int detect_motion(const struct stats *stats, const struct format *fmt, struct motion *motion)
+{
+    const int columns = STATS_BINS(fmt->width), rows = STATS_BINS(fmt->height);
+    int moving = 0;
+
+    if(!stats || !stats->gathered || !stats->bins)
+        return 0;
+    for(int bin = 0; bin < columns*rows; bin++)
+    {
+        const int x = bin % columns*STATS_BIN, y = bin / columns*STATS_BIN;
+        const int width = fmt->width - x < STATS_BIN ? fmt->width - x : STATS_BIN;
+        const int height = fmt->height - y < STATS_BIN ? fmt->height - y : STATS_BIN;
+        float mean = (float)stats->bins[bin] / (width*height*RG10_COLORS);
+        float *background = &motion->background[bin];
+
+        if(!motion->valid)
+            *background = mean;
+        motion->mask[bin] = fabsf(mean - *background) > motion->threshold*(*background + MOTION_FLOOR);
+        moving += motion->mask[bin];
+        *background += MOTION_WEIGHT*(mean - *background);
+    }
+    motion->valid = 1;
+    motion->score = (float)moving / (columns*rows);
+    return 1;
+}
+
+// Bytes in a row of the given domain, for a frame of the given width.
+INTERNAL size_t row_size(enum domain domain, int width)
+{
+    switch(domain)
+    {
+    case DOMAIN_MOSAIC: return (size_t)width*RG10_COLORS*RG10_COLOR_SIZE;
+    case DOMAIN_RGB:
+    case DOMAIN_CHROMA: return (size_t)width*RGB_COLORS*sizeof(uint16_t);
+    default:            return (size_t)width*RGB_COLORS*RGB_COLOR_SIZE;
+    }
+}
+
+// Normalize the colors of a row of blocks with min = 0 and max = 1023.
+// Values falling outside of a smoothed min and max are clipped.
+INTERNAL void stage_normalize(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                              int y)
+{
+    const struct levels *levels = stage->data;
+    (void)y;
+
+    simd()->normalize(in[0], out, fmt->width*RG10_COLORS, levels->min, levels->mult);
+}
+
+// Calibrate a row of blocks with the master frames of the options, at
+// the same row of them.
+INTERNAL void stage_calibrate(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                              int y)
+{
+    const struct options *masters = stage->data;
+    const int offset = RG10_LOCATION(0, y, fmt->width, 0);
+
+    simd()->calibrate(in[0], out, masters->dark ? masters->dark + offset : NULL,
+                      masters->gain ? masters->gain + offset : NULL, fmt->width*RG10_COLORS);
+}
+
+// Denoise a row of blocks, with the threshold chosen for the frame.
+INTERNAL void stage_denoise(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                            int y)
+{
+    const int *threshold = stage->data;
+    (void)y;
+
+    simd()->denoise((const uint16_t *const *)in, out, fmt->width, *threshold);
+}
+
+// The threshold of the denoising of a frame, from the noise estimated
+// along its normalization: 0 when it isn't denoised, not being
+// normalized, or with too little noise to bother. The noise is that of
+// single samples, so it's only for the conversions at full resolution,
+// a region of the frame included: the binned ones average the noise
+// down already and aren't denoised.
+INTERNAL int denoise_threshold(const struct norm *norm, const struct options *options)
+{
+    const struct stats *stats = norm ? norm->stats : NULL;
+
+    if(!options->denoise || !stats || !stats->gathered || stats->noise < DENOISE_MIN)
+        return 0;
+    return lrintf(options->denoise*stats->noise);
+}
+
+// Whether a row is in a list of rows in order.
+INTERNAL int listed(const int *rows, int count, int y)
+{
+    int low = 0, high = count;
+
+    while(low < high)
+    {
+        int middle = (low + high)/2;
+        if(rows[middle] < y)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < count && rows[low] == y;
+}
+
+// Rebuild the clipped samples of a row of blocks. A block with some of
+// its samples clipped takes the color of the nearest block without any,
+// within HIGHLIGHT_REACH blocks along the row: its clipped samples are
+// those of that block scaled by the samples that aren't clipped, then
+// the whole block is scaled down to the clip level, so it keeps the
+// color instead of the tint of the samples left unclipped. A block all
+// clipped, or without such a neighbour, is made white.
+INTERNAL void reconstruct_row(uint16_t *row, int width, uint16_t clip)
+{
+    uint16_t *sample[RG10_COLORS] = {row, row + 1, row + width*RG10_COLOR_SIZE, row + width*RG10_COLOR_SIZE + 1};
+    uint8_t mask[width];
+    int nearest[width];
+
+    for(int x = 0; x < width; x++)
+    {
+        mask[x] = 0;
+        for(int p = 0; p < RG10_COLORS; p++)
+            mask[x] |= (sample[p][2*x] >= clip) << p;
+    }
+
+    // The nearest block without clipped samples on the left, then on the
+    // right when it's nearer
+    for(int x = 0, last = -1; x < width; x++)
+    {
+        if(!mask[x])
+            last = x;
+        nearest[x] = last >= 0 && x - last <= HIGHLIGHT_REACH ? last : -1;
+    }
+    for(int x = width - 1, next = -1; x >= 0; x--)
+    {
+        if(!mask[x])
+            next = x;
+        if(next >= 0 && next - x <= HIGHLIGHT_REACH && (nearest[x] < 0 || next - x < x - nearest[x]))
+            nearest[x] = next;
+    }
+
+    for(int x = 0; x < width; x++)
+    {
+        double value[RG10_COLORS], here = 0, there = 0, top = 0;
+        const int n = nearest[x];
+        if(!mask[x])
+            continue;
+        for(int p = 0; p < RG10_COLORS; p++)
+        {
+            value[p] = sample[p][2*x];
+            if(n >= 0 && !(mask[x] >> p & 1))
+            {
+                here += value[p];
+                there += sample[p][2*n];
+            }
+        }
+        for(int p = 0; p < RG10_COLORS; p++)
+        {
+            if(mask[x] >> p & 1 && here > 0 && there > 0)
+                value[p] = fmax(value[p], sample[p][2*n]*here/there);
+            if(top < value[p])
+                top = value[p];
+        }
+        for(int p = 0; p < RG10_COLORS; p++)
+        {
+            const double v = here > 0 && there > 0 ? value[p]*clip/top : clip;
+            sample[p][2*x] = v < clip ? (uint16_t)(v + 0.5) : clip;
+        }
+    }
+}
+
+// The rows of a frame whose highlights are reconstructed, from the
+// clipped samples counted along its normalization: none when the
+// options don't ask for it, the frame isn't normalized, or nothing is
+// clipped, so the frames without clipping have no stage for it. Of a
+// region of a frame, those of its rows only.
+INTERNAL struct highlights clipped_rows(const struct norm *norm, const struct format *fmt,
+                                        const struct options *options)
+{
+    const struct stats *stats = norm ? norm->stats : NULL;
+    struct highlights clipped = {NULL, 0, fmt->y, 0};
+
+    if(options->highlights && stats && stats->gathered && stats->clip && stats->clipped_rows)
+    {
+        // Those of the rows of a region only
+        const int *rows = stats->clipped_rows, *end = rows + stats->clipped_count;
+        while(rows < end && *rows < fmt->y)
+            rows++;
+        while(end > rows && end[-1] >= fmt->y + fmt->height)
+            end--;
+        clipped.rows = rows;
+        clipped.count = end - rows;
+        clipped.clip = stats->clip;
+    }
+    return clipped;
+}
+
+// Reconstruct the highlights of a row of blocks when it's listed as
+// holding clipped samples, passing the other rows on as they are.
+INTERNAL void stage_highlights(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                               int y)
+{
+    const struct highlights *highlights = stage->data;
+
+    if(in[0] != out)
+        memcpy(out, in[0], row_size(DOMAIN_MOSAIC, fmt->width));
+    if(listed(highlights->rows, highlights->count, highlights->top + y))
+        reconstruct_row(out, fmt->width, highlights->clip);
+}
+
+// Measure the focus of a row of blocks, passing it on as it is. The
+// edge rows aren't measured.
+INTERNAL void stage_focus(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y)
+{
+    const struct focus_sums *focus = stage->data;
+
+    if(y > 0 && y < fmt->height - 1)
+        simd()->focus((const uint16_t *const *)in, fmt, focus->columns,
+                      focus->sums + (size_t)y*focus->columns*FOCUS_SUMS);
+    memcpy(out, in[1], row_size(DOMAIN_MOSAIC, fmt->width));
+}
+
+// Perform the actual de-Bayering, coverting a row of RGGB blocks to a
+// row of RGB pixels.
+INTERNAL void stage_demosaic(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                             int y)
+{
+    const uint16_t *src = in[0];
+    uint16_t *dst = out;
+    (void)stage;
+    (void)y;
+
+    for(int x = 0; x < fmt->width; x++)
+    {
+        dst[RGB_LOCATION(x, 0, 0, RGB_R)] = src[RG10_LOCATION(x, 0, 0, fmt->r)];
+        dst[RGB_LOCATION(x, 0, 0, RGB_B)] = src[RG10_LOCATION(x, 0, 0, fmt->b)];
+        dst[RGB_LOCATION(x, 0, 0, RGB_G)] = (src[RG10_LOCATION(x, 0, 0, fmt->gb)] + src[RG10_LOCATION(x, 0, 0, fmt->gr)]) / 2;
+    }
+}
+
+// Demosaic a row of blocks into the planes of the chroma stage.
+INTERNAL void stage_chroma_planes(const struct stage *stage, const struct format *fmt, const void *const *in,
+                                  void *out, int y)
+{
+    (void)stage;
+    (void)y;
+
+    simd()->chroma_planes(in[0], out, fmt, NULL);
+}
+
+// Suppress the false colors of a row of pixels, back to RGB.
+INTERNAL void stage_chroma(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y)
+{
+    (void)stage;
+    (void)y;
+
+    simd()->chroma((const uint16_t *const *)in, out, NULL, fmt->width);
+}
+
+// Correct the lateral CA of a row of blocks.
+INTERNAL void stage_lateral(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                            int y)
+{
+    simd()->lateral((const uint16_t *const *)in, out, fmt, stage->data, y);
+}
+
+// Scale a row of RGB pixels to the 8 bits output.
+INTERNAL void stage_pack(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y)
+{
+    const uint16_t *src = in[0];
+    uint8_t *dst = out;
+    (void)stage;
+    (void)y;
+
+    for(int i = 0; i < fmt->width*RGB_COLORS; i++)
+        dst[i] = NORM(src[i]);
+}
+
+// Grade a row of RGB pixels with the 3D LUT into the 8 bits output, in
+// place of packing it.
+INTERNAL void stage_lut(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y)
+{
+    const struct grading *grading = stage->data;
+    const uint16_t *src = in[0];
+    uint8_t *dst = out;
+    (void)y;
+
+    for(int x = 0; x < fmt->width; x++)
+    {
+        int rgb[RGB_COLORS];
+        for(int c = 0; c < RGB_COLORS; c++)
+            rgb[c] = src[RGB_LOCATION(x, 0, 0, c)] > MAX_RG10 ? MAX_RG10 : src[RGB_LOCATION(x, 0, 0, c)];
+        lut_pixel(grading->lut, rgb, dst + RGB_LOCATION(x, 0, 0, 0));
+    }
+}
+
+// The demosaic and pack stages fused into a single loop.
+INTERNAL void fused_demosaic_pack(const struct stage *stage, const struct format *fmt, const void *const *in,
+                                  void *out, int y)
+{
+    (void)stage;
+    (void)y;
+
+    simd()->demosaic_pack(in[0], out, fmt, NULL);
+}
+
+// The normalize, demosaic and pack stages fused into a single loop.
+INTERNAL void fused_normalize_demosaic_pack(const struct stage *stage, const struct format *fmt, const void *const *in,
+                                            void *out, int y)
+{
+    (void)y;
+
+    simd()->demosaic_pack(in[0], out, fmt, stage->data);
+}
+
+// The demosaic and 3D LUT stages fused into a single loop.
+INTERNAL void fused_demosaic_lut(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                                 int y)
+{
+    const struct grading *grading = stage->data;
+    (void)y;
+
+    simd()->lut(in[0], out, fmt, NULL, grading->lut);
+}
+
+// The normalize, demosaic and 3D LUT stages fused into a single loop.
+INTERNAL void fused_normalize_demosaic_lut(const struct stage *stage, const struct format *fmt, const void *const *in,
+                                           void *out,
+                                           int y)
+{
+    const struct grading *grading = stage->data;
+    (void)y;
+
+    simd()->lut(in[0], out, fmt, grading->levels, grading->lut);
+}
+
+// The normalize stage fused into the demosaic into the planes of the
+// chroma stage.
+INTERNAL void fused_normalize_chroma_planes(const struct stage *stage, const struct format *fmt, const void *const *in,
+                                            void *out, int y)
+{
+    (void)y;
+
+    simd()->chroma_planes(in[0], out, fmt, stage->data);
+}
+
+// The chroma and pack stages fused, packing the rows to 8 bits as
+// they're filtered.
+INTERNAL void fused_chroma_pack(const struct stage *stage, const struct format *fmt, const void *const *in, void *out,
+                                int y)
+{
+    (void)stage;
+    (void)y;
+
+    simd()->chroma((const uint16_t *const *)in, NULL, out, fmt->width);
+}
+
+// The stage sequences that have a fused kernel, all point-wise but the
+// first. A fused stage takes the parameters of the given stage of its
+// sequence, the first one unless it ends with the LUT, whose parameters
+// carry the levels of the normalization too.
+INTERNAL const struct fusion
+{
+    stage_fn sequence[MAX_FUSED];
+    stage_fn fused;
+    int data;                                    // Stage of the sequence whose parameters the fused stage takes
+} fusions[] =
+{
+    {{stage_normalize, stage_demosaic, stage_pack}, fused_normalize_demosaic_pack, 0},
+    {{stage_demosaic, stage_pack}, fused_demosaic_pack, 0},
+    {{stage_normalize, stage_demosaic, stage_lut}, fused_normalize_demosaic_lut, 2},
+    {{stage_demosaic, stage_lut}, fused_demosaic_lut, 1},
+    {{stage_normalize, stage_chroma_planes}, fused_normalize_chroma_planes, 0},
+    {{stage_chroma, stage_pack}, fused_chroma_pack, 0},
+};
+
+// Add a stage to the end of a pipeline.
+INTERNAL void add_stage(struct pipeline *pipe, const char *name, enum domain in, enum domain out, int halo,
+                        stage_fn run, const void *data)
+{
+    if(pipe->count == MAX_STAGES || halo > MAX_HALO)
+    {
+        fprintf(stderr, "Too many stages in the pipeline.\n");
+        exit(-1);
+    }
+    pipe->stages[pipe->count++] = (struct stage){name, in, out, halo, run, data, NULL, 0};
+}
+
+// The entry of a compiled kernel, converting a row in groups of 4 blocks.
+typedef void (*jit_fn)(const uint16_t *src, uint8_t *dst, const struct levels *levels);
+
+// A kernel compiled for the rows of a format, and the fused kernel it
+// replaces, which converts the blocks left over from the groups.
+struct jit_kernel
+{
+    stage_fn fused;
+    int width;
+    enum pattern pattern;
+    jit_fn run;
+};
+
+// The kernels compiled so far, reused by every pipeline of the same
+// format and stages.
+INTERNAL struct jit_cache
+{
+    struct jit_kernel kernels[JIT_KERNELS];
+    int count;
+    pthread_mutex_t lock;
+} jit_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#ifdef HAVE_JIT
+enum jit_register                                // x86-64 general purpose registers, by their encoding
+{
+    RCX = 1,
+    RDX = 2,
+    RSI = 6,
+    RDI = 7,
+    RIP = -1                                     // Addressing relative to the start of the code
+};
+
+enum sse_opcode                                  // SSE opcodes, with their mandatory prefix in front
+{
+    MOVSS_LOAD  = 0xf30f10,
+    MOVHLPS     = 0x0f12,
+    MULPS       = 0x0f59,
+    CVTPS2PD    = 0x0f5a,
+    CVTDQ2PS    = 0x0f5b,
+    CVTTPS2DQ   = 0xf30f5b,
+    SUBPS       = 0x0f5c,
+    ADDPD       = 0x660f58,
+    PUNPCKLQDQ  = 0x660f6c,
+    MOVDQA      = 0x660f6f,
+    MOVDQU_LOAD = 0xf30f6f,
+    PSHIFTD     = 0x660f72,                      // Shift dwords by an immediate, /2 right and /6 left
+    PSHIFTDQ    = 0x660f73,                      // Shift the register by immediate bytes, /3 right
+    MOVD_STORE  = 0x660f7e,
+    SHUFPS      = 0x0fc6,
+    MOVQ_STORE  = 0x660fd6,
+    PAND        = 0x660fdb,
+    CVTTPD2DQ   = 0x660fe6,
+    POR         = 0x660feb,
+    PXOR        = 0x660fef,
+    PADDD       = 0x660ffe,
+    PSHUFB      = 0x660f3800,
+    PMINSD      = 0x660f3839,
+    PMAXSD      = 0x660f383d
+};
+
+// The constants of a compiled kernel, in front of its code.
+struct jit_constants
+{
+    uint32_t low[4];                             // Mask of the first sample of each pair
+    double half[2];
+    int32_t max[4];
+    float pack[4];                               // Scale of NORM
+    uint8_t interleave[RGB_COLORS][16];          // Shuffles of the dwords of a color to its bytes of BGR pixels
+};
+
+// A buffer machine code is emitted to.
+struct emitter
+{
+    uint8_t *code;
+    size_t size;
+};
+
+// Emit a byte of code.
+INTERNAL void emit(struct emitter *e, int byte)
+{
+    e->code[e->size++] = byte;
+}
+
+// Emit a 32 bits little endian value.
+INTERNAL void emit32(struct emitter *e, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        emit(e, value >> i*8);
+}
+
+// Emit the prefix, the REX prefix when reaching xmm8 to xmm15, and the
+// opcode of an SSE instruction.
+INTERNAL void emit_opcode(struct emitter *e, uint32_t opcode, int reg, int rm)
+{
+    int bytes = opcode > 0xffffff ? 4 : opcode > 0xffff ? 3 : 2;
+    int prefix = opcode >> (bytes - 1)*8;
+
+    if(prefix == 0x66 || prefix == 0xf2 || prefix == 0xf3)
+    {
+        emit(e, prefix);
+        bytes--;
+    }
+    if(reg > 7 || rm > 7)
+        emit(e, 0x40 | (reg > 7) << 2 | (rm > 7));
+    while(bytes--)
+        emit(e, opcode >> bytes*8);
+}
+
+// An SSE instruction between two registers.
+INTERNAL void sse(struct emitter *e, uint32_t opcode, int reg, int rm)
+{
+    emit_opcode(e, opcode, reg, rm);
+    emit(e, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// An SSE instruction with an immediate. For the shifts reg is the digit
+// selecting the operation.
+INTERNAL void sse_imm(struct emitter *e, uint32_t opcode, int reg, int rm, int imm)
+{
+    sse(e, opcode, reg, rm);
+    emit(e, imm);
+}
+
+// An SSE instruction between a register and the memory at disp from a
+// base register, or at offset disp of the code for RIP.
+INTERNAL void sse_mem(struct emitter *e, uint32_t opcode, int reg, int base, int disp)
+{
+    emit_opcode(e, opcode, reg, base == RIP ? 0 : base);
+    if(base == RIP)
+    {
+        emit(e, 0x05 | (reg & 7) << 3);
+        emit32(e, disp - (int)(e->size + 4));
+    }
+    else
+    {
+        emit(e, 0x80 | (reg & 7) << 3 | base);
+        emit32(e, disp);
+    }
+}
+
+// Emit the normalization of the 4 samples in a register, the same as
+// stage_normalize: (sample - min) * mult rounded through a double,
+// clipped to 0 and 1023.
+INTERNAL void emit_normalize(struct emitter *e, int reg)
+{
+    sse(e, CVTDQ2PS, reg, reg);
+    sse(e, SUBPS, reg, 14);
+    sse(e, MULPS, reg, 13);
+    sse(e, CVTPS2PD, 4, reg);
+    sse(e, MOVHLPS, 5, reg);
+    sse(e, CVTPS2PD, 5, 5);
+    sse(e, ADDPD, 4, 12);
+    sse(e, ADDPD, 5, 12);
+    sse(e, CVTTPD2DQ, 4, 4);
+    sse(e, CVTTPD2DQ, 5, 5);
+    sse(e, PUNPCKLQDQ, 4, 5);
+    sse(e, PMAXSD, 4, 10);
+    sse(e, PMINSD, 4, 11);
+    sse(e, MOVDQA, reg, 4);
+}
+
+// Emit the pack of the 4 values in a register to 8 bits, the same as NORM.
+INTERNAL void emit_pack(struct emitter *e, int reg)
+{
+    sse(e, CVTDQ2PS, reg, reg);
+    sse(e, MULPS, reg, 9);
+    sse(e, CVTTPS2DQ, reg, reg);
+}
+
+// Emit a kernel converting the rows of the given width and pattern in
+// groups of 4 blocks, a straight line of SSE4.1 code with the width,
+// the positions of the colors and whether to normalize built in. It's
+// called as run(src, dst, levels), so the levels are in rdx.
+INTERNAL void jit_emit(struct emitter *e, int width, enum pattern pattern, int normalize)
+{
+    struct jit_constants constants =
+    {
+        {0xffff, 0xffff, 0xffff, 0xffff},
+        {0.5, 0.5},
+        {MAX_RG10, MAX_RG10, MAX_RG10, MAX_RG10},
+        {(float)MAX_RGB/MAX_RG10, (float)MAX_RGB/MAX_RG10, (float)MAX_RGB/MAX_RG10, (float)MAX_RGB/MAX_RG10},
+        {{0}}
+    };
+    const int samples[RG10_COLORS] = {2, 0, 3, 1}; // The registers holding the samples of each position
+    const int *position = pattern_positions[pattern];
+    const int r = samples[position[0]], gr = samples[position[1]], gb = samples[position[2]], b = samples[position[3]];
+
+    memset(constants.interleave, 0x80, sizeof(constants.interleave));
+    for(int color = 0; color < RGB_COLORS; color++)
+        for(int i = 0; i < 4; i++)
+            constants.interleave[color][RGB_LOCATION(i, 0, 0, color)] = i*sizeof(uint32_t);
+    memcpy(e->code, &constants, sizeof(constants));
+    e->size = sizeof(constants);
+    if(normalize)
+    {
+        sse_mem(e, MOVSS_LOAD, 14, RDX, offsetof(struct levels, min));
+        sse_imm(e, SHUFPS, 14, 14, 0);
+        sse_mem(e, MOVSS_LOAD, 13, RDX, offsetof(struct levels, mult));
+        sse_imm(e, SHUFPS, 13, 13, 0);
+    }
+    sse_mem(e, MOVDQA, 15, RIP, offsetof(struct jit_constants, low));
+    sse_mem(e, MOVDQA, 12, RIP, offsetof(struct jit_constants, half));
+    sse_mem(e, MOVDQA, 11, RIP, offsetof(struct jit_constants, max));
+    sse(e, PXOR, 10, 10);
+    sse_mem(e, MOVDQA, 9, RIP, offsetof(struct jit_constants, pack));
+    for(int color = 0; color < RGB_COLORS; color++)
+        sse_mem(e, MOVDQA, 6 + color, RIP, offsetof(struct jit_constants, interleave[color]));
+    emit(e, 0xb8 + RCX);                         // mov ecx, groups
+    emit32(e, width/4);
+
+    const size_t loop = e->size;
+    sse_mem(e, MOVDQU_LOAD, 0, RDI, 0);
+    sse_mem(e, MOVDQU_LOAD, 1, RDI, width*RG10_COLOR_SIZE*sizeof(uint16_t));
+    for(int row = 0; row < 2; row++)
+    {
+        sse(e, MOVDQA, samples[row*2], row);
+        sse(e, PAND, samples[row*2], 15);
+        sse_imm(e, PSHIFTD, 2, row, 16);
+    }
+    if(normalize)
+        for(int reg = 0; reg < RG10_COLORS; reg++)
+            emit_normalize(e, reg);
+    sse(e, PADDD, gr, gb);
+    sse_imm(e, PSHIFTD, 2, gr, 1);
+    emit_pack(e, r);
+    emit_pack(e, gr);
+    emit_pack(e, b);
+    sse(e, PSHUFB, b, 6 + RGB_B);
+    sse(e, PSHUFB, gr, 6 + RGB_G);
+    sse(e, PSHUFB, r, 6 + RGB_R);
+    sse(e, POR, b, gr);
+    sse(e, POR, b, r);
+    sse_mem(e, MOVQ_STORE, b, RSI, 0);
+    sse_imm(e, PSHIFTDQ, 3, b, 8);
+    sse_mem(e, MOVD_STORE, b, RSI, 8);
+
+    const uint8_t step[] =
+    {
+        0x48, 0x83, 0xc7, 4*RG10_COLOR_SIZE*sizeof(uint16_t), // add rdi, 16
+        0x48, 0x83, 0xc6, 4*RGB_COLORS,         // add rsi, 12
+        0x83, 0xe9, 0x01,                       // sub ecx, 1
+        0x0f, 0x85                              // jnz loop
+    };
+    for(size_t i = 0; i < sizeof(step); i++)
+        emit(e, step[i]);
+    emit32(e, (int)loop - (int)(e->size + 4));
+    emit(e, 0xc3);                               // ret
+}
+
+// Compile the kernel of a fused stage for the rows of a format. Returns
+// NULL when there's none for the stage or the CPU lacks SSE4.1.
+INTERNAL jit_fn jit_compile(stage_fn fused, const struct format *fmt)
+{
+    if((fused != fused_demosaic_pack && fused != fused_normalize_demosaic_pack) || fmt->width < 4 ||
+       !__builtin_cpu_supports("sse4.1"))
+        return NULL;
+
+    uint8_t *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED)
+        return NULL;
+    struct emitter e = {code, 0};
+    jit_emit(&e, fmt->width, fmt->pattern, fused == fused_normalize_demosaic_pack);
+    if(mprotect(code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC))
+    {
+        munmap(code, JIT_CODE_SIZE);
+        return NULL;
+    }
+    return (jit_fn)(code + sizeof(struct jit_constants));
+}
+#else
+// Compiled kernels are x86-64 only.
+INTERNAL jit_fn jit_compile(stage_fn fused, const struct format *fmt)
+{
+    (void)fused;
+    (void)fmt;
+    return NULL;
+}
+#endif
+
+// Run a fused stage with its compiled kernel, and the blocks left over
+// from the groups of 4 with the fused kernel.
+INTERNAL void stage_jit(const struct stage *stage, const struct format *fmt, const void *const *in, void *out, int y)
+{
+    const struct jit_kernel *kernel = stage->code;
+    const int done = fmt->width & ~3;
+    struct format rest = *fmt;
+    const void *src = (const uint16_t *)in[0] + done*RG10_COLOR_SIZE;
+
+    kernel->run(in[0], out, stage->data);
+    if(done < fmt->width)
+    {
+        rest.width = fmt->width - done;
+        kernel->fused(stage, &rest, &src, (uint8_t *)out + done*RGB_COLORS, y);
+    }
+}
+
+// Find the compiled kernel of a fused stage for the rows of a format,
+// compiling it on first use. Returns NULL when it can't be compiled.
+INTERNAL const struct jit_kernel *jit_lookup(stage_fn fused, const struct format *fmt)
+{
+    const struct jit_kernel *found = NULL;
+
+    pthread_mutex_lock(&jit_cache.lock);
+    for(int i = 0; i < jit_cache.count && !found; i++)
+        if(jit_cache.kernels[i].fused == fused && jit_cache.kernels[i].width == fmt->width &&
+           jit_cache.kernels[i].pattern == fmt->pattern)
+            found = &jit_cache.kernels[i];
+    if(!found && jit_cache.count < JIT_KERNELS)
+    {
+        jit_fn run = jit_compile(fused, fmt);
+        if(run)
+        {
+            struct jit_kernel *kernel = &jit_cache.kernels[jit_cache.count++];
+            kernel->fused = fused;
+            kernel->width = fmt->width;
+            kernel->pattern = fmt->pattern;
+            kernel->run = run;
+            found = kernel;
+        }
+    }
+    pthread_mutex_unlock(&jit_cache.lock);
+    return found;
+}
+
+// Replace the sequences of stages that have a fused kernel with a single
+// stage running it, compiled for the pipeline's format when the JIT is
+// on. The fused stage has the halo of the first stage of its sequence,
+// the others being point-wise.
+INTERNAL void fuse(struct pipeline *pipe)
+{
+    for(int i = 0; i < pipe->count; i++)
+    {
+        for(size_t f = 0; f < sizeof(fusions)/sizeof(fusions[0]); f++)
+        {
+            int length = 0;
+            while(length < MAX_FUSED && fusions[f].sequence[length] && i + length < pipe->count &&
+                  pipe->stages[i+length].run == fusions[f].sequence[length] && (!length || !pipe->stages[i+length].halo))
+                length++;
+            if(length < MAX_FUSED && fusions[f].sequence[length])
+                continue;
+
+            struct stage *stage = &pipe->stages[i];
+            stage->name = "fused";
+            stage->out = pipe->stages[i+length-1].out;
+            stage->run = fusions[f].fused;
+            stage->data = pipe->stages[i+fusions[f].data].data;
+            if(tuning.jit && (stage->code = jit_lookup(stage->run, pipe->fmt)))
+                stage->run = stage_jit;
+            memmove(stage + 1, stage + length, (pipe->count - i - length)*sizeof(struct stage));
+            pipe->count -= length - 1;
+            break;
+        }
+    }
+}
+
+// The state of a thread running bands of a pipeline. Level 0 holds the
+// input rows, and every following level the output rows of a segment:
+// a neighbourhood stage (or the first stage) and the point-wise stages
+// after it, which run on a row while it's still in the cache. A level
+// keeps a rolling buffer of as many rows as the next level's halo needs.
+struct band
+{
+    const struct pipeline *pipe;
+    struct format rows;                          // The format of the rows passed between the stages
+    const uint16_t *frame;
+    uint8_t *image;
+    int levels;
+    int first[MAX_STAGES+1];                     // First stage of each level's segment
+    int halo[MAX_STAGES+1];                      // Halo of each level's segment
+    int size[MAX_STAGES+1];                      // Rows in each level's rolling buffer, 0 for none
+    enum domain domain[MAX_STAGES+1];            // What each level's rows hold
+    uint8_t *ring[MAX_STAGES+1];
+    int next[MAX_STAGES+1];                      // Next row each level produces
+    void *scratch[DOMAINS];                      // Rows between the stages of a segment
+    int top, bottom;                             // Rows of blocks of the band being run
+};
+
+// A row of a level, which must be in its rolling buffer already.
+INTERNAL const void *band_row(struct band *band, int level, int y)
+{
+    const struct format *fmt = band->pipe->fmt;
+    if(level == 0 && !band->size[0])
+        return band->frame + RG10_LOCATION(0, y, fmt->stride, 0);
+    return band->ring[level] + (size_t)(y % band->size[level])*row_size(band->domain[level], fmt->width);
+}
+
+// Produce a row of a level, from the rows of the previous one.
+INTERNAL void band_produce(struct band *band, int level, int y)
+{
+    const struct format *fmt = band->pipe->fmt;
+    const int height = fmt->height;
+
+    if(level == 0)
+    {
+        // Copy the two sensor rows of a cropped frame next to each other
+        if(band->size[0])
+        {
+            uint16_t *row = (uint16_t *)band_row(band, 0, y);
+            const uint16_t *top = band->frame + RG10_LOCATION(0, y, fmt->stride, 0);
+            memcpy(row, top, fmt->width*RG10_COLOR_SIZE*sizeof(uint16_t));
+            memcpy(row + fmt->width*RG10_COLOR_SIZE, top + fmt->stride*RG10_COLOR_SIZE,
+                   fmt->width*RG10_COLOR_SIZE*sizeof(uint16_t));
+        }
+        return;
+    }
+
+    const void *in[2*MAX_HALO+1];
+    const int halo = band->halo[level];
+    for(int i = -halo; i <= halo; i++)
+        in[i+halo] = band_row(band, level-1, y+i < 0 ? 0 : y+i >= height ? height-1 : y+i);
+
+    const int last = level + 1 < band->levels ? band->first[level+1] : band->pipe->count;
+    for(int s = band->first[level]; s < last; s++)
+    {
+        const struct stage *stage = &band->pipe->stages[s];
+        void *out;
+        if(s < last - 1)
+            out = band->scratch[stage->out];
+        else if(level == band->levels - 1)
+            out = band->image + (size_t)y*row_size(DOMAIN_BGR8, fmt->width);
+        else
+            out = (void *)band_row(band, level, y);
+        if(stage->measures && (y < band->top || y >= band->bottom))
+            memcpy(out, in[halo], row_size(stage->out, fmt->width));
+        else
+            stage->run(stage, &band->rows, s == band->first[level] ? in : (const void *const *)&in[halo], out, y);
+        in[halo] = out;
+    }
+}
+
+// Make sure a level produced all the rows up to y.
+INTERNAL void band_ensure(struct band *band, int level, int y)
+{
+    while(band->next[level] <= y)
+    {
+        int row = band->next[level]++;
+        if(level > 0)
+        {
+            int need = row + band->halo[level];
+            band_ensure(band, level-1, need < band->pipe->fmt->height ? need : band->pipe->fmt->height - 1);
+        }
+        band_produce(band, level, row);
+    }
+}
+
+// The frame and image of a pipeline run, and the memory of the buffers
+// of its bands.
+struct pipeline_job
+{
+    const struct pipeline *pipe;
+    const uint16_t *frame;
+    uint8_t *image;
+    uint8_t *memory;                             // The buffers of a band for each thread, one after the other
+    size_t band_size;                            // Bytes of the buffers of a band
+    int threads;                                 // Threads that took their buffers so far
+};
+
+// Split the stages of a pipeline into the segments of a band's levels,
+// and size their rolling buffers.
+INTERNAL void band_levels(struct band *band, const struct pipeline *pipe)
+{
+    const struct format *fmt = pipe->fmt;
+
+    band->pipe = pipe;
+    set_format(&band->rows, fmt->width, fmt->height, fmt->pattern);
+    band->domain[0] = DOMAIN_MOSAIC;
+    band->levels = 1;
+    for(int s = 0; s < pipe->count; s++)
+    {
+        if(s == 0 || pipe->stages[s].halo)
+        {
+            band->first[band->levels] = s;
+            band->halo[band->levels] = pipe->stages[s].halo;
+            band->size[band->levels-1] = 2*pipe->stages[s].halo + 1;
+            band->levels++;
+        }
+        band->domain[band->levels-1] = pipe->stages[s].out;
+    }
+    if(fmt->stride == fmt->width)
+        band->size[0] = 0;
+}
+
+// Lay out the rolling buffers and the scratch rows of a band from the
+// given memory, each on its own cache lines, or only size them for
+// NULL. Returns their bytes.
+INTERNAL size_t band_buffers(struct band *band, uint8_t *memory)
+{
+    const int width = band->pipe->fmt->width;
+    size_t size = 0;
+
+    for(int level = 0; level < band->levels; level++)
+    {
+        band->ring[level] = band->size[level] && memory ? memory + size : NULL;
+        if(band->size[level])
+            size += CACHE_LINES(band->size[level]*row_size(band->domain[level], width));
+    }
+    for(int domain = 0; domain < DOMAINS; domain++)
+    {
+        band->scratch[domain] = memory ? memory + size : NULL;
+        size += CACHE_LINES(row_size(domain, width));
+    }
+    return size;
+}
+
+// The threads running the bands of a pipeline.
+INTERNAL int pipeline_threads(const struct pipeline *pipe)
+{
+    const int bands = (pipe->fmt->height + pipe->band - 1) / pipe->band;
+    return pipe->threads < bands ? pipe->threads : bands;
+}
+
+// The bytes of the buffers of the bands of all the threads of a
+// pipeline, for run_pipeline().
+INTERNAL size_t pipeline_memory(const struct pipeline *pipe)
+{
+    struct band band = {0};
+    const int threads = pipeline_threads(pipe);
+
+    band_levels(&band, pipe);
+    return band_buffers(&band, NULL)*(threads > 1 ? threads : 1);
+}
+
+// Run the bands from begin to end of a pipeline. The rows above and
+// below a band needed by its neighbourhood stages are computed again by
+// each band, so the bands are independent, but only measured by their
+// own band.
+INTERNAL void pipeline_bands(void *arg, int begin, int end)
+{
+    struct pipeline_job *job = arg;
+    const struct pipeline *pipe = job->pipe;
+    const struct format *fmt = pipe->fmt;
+    struct band band = {0};
+    const int thread = __atomic_fetch_add(&job->threads, 1, __ATOMIC_RELAXED);
+
+    band_levels(&band, pipe);
+    band_buffers(&band, job->memory + thread*job->band_size);
+    band.frame = job->frame;
+    band.image = job->image;
+    for(int b = begin; b < end; b++)
+    {
+        int y0 = b*pipe->band, y1 = y0 + pipe->band < fmt->height ? y0 + pipe->band : fmt->height;
+        int level = band.levels - 1;
+        band.top = y0;
+        band.bottom = y1;
+        band.next[level] = y0;
+        for(; level > 0; level--)
+            band.next[level-1] = band.next[level] - band.halo[level] > 0 ? band.next[level] - band.halo[level] : 0;
+        band_ensure(&band, band.levels - 1, y1 - 1);
+    }
+}
+
+// Run a pipeline over a frame, band by band over its threads, saving the
+// rows of its last stage to the image. The buffers of the bands are
+// taken from the given memory, of pipeline_memory() bytes, so running it
+// allocates nothing.
+INTERNAL void run_pipeline(const struct pipeline *pipe, const uint16_t *frame, uint8_t *image, uint8_t *memory)
+{
+    struct band band = {0};
+    struct pipeline_job job = {pipe, frame, image, memory, 0, 0};
+
+    if(pipe->count == 0 || pipe->stages[pipe->count-1].out != DOMAIN_BGR8)
+    {
+        fprintf(stderr, "The pipeline doesn't end with an output stage.\n");
+        exit(-1);
+    }
+    band_levels(&band, pipe);
+    job.band_size = band_buffers(&band, NULL);
+    parallel_for(pipeline_threads(pipe), (pipe->fmt->height + pipe->band - 1) / pipe->band, pipeline_bands, &job);
+}
+
+// Make room for size bytes in a workspace, keeping its memory when it's
+// large enough already. Returns 0 for lack of memory.
+INTERNAL int reserve(struct workspace *workspace, size_t size)
+{
+    if(workspace->size >= size)
+        return 1;
+    free(workspace->data);
+    workspace->size = 0;
+    if(!(workspace->data = malloc(size)))
+        return 0;
+    workspace->size = size;
+    return 1;
+}
+
+// Sum up the focus of the zones of a frame from the sums of its rows.
+INTERNAL void sum_focus(const double *sums, const struct format *fmt, struct focus *focus)
+{
+    const int columns = focus->columns, rows = focus->rows;
+    double total[FOCUS_SUMS] = {0}, blocks = 0;
+
+    for(int zone = 0; zone < columns*rows; zone++)
+    {
+        const int column = zone % columns, row = zone / columns;
+        int x0 = fmt->width*column / columns, x1 = fmt->width*(column + 1) / columns;
+        int y0 = fmt->height*row / rows, y1 = fmt->height*(row + 1) / rows;
+        double zone_sums[FOCUS_SUMS] = {0};
+
+        // Without the edge blocks
+        x0 = x0 > 1 ? x0 : 1;
+        x1 = x1 < fmt->width - 1 ? x1 : fmt->width - 1;
+        y0 = y0 > 1 ? y0 : 1;
+        y1 = y1 < fmt->height - 1 ? y1 : fmt->height - 1;
+        for(int y = y0; y < y1; y++)
+            for(int i = 0; i < FOCUS_SUMS; i++)
+                zone_sums[i] += sums[((size_t)y*columns + column)*FOCUS_SUMS + i];
+        double count = x1 > x0 && y1 > y0 ? (double)(x1 - x0)*(y1 - y0) : 0;
+        for(int i = 0; i < FOCUS_SUMS; i++)
+            total[i] += zone_sums[i];
+        blocks += count;
+        if(focus->zones)
+        {
+            double mean = count ? zone_sums[0] / count : 0;
+            focus->zones[zone].laplacian = count ? zone_sums[1] / count - mean*mean : 0;
+            focus->zones[zone].tenengrad = count ? zone_sums[2] / count : 0;
+        }
+    }
+    double mean = blocks ? total[0] / blocks : 0;
+    focus->frame.laplacian = blocks ? total[1] / blocks - mean*mean : 0;
+    focus->frame.tenengrad = blocks ? total[2] / blocks : 0;
+}
+
+// Perform the actual de-Bayering, coverting RGGB to RGB image, through a
+// pipeline of the calibration when the options calibrate the frame, the
+// normalization when given, the demosaic and the packing
+// to 8 bits, fused into a single pass over the frame. Returns 0 for
+// lack of memory, or options that can't process the frame.
+int debayer(uint16_t *buffer, const struct format *fmt, const struct norm *norm, const struct options *options,
+            uint8_t *image, int threads)
+{
+    return debayer_focus(buffer, fmt, norm, options, image, threads, NULL, NULL);
+}
+
+// De-Bayer a frame, measuring its focus when given by a stage on the
+// calibrated frame, ahead of the normalization so the measure doesn't
+// depend on it. A normalized frame has its clipped highlights rebuilt
+// and is denoised first when asked for, for the focus to measure the
+// details rather than the noise. The lateral CA of the lens is then
+// corrected on the mosaic when there's a lens profile, about the optical
+// center of the whole frame even on a region of it, ahead of the focus
+// and the normalization. The false colors are suppressed after the
+// demosaic when asked for. All of them as the options ask for. The sums
+// of the focus and the buffers of the bands are taken from the
+// workspace, grown when it's too small, or allocated for this frame only
+// without one. Returns 0 for lack of memory, or options check_options()
+// refuses, the frame not converted.
+int debayer_focus(uint16_t *buffer, const struct format *fmt, const struct norm *norm, const struct options *options,
+                  uint8_t *image, int threads, struct focus *focus, struct workspace *workspace)
+{
+    struct pipeline pipe = {fmt, {{0}}, 0, tuning.band, threads};
+    struct focus_sums sums = {0};
+    struct workspace own = {0};
+    size_t sums_size = focus ? CACHE_LINES((size_t)fmt->height*focus->columns*FOCUS_SUMS*sizeof(double)) : 0;
+    struct levels levels;
+
+    if(!options)
+        options = &no_options;
+    if(!check_options(options, fmt))
+        return 0;
+
+    struct grading grading = {options->lut, NULL};
+    int threshold = denoise_threshold(norm, options);
+    struct highlights clipped = clipped_rows(norm, fmt, options);
+    struct lateral lateral = lateral_resampling(&options->lens, fmt);
+
+    if(calibrated(fmt, options))
+        add_stage(&pipe, "calibrate", DOMAIN_MOSAIC, DOMAIN_MOSAIC, 0, stage_calibrate, options);
+    if(clipped.count)
+        add_stage(&pipe, "highlights", DOMAIN_MOSAIC, DOMAIN_MOSAIC, 0, stage_highlights, &clipped);
+    if(threshold)
+        add_stage(&pipe, "denoise", DOMAIN_MOSAIC, DOMAIN_MOSAIC, 1, stage_denoise, &threshold);
+    if(lateral.halo)
+        add_stage(&pipe, "lateral", DOMAIN_MOSAIC, DOMAIN_MOSAIC, lateral.halo, stage_lateral, &lateral);
+    if(focus)
+    {
+        sums.columns = focus->columns;
+        add_stage(&pipe, "focus", DOMAIN_MOSAIC, DOMAIN_MOSAIC, 1, stage_focus, &sums);
+        pipe.stages[pipe.count-1].measures = 1;
+    }
+    if(norm)
+    {
+        levels.min = norm->min;
+        levels.mult = 1023 / (norm->max - norm->min);
+        grading.levels = norm->mode == NORM_FIXED ? &fixed_levels : &levels;
+        add_stage(&pipe, "normalize", DOMAIN_MOSAIC, DOMAIN_MOSAIC, 0, stage_normalize, grading.levels);
+    }
+    if(options->chroma)
+    {
+        add_stage(&pipe, "demosaic", DOMAIN_MOSAIC, DOMAIN_CHROMA, 0, stage_chroma_planes, NULL);
+        add_stage(&pipe, "chroma", DOMAIN_CHROMA, DOMAIN_RGB, 1, stage_chroma, NULL);
+    }
+    else
+        add_stage(&pipe, "demosaic", DOMAIN_MOSAIC, DOMAIN_RGB, 0, stage_demosaic, NULL);
+    if(options->lut)
+        add_stage(&pipe, "lut", DOMAIN_RGB, DOMAIN_BGR8, 0, stage_lut, &grading);
+    else
+        add_stage(&pipe, "pack", DOMAIN_RGB, DOMAIN_BGR8, 0, stage_pack, NULL);
+    fuse(&pipe);
+    if(!workspace)
+        workspace = &own;
+    if(!reserve(workspace, sums_size + pipeline_memory(&pipe)))
+        return 0;
+    if(focus)
+    {
+        sums.sums = workspace->data;
+        memset(sums.sums, 0, sums_size);
+    }
+    run_pipeline(&pipe, buffer, image, (uint8_t *)workspace->data + sums_size);
+    if(focus)
+        sum_focus(sums.sums, fmt, focus);
+    free(own.data);
+    return 1;
+}
+
+// Perform a binned de-Bayering, averaging each bin x bin group of Bayer
+// blocks into a single RGB pixel of a width/bin x height/bin image. The
+// image rows are stride bytes apart, so it can be a tile of a larger
+// image. When given a prepared normalization, the frame is normalized on
+// the fly instead of in a separate pass.
+INTERNAL void debayer_binned(uint16_t *buffer, const struct format *fmt, int bin, const struct norm *norm,
+                             uint8_t *image, int stride)
+{
+    const int width = fmt->width/bin;
+    const int count = bin*bin;
+    float min = 0, mult = 1;
+
+    if(norm)
+    {
+        min = norm->min;
+        mult = 1023 / (norm->max - min);
+    }
+    for(int y = 0; y < fmt->height/bin; y++)
+    {
+        uint8_t *row = image + y*stride;
+        for(int x = 0; x < width; x++)
+        {
+            unsigned int r = 0, g = 0, b = 0;
+            for(int j = 0; j < bin; j++)
+            {
+                for(int i = 0; i < bin; i++)
+                {
+                    int sx = bin*x+i, sy = bin*y+j;
+                    r += *(buffer + RG10_LOCATION(sx, sy, fmt->stride, fmt->r));
+                    b += *(buffer + RG10_LOCATION(sx, sy, fmt->stride, fmt->b));
+                    g += *(buffer + RG10_LOCATION(sx, sy, fmt->stride, fmt->gb)) +
+                         *(buffer + RG10_LOCATION(sx, sy, fmt->stride, fmt->gr));
+                }
+            }
+            unsigned int colors[RGB_COLORS];
+            colors[RGB_R] = r / count;
+            colors[RGB_G] = g / (2*count);
+            colors[RGB_B] = b / count;
+            for(int color = 0; color < RGB_COLORS; color++)
+            {
+                float value = round((colors[color] - min) * mult);
+                value = value < 0 ? 0 : value > MAX_RG10 ? MAX_RG10 : value;
+                row[x*RGB_COLORS + color] = NORM(value);
+            }
+        }
+    }
+}
+
+// Compute the grayscale plane of a frame, a byte per Bayer block, as a
+// weighted sum of the block's colors: the average of the greens, or the
+// BT.601 luma. The normalization, prepared from the colors used, and the
+// scaling to 8 bits are folded into the weights, so it's a single
+// multiply-add per color.
+void debayer_gray(uint16_t *buffer, const struct format *fmt, enum gray gray, const struct norm *norm, uint8_t *plane)
+{
+    const int *position = pattern_positions[fmt->pattern];
+    float weights[RG10_COLORS], min = 0, mult = 1;
+
+    if(norm)
+    {
+        min = norm->min;
+        mult = MAX_RG10 / (norm->max - min);
+    }
+
+    // The weights by the position in the block, which sum up to 1
+    float scale = mult*MAX_RGB / MAX_RG10;
+    weights[position[0]] = (gray == GRAY_GREEN ? 0 : LUMA_R)*scale;
+    weights[position[1]] = (gray == GRAY_GREEN ? 1 : LUMA_G) / 2*scale;
+    weights[position[2]] = (gray == GRAY_GREEN ? 1 : LUMA_G) / 2*scale;
+    weights[position[3]] = (gray == GRAY_GREEN ? 0 : LUMA_B)*scale;
+    float offset = -min*scale;
+
+    for(int y = 0; y < fmt->height; y++)
+    {
+        const uint16_t *top = buffer + RG10_LOCATION(0, y, fmt->stride, 0);
+        const uint16_t *bottom = top + fmt->stride*RG10_COLOR_SIZE;
+        uint8_t *out = plane + (size_t)y*fmt->width;
+        simd()->gray(top, bottom, out, fmt->width, weights, offset);
+    }
+}
+
+// Bytes per frame of a tensor.
+INTERNAL size_t tensor_size(const struct tensor *tensor)
+{
+    return (size_t)tensor->width*tensor->height*RGB_COLORS*(tensor->dtype == DTYPE_F32 ? sizeof(float) : 1);
+}
+
+// Fill the tensor rows from begin to end. Each tensor pixel is the
+// average of the Bayer blocks it covers, summed a frame row at a time
+// into per column accumulators, then normalized and stored in the
+// layout of the tensor.
+INTERNAL void tensor_rows(void *arg, int begin, int end)
+{
+    struct tensor_job *job = arg;
+    const struct format *fmt = job->fmt;
+    const struct tensor *tensor = job->tensor;
+    const int width = tensor->width, plane = tensor->width*tensor->height;
+    const int columns = job->x0[job->width] - job->x0[0];
+    uint32_t *sums = malloc(fmt->width*RGB_COLORS*sizeof(uint32_t));
+    uint32_t *r = sums, *g = sums + fmt->width, *b = sums + 2*fmt->width;
+    float scale[RGB_COLORS], offset[RGB_COLORS], low[RGB_COLORS], high[RGB_COLORS], pad[RGB_COLORS];
+
+    // Fold the normalization, the 0-1 range and the mean and std together
+    for(int c = 0; c < RGB_COLORS; c++)
+    {
+        float std = tensor->dtype == DTYPE_F32 ? tensor->std[c] : 1.0f / MAX_RGB;
+        float mean = tensor->dtype == DTYPE_F32 ? tensor->mean[c] : 0;
+        scale[c] = job->mult / MAX_RG10 / std;
+        offset[c] = -job->min*scale[c] - mean / std;
+        low[c] = -mean / std;
+        high[c] = (1 - mean) / std;
+        pad[c] = ((float)tensor->pad / MAX_RGB - mean) / std;
+    }
+
+    for(int y = begin; y < end; y++)
+    {
+        int row = y - job->top;
+        int inside = row >= 0 && row < job->height;
+        if(inside)
+        {
+            memset(sums, 0, fmt->width*RGB_COLORS*sizeof(uint32_t));
+            for(int sy = job->y0[row]; sy < job->y0[row+1]; sy++)
+            {
+                const uint16_t *line = job->buffer + RG10_LOCATION(0, sy, fmt->stride, 0);
+                for(int x = job->x0[0]; x < job->x0[0] + columns; x++)
+                {
+                    r[x] += line[2*x + fmt->r];
+                    g[x] += line[2*x + fmt->gr] + line[2*x + fmt->gb];
+                    b[x] += line[2*x + fmt->b];
+                }
+            }
+        }
+        for(int x = 0; x < width; x++)
+        {
+            int column = x - job->left;
+            float values[RGB_COLORS] = {pad[0], pad[1], pad[2]};
+            if(inside && column >= 0 && column < job->width)
+            {
+                uint32_t sum[RGB_COLORS] = {0};
+                for(int sx = job->x0[column]; sx < job->x0[column+1]; sx++)
+                {
+                    sum[0] += r[sx];
+                    sum[1] += g[sx];
+                    sum[2] += b[sx];
+                }
+                float count = (job->x0[column+1] - job->x0[column])*(job->y0[row+1] - job->y0[row]);
+                for(int c = 0; c < RGB_COLORS; c++)
+                {
+                    float value = sum[c] / (c == 1 ? 2*count : count)*scale[c] + offset[c];
+                    values[c] = value < low[c] ? low[c] : value > high[c] ? high[c] : value;
+                }
+            }
+            for(int c = 0; c < RGB_COLORS; c++)
+            {
+                size_t index = tensor->layout == LAYOUT_NCHW ? (size_t)c*plane + y*width + x : ((size_t)y*width + x)*RGB_COLORS + c;
+                if(tensor->dtype == DTYPE_F32)
+                    ((float *)job->out)[index] = values[c];
+                else
+                    ((uint8_t *)job->out)[index] = values[c] + 0.5f;
+            }
+        }
+    }
+    free(sums);
+}
+
+// Convert a frame into its place in the tensor batch, in one pass over
+// the Bayer frame. The frame is scaled to fit the tensor keeping its
+// aspect ratio, centered with the pad color around it.
+INTERNAL void tensor_frame(uint16_t *buffer, const struct format *fmt, const struct norm *norm, struct tensor *tensor,
+                           void *out)
+{
+    struct tensor_job job = {buffer, fmt, tensor, out, 0, 1, 0, 0, 0, 0, NULL, NULL};
+    double scale = fmin((double)tensor->width / fmt->width, (double)tensor->height / fmt->height);
+    int width = fmt->width*scale + 0.5, height = fmt->height*scale + 0.5;
+
+    if(norm)
+    {
+        job.min = norm->min;
+        job.mult = MAX_RG10 / (norm->max - norm->min);
+    }
+    job.width = width;
+    job.height = height;
+    job.left = (tensor->width - width) / 2;
+    job.top = (tensor->height - height) / 2;
+    job.x0 = malloc((width + height + 2)*sizeof(int));
+    job.y0 = job.x0 + width + 1;
+    for(int x = 0; x <= width; x++)
+        job.x0[x] = (int)((double)x*fmt->width / width);
+    for(int y = 0; y <= height; y++)
+        job.y0[y] = (int)((double)y*fmt->height / height);
+    // Upscaling, every tensor pixel still needs a block
+    for(int x = 0; x < width; x++)
+        if(job.x0[x+1] <= job.x0[x]) job.x0[x+1] = job.x0[x] + 1;
+    for(int y = 0; y < height; y++)
+        if(job.y0[y+1] <= job.y0[y]) job.y0[y+1] = job.y0[y] + 1;
+
+    parallel_for(tensor->threads, tensor->height, tensor_rows, &job);
+    free(job.x0);
+}
+
+// Save the current batch of a tensor output, named by the printf pattern
+// with the batch number.
+INTERNAL void write_tensor(char *pattern, struct tensor *tensor)
+{
+    char name[4096];
+    FILE *file;
+
+    snprintf(name, sizeof(name), pattern, tensor->index++);
+    file = fopen(name, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open file %s for writing.\n", name);
+        exit(-1);
+    }
+    fwrite(tensor->data, tensor_size(tensor), tensor->count, file);
+    fclose(file);
+    tensor->count = 0;
+}
+
+// Make and save the outputs from begin to end of a fan-out.
+INTERNAL void fan_out_outputs(void *arg, int begin, int end)
+{
+    struct fan_out *job = arg;
+    char name[4096];
+
+    for(int i = begin; i < end; i++)
+    {
+        struct output *output = &job->outputs[i];
+        const uint16_t *buffer = job->buffer + RG10_LOCATION(output->x, output->y, job->fmt->stride, 0);
+        struct format region = *job->fmt;
+        int bin = output->bin;
+
+        region.width = output->width;
+        region.height = output->height;
+        region.x = output->x;
+        region.y = output->y;
+        if(job->frame >= 0)
+            snprintf(name, sizeof(name), output->name, job->frame);
+        else
+            snprintf(name, sizeof(name), "%s", output->name);
+
+        if(output->gray)
+        {
+            // Bin the plane in place, every binned pixel is stored before
+            // the pixels it comes from
+            const int width = region.width/bin;
+            debayer_gray((uint16_t *)buffer, &region, output->gray, job->norm, output->image);
+            for(int y = 0; bin > 1 && y < region.height/bin; y++)
+            {
+                for(int x = 0; x < width; x++)
+                {
+                    unsigned int sum = 0;
+                    for(int j = 0; j < bin; j++)
+                        for(int i = 0; i < bin; i++)
+                            sum += output->image[(y*bin+j)*region.width + x*bin+i];
+                    output->image[y*width+x] = sum / (bin*bin);
+                }
+            }
+            write_gray(name, output->image, width, region.height/bin, !output->plane);
+        }
+        else if(bin == 1)
+        {
+            if(!debayer_focus((uint16_t *)buffer, &region, job->norm, job->options, output->image, 1, NULL,
+                              &output->workspace))
+            {
+                fprintf(stderr, "Out of memory converting %s.\n", name);
+                exit(-1);
+            }
+            write_tga(name, output->image, region.width, region.height);
+        }
+        else
+        {
+            debayer_binned((uint16_t *)buffer, &region, bin, job->norm, output->image, region.width/bin*RGB_COLORS);
+            write_tga(name, output->image, region.width/bin, region.height/bin);
+        }
+    }
+}
+
+// Convert a frame into all the outputs of a fan-out. The frame is read
+// and its normalization prepared once for all of them, then every output
+// is made and saved by its own thread.
+INTERNAL void fan_out(uint16_t *buffer, const struct format *fmt, const struct norm *norm,
+                      const struct options *options, struct output *outputs, int count, int threads, long frame)
+{
+    struct fan_out job = {outputs, buffer, fmt, norm, options, frame};
+    parallel_for(threads, count, fan_out_outputs, &job);
+}
+
+// Find the motion in a frame of a stream, reporting its score and saving
+// its mask next to the output, a byte per bin. Returns 0 when the frame
+// isn't converted, having too little motion.
+INTERNAL int gate_motion(struct stream *stream, unsigned long frame, char *name)
+{
+    const int columns = STATS_BINS(stream->fmt.width), rows = STATS_BINS(stream->fmt.height);
+    struct motion *motion = stream->motion;
+    char mask[4096];
+
+    if(!detect_motion(&stream->stats, &stream->fmt, motion))
+        return 1;
+    printf("stream %d frame %lu: motion %.2f%%\n", stream->id, frame, motion->score*100);
+    fflush(stdout);
+    if(motion->score < stream->gate)
+        return 0;
+    if(name)
+    {
+        uint8_t *plane = malloc(columns*rows);
+        for(int bin = 0; bin < columns*rows; bin++)
+            plane[bin] = motion->mask[bin] ? MAX_RGB : 0;
+        snprintf(mask, sizeof(mask), "%s.mask.tga", name);
+        write_gray(mask, plane, columns, rows, 1);
+        free(plane);
+    }
+    return 1;
+}
+
+// Convert a frame of a stream at the given tier and save it to the disk.
+// Its normalization is prepared first, gathering the statistics, so it
+// can be gated on the motion in it.
+INTERNAL void convert(struct stream *stream, uint16_t *buffer, uint8_t *image, enum tier tier, unsigned long frame)
+{
+    const struct format *fmt = &stream->fmt;
+    struct norm *norm = tier == TIER_FULL ? &stream->norm : NULL;
+    const struct norm *prepared = prepare_norm(buffer, fmt, !stream->outputs_count && stream->gray == GRAY_GREEN ?
+                                               COLORS_GREEN : COLORS_ALL, norm, &stream->options);
+    char name[4096];
+
+    if(stream->output)
+        snprintf(name, sizeof(name), stream->output, frame);
+    if(stream->motion && !gate_motion(stream, frame, stream->output ? name : NULL))
+        return;
+    if(stream->outputs_count)
+    {
+        fan_out(buffer, fmt, prepared, &stream->options, stream->outputs,
+                stream->outputs_count, stream->threads, frame);
+        return;
+    }
+    if(stream->gray)
+    {
+        debayer_gray(buffer, fmt, stream->gray, prepared, image);
+        write_gray(name, image, fmt->width, fmt->height, !stream->plane);
+    }
+    else if(stream->tensor)
+    {
+        struct tensor *tensor = stream->tensor;
+        tensor_frame(buffer, fmt, prepared, tensor, tensor->data + tensor->count++*tensor_size(tensor));
+        if(tensor->count == tensor->batch)
+            write_tensor(stream->output, tensor);
+    }
+    else if(tier == TIER_PREVIEW)
+    {
+        debayer_binned(buffer, fmt, 2, NULL, image, fmt->width/2*RGB_COLORS);
+        write_tga(name, image, fmt->width/2, fmt->height/2);
+    }
+    else
+    {
+        if(!debayer_focus(buffer, fmt, prepared, &stream->options, image, stream->threads, stream->focus,
+                          &stream->workspace))
+        {
+            fprintf(stderr, "Out of memory converting %s.\n", name);
+            exit(-1);
+        }
+        write_tga(name, image, fmt->width, fmt->height);
+        if(stream->focus)
+            write_focus(name, stream->focus);
+    }
+}
+
+// Gather the statistics of the frames of a stream, for finding flicker.
+// Once the stream is in its final place, as its normalization points
+// to them.
+INTERNAL void watch_flicker(struct stream *stream, double line)
+{
+    stream->line = line;
+    stream->stats.rows = malloc(stream->fmt.height*sizeof(uint32_t));
+    stream->norm.stats = &stream->stats;
+}
+
+// Find the motion in the frames of a stream, converting only those with
+// a score of at least gate. Once the stream is in its final place.
+INTERNAL void watch_motion(struct stream *stream, float threshold, float gate)
+{
+    const int bins = STATS_BINS(stream->fmt.width)*STATS_BINS(stream->fmt.height);
+
+    stream->motion = calloc(1, sizeof(struct motion));
+    stream->motion->threshold = threshold;
+    stream->motion->mask = malloc(bins);
+    stream->motion->background = malloc(bins*sizeof(float));
+    stream->stats.bins = malloc(bins*sizeof(uint32_t));
+    stream->norm.stats = &stream->stats;
+    stream->gate = gate;
+}
+
+// Count the samples of the frames of a stream clipped at the level of
+// its highlights, listing the rows holding them for reconstructing the
+// highlights. Once the stream is in its final place.
+INTERNAL void watch_highlights(struct stream *stream)
+{
+    stream->stats.clip = stream->options.highlights;
+    stream->stats.clipped_rows = malloc(stream->fmt.height*sizeof(int));
+    stream->norm.stats = &stream->stats;
+}
+
+// Report the flicker found in the last frame of a stream, if it was
+// normalized, i.e. its statistics gathered.
+INTERNAL void report_flicker(struct stream *stream, unsigned long frame)
+{
+    struct flicker flicker;
+    if(!detect_flicker(&stream->stats, &stream->fmt, stream->line, &flicker))
+        return;
+    printf("stream %d frame %lu: flicker %.0f Hz, amplitude %.2f%%\n", stream->id, frame, flicker.frequency,
+           flicker.amplitude*100);
+    fflush(stdout);
+}
+
+// Pick the best tier whose expected cost fits in the time left until
+// the deadline. Returns TIERS when the frame should be dropped.
+INTERNAL enum tier schedule(struct scheduler *sched, unsigned long frame)
+{
+    if(sched->period <= 0)
+        return TIER_FULL;
+
+    double slack = sched->start + (frame + 1)*sched->period - now();
+    if(slack <= 0 && sched->drop == DROP_LATE)
+        return TIERS;
+    for(int tier = TIER_FULL; tier < TIERS - 1; tier++)
+        if(sched->cost[tier] <= slack)
+            return tier;
+    return TIERS - 1;
+}
+
+// Account for a converted frame, updating the tier cost average.
+INTERNAL void account(struct stream *stream, unsigned long frame, enum tier tier, double start, int verbose)
+{
+    struct scheduler *sched = &stream->sched;
+    double end = now();
+    double late = end - (sched->start + (frame + 1)*sched->period);
+
+    if(sched->frames[tier]++ == 0)
+        sched->cost[tier] = end - start;
+    else
+        sched->cost[tier] += EMA_WEIGHT*(end - start - sched->cost[tier]);
+    if(end - start > stream->max_cost)
+        stream->max_cost = end - start;
+    if(sched->period > 0 && late > 0)
+    {
+        sched->missed++;
+        if(late > sched->max_late)
+            sched->max_late = late;
+    }
+    if(verbose)
+        fprintf(stderr, "stream %d frame %lu: %s, %.1f ms%s\n", stream->id, frame, tier_names[tier],
+                (end - start)*1e3, sched->period > 0 && late > 0 ? ", late" : "");
+}
+
+// Read, convert and save the next frame of a stream, using the buffers
+// of the calling worker. Returns 0 at the end of the stream.
+INTERNAL int process_frame(struct stream *stream, uint16_t *buffer, uint8_t *image, int verbose)
+{
+    struct scheduler *sched = &stream->sched;
+    unsigned long frame = stream->frame;
+
+    if(!read_frame(stream->file, buffer, &stream->fmt))
+        return 0;
+    stream->frame++;
+
+    double start = now();
+    if(frame == 0)
+        sched->start = start;
+
+    enum tier tier = schedule(sched, frame);
+    if(tier == TIERS)
+    {
+        sched->dropped++;
+        if(verbose)
+            fprintf(stderr, "stream %d frame %lu: dropped\n", stream->id, frame);
+        return 1;
+    }
+    stream->stats.gathered = 0;
+    convert(stream, buffer, image, tier, frame);
+    if(stream->line > 0)
+        report_flicker(stream, frame);
+    account(stream, frame, tier, start, verbose);
+    return 1;
+}
+
+// Pick the stream to work on next: the one with the least weighted
+// worker time among those not taken by another worker. Returns NULL
+// if there is none.
+INTERNAL struct stream *pick_stream(struct pool *pool)
+{
+    struct stream *best = NULL;
+    for(int i = 0; i < pool->count; i++)
+    {
+        struct stream *stream = &pool->streams[i];
+        if(!stream->running && !stream->done && (!best || stream->vtime < best->vtime))
+            best = stream;
+    }
+    return best;
+}
+
+// A worker thread, processing a frame of a stream at a time until all
+// the streams end. Every worker has its own buffers, sized for the
+// largest stream, so the memory grows with the threads and not the
+// cameras.
+INTERNAL void *worker(void *arg)
+{
+    struct pool *pool = arg;
+    uint16_t *buffer = malloc(pool->raw_size);
+    uint8_t *image = malloc(pool->rgb_size);
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        struct stream *stream = pick_stream(pool);
+        if(!stream)
+        {
+            int left = 0;
+            for(int i = 0; i < pool->count; i++)
+                left += !pool->streams[i].done;
+            if(!left)
+                break;
+            pthread_cond_wait(&pool->idle, &pool->lock);
+            continue;
+        }
+        stream->running = 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        double start = now();
+        int more = process_frame(stream, buffer, image, pool->verbose);
+        double cost = now() - start;
+
+        pthread_mutex_lock(&pool->lock);
+        stream->running = 0;
+        stream->busy += cost;
+        stream->vtime += cost / stream->weight;
+        if(!more)
+            stream->done = 1;
+        pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(buffer);
+    free(image);
+    return NULL;
+}
+
+// Print the metrics of a stream.
+INTERNAL void report(struct stream *stream, double elapsed)
+{
+    struct scheduler *sched = &stream->sched;
+
+    fprintf(stderr, "stream %d (%s): %lu frames:", stream->id, stream->input, stream->frame);
+    for(int tier = TIER_FULL; tier < TIERS; tier++)
+        fprintf(stderr, " %lu %s (%.1f ms),", sched->frames[tier], tier_names[tier], sched->cost[tier]*1e3);
+    fprintf(stderr, " %lu dropped", sched->dropped);
+    if(sched->period > 0)
+        fprintf(stderr, ", %lu late (worst by %.1f ms)", sched->missed, sched->max_late*1e3);
+    fprintf(stderr, ", slowest %.1f ms, %.1f fps, %.0f%% of a core\n", stream->max_cost*1e3,
+            elapsed > 0 ? stream->frame / elapsed : 0, elapsed > 0 ? 100*stream->busy / elapsed : 0);
+}
+
+// Convert all the frames of the streams using the given number of
+// worker threads, naming the outputs by the printf pattern of each
+// stream with the frame number.
+INTERNAL void run(struct stream *streams, int count, int threads, int verbose)
+{
+    struct pool pool = {streams, count, verbose, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for(int i = 0; i < count; i++)
+    {
+        struct stream *stream = &streams[i];
+        size_t raw_size = RG10_SIZE(stream->fmt.width, stream->fmt.height);
+        size_t rgb_size = RGB_SIZE(stream->fmt.width, stream->fmt.height);
+
+        stream->file = strcmp(stream->input, "-") ? fopen(stream->input, "rb") : stdin;
+        if (!stream->file)
+        {
+            fprintf(stderr, "Unable to open file %s for reading.\n", stream->input);
+            exit(-1);
+        }
+        if(raw_size > pool.raw_size) pool.raw_size = raw_size;
+        if(rgb_size > pool.rgb_size) pool.rgb_size = rgb_size;
+    }
+
+    double start = now();
+    for(int i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, worker, &pool);
+    for(int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    double elapsed = now() - start;
+
+    for(int i = 0; i < count; i++)
+    {
+        if(streams[i].tensor && streams[i].tensor->count)
+            write_tensor(streams[i].output, streams[i].tensor);
+        report(&streams[i], elapsed);
+        if(streams[i].file != stdin)
+            fclose(streams[i].file);
+    }
+    free(workers);
+}
+
+// A video wall worker, converting every threads-th tile on each refresh.
+// The first worker saves the image once all the tiles are done, and the
+// wall stops at the end of the shortest input.
+INTERNAL void *wall_thread(void *arg)
+{
+    struct wall_worker *self = arg;
+    struct wall *wall = self->wall;
+    uint16_t *buffer = malloc(wall->raw_size);
+    const int stride = wall->width*RGB_COLORS;
+    char name[4096];
+
+    for(unsigned long frame = 0; ; frame++)
+    {
+        for(int i = self->index; i < wall->count; i += wall->threads)
+        {
+            struct stream *stream = &wall->streams[i];
+            uint8_t *tile = wall->image + (i / wall->columns)*wall->tile_height*stride +
+                            (i % wall->columns)*wall->tile_width*RGB_COLORS;
+
+            if(read_frame(stream->file, buffer, &stream->fmt))
+                debayer_binned(buffer, &stream->fmt, wall->bin, prepare_norm(buffer, &stream->fmt, COLORS_ALL,
+                               &stream->norm, &stream->options), tile, stride);
+            else
+                stream->done = 1;
+        }
+        pthread_barrier_wait(&wall->barrier);
+
+        int ended = 0;
+        for(int i = 0; i < wall->count; i++)
+            ended |= wall->streams[i].done;
+        if(self->index == 0 && !ended)
+        {
+            snprintf(name, sizeof(name), wall->streams[0].output, frame);
+            write_tga(name, wall->image, wall->width, wall->height);
+            wall->streams[0].frame = frame + 1;
+        }
+        pthread_barrier_wait(&wall->barrier);
+        if(ended)
+            break;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Composite the streams into a video wall of columns x rows tiles, each
+// binned by the given factor, saving an image per refresh named by the
+// output printf pattern.
+INTERNAL void run_wall(struct stream *streams, int count, int columns, int rows, int bin, int threads, char *output)
+{
+    struct wall wall = {0};
+
+    wall.streams = streams;
+    wall.count = count;
+    wall.threads = threads < count ? threads : count;
+    wall.columns = columns;
+    wall.rows = rows;
+    wall.bin = bin;
+    if(count > columns*rows)
+    {
+        fprintf(stderr, "%d cameras don't fit in a %dx%d wall.\n", count, columns, rows);
+        exit(-1);
+    }
+    for(int i = 0; i < count; i++)
+    {
+        struct stream *stream = &streams[i];
+        size_t raw_size = RG10_SIZE(stream->fmt.width, stream->fmt.height);
+
+        stream->output = output;
+        stream->file = strcmp(stream->input, "-") ? fopen(stream->input, "rb") : stdin;
+        if (!stream->file)
+        {
+            fprintf(stderr, "Unable to open file %s for reading.\n", stream->input);
+            exit(-1);
+        }
+        if(raw_size > wall.raw_size) wall.raw_size = raw_size;
+        if(stream->fmt.width/bin > wall.tile_width) wall.tile_width = stream->fmt.width/bin;
+        if(stream->fmt.height/bin > wall.tile_height) wall.tile_height = stream->fmt.height/bin;
+    }
+    wall.width = columns*wall.tile_width;
+    wall.height = rows*wall.tile_height;
+    wall.image = calloc(1, RGB_SIZE(wall.width, wall.height));
+    struct wall_worker *workers = malloc(wall.threads * sizeof(struct wall_worker));
+    pthread_t *ids = malloc(wall.threads * sizeof(pthread_t));
+    pthread_barrier_init(&wall.barrier, NULL, wall.threads);
+
+    double start = now();
+    for(int i = 0; i < wall.threads; i++)
+    {
+        workers[i].wall = &wall;
+        workers[i].index = i;
+        pthread_create(&ids[i], NULL, wall_thread, &workers[i]);
+    }
+    for(int i = 0; i < wall.threads; i++)
+        pthread_join(ids[i], NULL);
+    double elapsed = now() - start;
+
+    fprintf(stderr, "wall %dx%d of %dx%d tiles: %lu refreshes, %.1f ms each\n", columns, rows,
+            wall.tile_width, wall.tile_height, streams[0].frame,
+            streams[0].frame ? elapsed*1e3 / streams[0].frame : 0);
+    for(int i = 0; i < count; i++)
+        if(streams[i].file != stdin)
+            fclose(streams[i].file);
+    pthread_barrier_destroy(&wall.barrier);
+    free(wall.image);
+    free(workers);
+    free(ids);
+}
+
+// Compress a frame losslessly. Every color is stored as the difference
+// from the previous one of the same color in the row, zigzag encoded in
+// 1 or 2 bytes, or escaped and stored as is in 3 bytes. The output must
+// fit 3 bytes per color. Returns the compressed size.
+INTERNAL size_t pack_frame(const uint16_t *buffer, const struct format *fmt, uint8_t *out)
+{
+    const int columns = fmt->width*RG10_COLOR_SIZE;
+    uint8_t *start = out;
+
+    for(int y = 0; y < fmt->height*2; y++)
+    {
+        const uint16_t *row = buffer + (size_t)y*columns;
+        for(int x = 0; x < columns; x++)
+        {
+            int delta = row[x] - (x >= 2 ? row[x-2] : 0);
+            unsigned int zigzag = delta < 0 ? -2*delta - 1 : 2*delta;
+            if(zigzag < 0x80)
+                *out++ = zigzag;
+            else if(zigzag < 0x4000)
+            {
+                *out++ = 0x80 | zigzag >> 8;
+                *out++ = zigzag;
+            }
+            else
+            {
+                *out++ = 0xc0;
+                *out++ = row[x];
+                *out++ = row[x] >> 8;
+            }
+        }
+    }
+    return out - start;
+}
+
+// Decompress a frame compressed by pack_frame().
+INTERNAL void unpack_frame(const uint8_t *in, const struct format *fmt, uint16_t *buffer)
+{
+    const int columns = fmt->width*RG10_COLOR_SIZE;
+
+    for(int y = 0; y < fmt->height*2; y++)
+    {
+        uint16_t *row = buffer + (size_t)y*columns;
+        for(int x = 0; x < columns; x++)
+        {
+            unsigned int zigzag = *in++;
+            if(zigzag >= 0xc0)
+            {
+                row[x] = in[0] | in[1] << 8;
+                in += 2;
+                continue;
+            }
+            if(zigzag >= 0x80)
+                zigzag = (zigzag & 0x3f) << 8 | *in++;
+            int delta = zigzag & 1 ? -(int)(zigzag >> 1) - 1 : (int)(zigzag >> 1);
+            row[x] = delta + (x >= 2 ? row[x-2] : 0);
+        }
+    }
+}
+
+// Compress a frame into a newly allocated packed frame, keeping it as is
+// when it doesn't compress.
+INTERNAL struct packed pack(const uint16_t *buffer, const struct format *fmt, uint8_t *scratch, unsigned long frame)
+{
+    struct packed packed = {0};
+    size_t raw_size = RG10_SIZE(fmt->width, fmt->height);
+
+    packed.frame = frame;
+    packed.size = pack_frame(buffer, fmt, scratch);
+    if(packed.size >= raw_size)
+    {
+        packed.size = raw_size;
+        scratch = (uint8_t *)buffer;
+    }
+    packed.data = malloc(packed.size);
+    memcpy(packed.data, scratch, packed.size);
+    return packed;
+}
+
+// Queue a packed frame for conversion.
+INTERNAL void enqueue(struct ring *ring, struct packed packed)
+{
+    struct packed *item = malloc(sizeof(struct packed));
+    *item = packed;
+
+    pthread_mutex_lock(&ring->lock);
+    if(ring->tail)
+        ring->tail->next = item;
+    else
+        ring->head = item;
+    ring->tail = item;
+    ring->queued_bytes += packed.size;
+    pthread_cond_signal(&ring->queued);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Wait for the room of a frame of the given bytes within the budget,
+// along with the ring and the conversion queue, unless the frames that
+// don't fit are dropped. Returns 0 when there isn't room. A frame always
+// fits an empty queue.
+INTERNAL int make_room(struct ring *ring, size_t bytes, enum drop drop)
+{
+    int room;
+
+    pthread_mutex_lock(&ring->lock);
+    while(!(room = !ring->queued_bytes || ring->queued_bytes + ring->bytes + bytes <= ring->budget) &&
+          drop == DROP_NEVER)
+        pthread_cond_wait(&ring->freed, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+    return room;
+}
+
+// A ring worker, converting the queued frames until the input ends and
+// the queue is empty. The frames are normalized independently, since
+// they are converted out of order.
+INTERNAL void *ring_worker(void *arg)
+{
+    struct ring *ring = arg;
+    struct stream *stream = ring->stream;
+    const struct format *fmt = &stream->fmt;
+    size_t raw_size = RG10_SIZE(fmt->width, fmt->height);
+    uint16_t *buffer = malloc(raw_size);
+    uint8_t *image = malloc(RGB_SIZE(fmt->width, fmt->height));
+    struct workspace workspace = {0};
+    char name[4096];
+
+    for(;;)
+    {
+        pthread_mutex_lock(&ring->lock);
+        while(!ring->head && !ring->ended)
+            pthread_cond_wait(&ring->queued, &ring->lock);
+        struct packed *item = ring->head;
+        if(item)
+        {
+            ring->head = item->next;
+            if(!ring->head)
+                ring->tail = NULL;
+        }
+        pthread_mutex_unlock(&ring->lock);
+        if(!item)
+            break;
+
+        if(item->size == raw_size)
+            memcpy(buffer, item->data, raw_size);
+        else
+            unpack_frame(item->data, fmt, buffer);
+        struct norm norm = {stream->norm.mode == NORM_SMOOTH ? NORM_FRAME : stream->norm.mode, 0, 0, 0, NULL};
+        snprintf(name, sizeof(name), stream->output, item->frame);
+        if(!debayer_focus(buffer, fmt, prepare_norm(buffer, fmt, COLORS_ALL, &norm, &stream->options),
+                          &stream->options, image, 1, NULL, &workspace))
+        {
+            fprintf(stderr, "Out of memory converting %s.\n", name);
+            exit(-1);
+        }
+        write_tga(name, image, fmt->width, fmt->height);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->queued_bytes -= item->size;
+        pthread_cond_signal(&ring->freed);
+        pthread_mutex_unlock(&ring->lock);
+        free(item->data);
+        free(item);
+    }
+    free(buffer);
+    free(image);
+    free(workspace.data);
+    return NULL;
+}
+
+INTERNAL void on_trigger(int signal)
+{
+    (void)signal;
+    triggered = 1;
+}
+
+// Check the trigger sources, consuming any trigger found.
+INTERNAL int check_trigger(struct trigger *trigger, int sock)
+{
+    char message[256];
+    int hit = triggered;
+
+    triggered = 0;
+    if(trigger->file && access(trigger->file, F_OK) == 0)
+    {
+        unlink(trigger->file);
+        hit = 1;
+    }
+    while(sock >= 0 && recv(sock, message, sizeof(message), MSG_DONTWAIT) >= 0)
+        hit = 1;
+    return hit;
+}
+
+// Open the UNIX datagram socket receiving triggers, or return -1 when
+// there isn't one.
+INTERNAL int open_trigger_socket(char *path)
+{
+    struct sockaddr_un addr = {0};
+    int sock;
+
+    if(!path)
+        return -1;
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if(sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Unable to listen for triggers on %s.\n", path);
+        exit(-1);
+    }
+    return sock;
+}
+
+// Capture a stream into the pre-trigger ring, and on every trigger queue
+// the ring and the frames following it for conversion by the workers.
+// The frames queued count against the budget of the ring, so when the
+// workers fall behind the capture waits for them, or drops the frames
+// that don't fit with the late drop policy.
+INTERNAL void run_ring(struct stream *stream, struct trigger *trigger, int threads)
+{
+    const struct format *fmt = &stream->fmt;
+    size_t raw_size = RG10_SIZE(fmt->width, fmt->height);
+    uint16_t *buffer = malloc(raw_size);
+    uint8_t *scratch = malloc(raw_size / RG10_COLOR_SIZE * 3);
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    struct ring ring = {0};
+    unsigned long post = 0, triggers = 0, converted = 0, dropped = 0, frame;
+    size_t peak = 0, packed_bytes = 0;
+    int sock = open_trigger_socket(trigger->socket);
+
+    ring.stream = stream;
+    ring.capacity = trigger->pre*trigger->fps + 0.5;
+    ring.frames = calloc(ring.capacity ? ring.capacity : 1, sizeof(struct packed));
+    ring.budget = trigger->budget;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.queued, NULL);
+    pthread_cond_init(&ring.freed, NULL);
+    signal(SIGUSR1, on_trigger);
+
+    stream->file = strcmp(stream->input, "-") ? fopen(stream->input, "rb") : stdin;
+    if (!stream->file)
+    {
+        fprintf(stderr, "Unable to open file %s for reading.\n", stream->input);
+        exit(-1);
+    }
+    for(int i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, ring_worker, &ring);
+
+    for(frame = 0; read_frame(stream->file, buffer, fmt); frame++)
+    {
+        struct packed packed = pack(buffer, fmt, scratch, frame);
+        packed_bytes += packed.size;
+
+        if(check_trigger(trigger, sock))
+        {
+            triggers++;
+            converted += ring.count;
+            for(; ring.count; ring.count--, ring.first = (ring.first + 1) % ring.capacity)
+                enqueue(&ring, ring.frames[ring.first]);
+            ring.bytes = 0;
+            post = trigger->post*trigger->fps + 1;
+        }
+        if(post)
+        {
+            post--;
+            if(!make_room(&ring, packed.size, stream->sched.drop))
+            {
+                dropped++;
+                free(packed.data);
+                continue;
+            }
+            converted++;
+            enqueue(&ring, packed);
+            continue;
+        }
+        if(!ring.capacity)
+        {
+            free(packed.data);
+            continue;
+        }
+
+        // Make room, evicting the oldest frames, then waiting for the
+        // conversions when the queue still holds the rest of the budget
+        pthread_mutex_lock(&ring.lock);
+        size_t queued = ring.queued_bytes;
+        pthread_mutex_unlock(&ring.lock);
+        while(ring.count && (ring.count == ring.capacity || queued + ring.bytes + packed.size > trigger->budget))
+        {
+            ring.bytes -= ring.frames[ring.first].size;
+            free(ring.frames[ring.first].data);
+            ring.first = (ring.first + 1) % ring.capacity;
+            ring.count--;
+        }
+        if(!make_room(&ring, packed.size, stream->sched.drop))
+        {
+            dropped++;
+            free(packed.data);
+            continue;
+        }
+        ring.frames[(ring.first + ring.count++) % ring.capacity] = packed;
+        ring.bytes += packed.size;
+        if(ring.bytes > peak)
+            peak = ring.bytes;
+    }
+
+    pthread_mutex_lock(&ring.lock);
+    ring.ended = 1;
+    pthread_cond_broadcast(&ring.queued);
+    pthread_mutex_unlock(&ring.lock);
+    for(int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    fprintf(stderr, "%lu frames, %lu triggers, %lu converted, %lu dropped, compressed to %.0f%%, ring peak %.1f MB\n",
+            frame, triggers, converted, dropped, frame ? 100.0*packed_bytes / (frame*raw_size) : 0,
+            peak / 1048576.0);
+    for(; ring.count; ring.count--, ring.first = (ring.first + 1) % ring.capacity)
+        free(ring.frames[ring.first].data);
+    if(stream->file != stdin)
+        fclose(stream->file);
+    if(sock >= 0)
+    {
+        close(sock);
+        unlink(trigger->socket);
+    }
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.queued);
+    pthread_cond_destroy(&ring.freed);
+    free(ring.frames);
+    free(buffer);
+    free(scratch);
+    free(workers);
+}
+
+// Load the tuning profile, when there's one. Lines of the profile are
+// key=value, and the keys it doesn't know are skipped.
+INTERNAL void load_profile(const char *name)
+{
+    FILE *file = fopen(name, "r");
+    char line[256];
+
+    if(!file)
+        return;
+    while(fgets(line, sizeof(line), file))
+    {
+        int value;
+        if(sscanf(line, "band=%d", &value) == 1 && value > 0)
+            tuning.band = value;
+        else if(sscanf(line, "threads=%d", &value) == 1 && value >= 0)
+            tuning.threads = value;
+        else if(sscanf(line, "jit=%d", &value) == 1)
+            tuning.jit = value != 0;
+    }
+    fclose(file);
+}
+
+// Save the tuning to a profile.
+INTERNAL void save_profile(const char *name)
+{
+    FILE *file = fopen(name, "w");
+
+    if(!file)
+    {
+        fprintf(stderr, "Can't write the profile %s.\n", name);
+        exit(-1);
+    }
+    fprintf(file, "# bayer2tga tuning profile, written by --autotune\n");
+    fprintf(file, "band=%d\nthreads=%d\njit=%d\n", tuning.band, tuning.threads, tuning.jit);
+    fclose(file);
+}
+
+// Time the conversion of the frames with the current tuning, taking the
+// fastest of a few repeats of each frame. Returns the total in seconds.
+INTERNAL double time_conversion(uint16_t **frames, int count, const struct format *fmt,
+                                const struct options *options, uint8_t *image)
+{
+    double total = 0;
+    struct workspace workspace = {0};
+
+    for(int i = 0; i < count; i++)
+    {
+        struct norm norm = {NORM_FRAME, 0, 0, 0, NULL};
+        const struct norm *prepared = prepare_norm(frames[i], fmt, COLORS_ALL, &norm, options);
+        double best = 0;
+        for(int repeat = 0; repeat < TUNE_REPEATS; repeat++)
+        {
+            double start = now();
+            if(!debayer_focus(frames[i], fmt, prepared, options, image, tuning.threads, NULL, &workspace))
+            {
+                fprintf(stderr, "Out of memory converting the frames.\n");
+                exit(-1);
+            }
+            double seconds = now() - start;
+            if(!repeat || seconds < best)
+                best = seconds;
+        }
+        total += best;
+    }
+    free(workspace.data);
+    return total;
+}
+
+// Benchmark the conversion of a synthetic frame, and of the given one
+// when there's one, processed by the options, with every band size,
+// thread count and kernel. The fastest is saved to the profile, which
+// the following runs load.
+INTERNAL void autotune(char *input, const struct format *fmt, const struct options *options, const char *profile,
+                       int verbose)
+{
+    const int bands[] = {4, 8, 16, 32, 64, 128};
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    const int kernels = jit_lookup(fused_normalize_demosaic_pack, fmt) ? 2 : 1;
+    uint16_t *frames[2];
+    uint8_t *image = malloc(RGB_SIZE(fmt->width, fmt->height));
+    int count = 0, threads[64], candidates = 0;
+    struct tuning best = tuning;
+    double fastest = 0;
+
+    // Powers of 2 threads, and a thread per core
+    for(int n = 1; n < cores && candidates < 63; n *= 2)
+        threads[candidates++] = n;
+    threads[candidates++] = cores;
+
+    // A synthetic frame of gradients with some noise, and the real one
+    frames[count] = malloc(RG10_SIZE(fmt->width, fmt->height));
+    for(int i = 0; i < fmt->width*fmt->height*RG10_COLORS; i++)
+        frames[count][i] = (i % (fmt->width*RG10_COLOR_SIZE)*MAX_RG10 / (fmt->width*RG10_COLOR_SIZE) + rand() % 64) & MAX_RG10;
+    count++;
+    if(input)
+        frames[count++] = read_file(input, fmt);
+
+    for(tuning.jit = 0; tuning.jit < kernels; tuning.jit++)
+    {
+        for(int t = 0; t < candidates; t++)
+        {
+            tuning.threads = threads[t];
+            for(size_t band = 0; band < sizeof(bands)/sizeof(bands[0]); band++)
+            {
+                tuning.band = bands[band];
+                double seconds = time_conversion(frames, count, fmt, options, image);
+                if(verbose)
+                    fprintf(stderr, "band %3d, %2d threads, %s kernels: %.2f ms\n", tuning.band, tuning.threads,
+                            tuning.jit ? "compiled" : "generic", seconds*1000/count);
+                if(!fastest || seconds < fastest)
+                {
+                    fastest = seconds;
+                    best = tuning;
+                }
+            }
+        }
+    }
+    tuning = best;
+    save_profile(profile);
+    fprintf(stderr, "%s: band %d, %d threads, %s kernels, %.2f ms per frame\n", profile, tuning.band,
+            tuning.threads, tuning.jit ? "compiled" : "generic", fastest*1000/count);
+    for(int i = 0; i < count; i++)
+        free(frames[i]);
+    free(image);
+}
+
+// Read size bytes at an offset of a file. Returns 0 when there aren't
+// as many.
+INTERNAL int read_at(int fd, void *buffer, size_t size, off_t offset)
+{
+    while(size)
+    {
+        ssize_t done = pread(fd, buffer, size, offset);
+        if(done <= 0)
+            return 0;
+        buffer = (uint8_t *)buffer + done;
+        size -= done;
+        offset += done;
+    }
+    return 1;
+}
+
+// The median of count values, reordering them by a quickselect. Of an
+// even count, the mean of the two middle ones.
+INTERNAL uint16_t median(uint16_t *values, int count)
+{
+    int k = count/2, low = 0, high = count - 1;
+
+    while(low < high)
+    {
+        uint16_t pivot = values[(low + high)/2], swap;
+        int i = low, j = high;
+        while(i <= j)
+        {
+            while(values[i] < pivot) i++;
+            while(values[j] > pivot) j--;
+            if(i <= j)
+            {
+                swap = values[i];
+                values[i++] = values[j];
+                values[j--] = swap;
+            }
+        }
+        if(k <= j)
+            high = j;
+        else if(k >= i)
+            low = i;
+        else
+            break;
+    }
+    if(count & 1)
+        return values[k];
+
+    // The values before k are all smaller, the lower middle is their max
+    uint16_t lower = values[0];
+    for(int i = 1; i < k; i++)
+        if(lower < values[i]) lower = values[i];
+    return (lower + values[k] + 1)/2;
+}
+
+// The mean of count values without the outliers, those more than sigma
+// std away from the mean, repeated on the values kept until no more are
+// left out.
+INTERNAL uint16_t clipped_mean(const uint16_t *values, int count, float sigma)
+{
+    double low = 0, high = 65535, mean = 0;
+    int kept = 0;
+
+    for(int round = 0; round < CLIP_ROUNDS; round++)
+    {
+        uint64_t sum = 0, squares = 0;
+        int previous = kept;
+        kept = 0;
+        for(int i = 0; i < count; i++)
+        {
+            if(values[i] < low || values[i] > high)
+                continue;
+            sum += values[i];
+            squares += (uint64_t)values[i]*values[i];
+            kept++;
+        }
+        if(!kept || kept == previous)
+            break;
+        mean = (double)sum/kept;
+        double std = sqrt(fmax((double)squares/kept - mean*mean, 0));
+        low = mean - sigma*std;
+        high = mean + sigma*std;
+    }
+    return (uint16_t)(mean + 0.5);
+}
+
+// Combine the tiles from begin to end of a stack: read the tile of every
+// frame, and combine the values of each sample.
+INTERNAL void stack_tiles(void *arg, int begin, int end)
+{
+    const struct stack *stack = arg;
+    const struct format *fmt = stack->fmt;
+    const size_t row = (size_t)fmt->width*RG10_COLORS;   // Samples in a row of blocks
+    const size_t packed = RAW10_SIZE(fmt->width, 1);
+    uint16_t *tiles = malloc(stack->count*stack->rows*row*sizeof(uint16_t));
+    uint16_t *values = malloc(stack->count*sizeof(uint16_t));
+    uint8_t *raw = fmt->packed ? malloc(stack->rows*packed) : NULL;
+    if(!tiles || !values || (fmt->packed && !raw))
+    {
+        fprintf(stderr, "Out of memory stacking the frames.\n");
+        exit(-1);
+    }
+
+    for(int t = begin; t < end; t++)
+    {
+        const int y = t*stack->rows;
+        const int rows = y + stack->rows < fmt->height ? stack->rows : fmt->height - y;
+        const size_t samples = rows*row;
+
+        for(int f = 0; f < stack->count; f++)
+        {
+            uint16_t *tile = tiles + f*samples;
+            int complete;
+            if(fmt->packed)
+            {
+                complete = read_at(stack->fds[f], raw, rows*packed, stack->offsets[f] + y*packed);
+                simd()->unpack(raw, tile, samples);
+            }
+            else
+                complete = read_at(stack->fds[f], tile, samples*sizeof(uint16_t),
+                                   stack->offsets[f] + y*row*sizeof(uint16_t));
+            if(!complete)
+            {
+                fprintf(stderr, "Unable to read frame %d of the stack.\n", f);
+                exit(-1);
+            }
+        }
+
+        uint16_t *out = stack->result + y*row;
+        for(size_t i = 0; i < samples; i++)
+        {
+            uint64_t sum = 0;
+            for(int f = 0; f < stack->count; f++)
+                sum += values[f] = tiles[f*samples + i];
+            switch(stack->mode)
+            {
+            case STACK_CLIP: out[i] = clipped_mean(values, stack->count, stack->sigma); break;
+            case STACK_MEDIAN: out[i] = median(values, stack->count); break;
+            default: out[i] = (sum + stack->count/2) / stack->count; break;
+            }
+        }
+    }
+    free(tiles);
+    free(values);
+    free(raw);
+}
+
+// Turn a stacked flat field into the gains correcting it: the mean of
+// each color over the frame divided by the sample, after subtracting the
+// dark frame when given. Dead samples are left alone.
+INTERNAL void flat_gains(uint16_t *flat, const struct format *fmt, const uint16_t *dark)
+{
+    const size_t row = (size_t)fmt->width*RG10_COLORS, size = row*fmt->height;
+    double sums[RG10_COLORS] = {0}, means[RG10_COLORS];
+
+    // By the position in the block, the first half of a row of blocks
+    // being the top row of the sensor
+    for(size_t i = 0; i < size; i++)
+    {
+        if(dark)
+            flat[i] = flat[i] > dark[i] ? flat[i] - dark[i] : 0;
+        sums[(i % row >= row/2)*2 + (i & 1)] += flat[i];
+    }
+    for(int position = 0; position < RG10_COLORS; position++)
+        means[position] = sums[position] / (size/RG10_COLORS);
+    for(size_t i = 0; i < size; i++)
+    {
+        double gain = flat[i] ? FLAT_ONE*means[(i % row >= row/2)*2 + (i & 1)] / flat[i] + 0.5 : FLAT_ONE;
+        flat[i] = gain > 65535 ? 65535 : gain;
+    }
+}
+
+// Stack the frames of the input files, each holding any number of them,
+// into a master frame saved as an RG10 file, or its flat field gains.
+// The frames are combined a tile of rows at a time, never more than a
+// tile of each frame per thread, within the memory budget.
+INTERNAL void run_stack(char *output, char **inputs, int files, const struct format *fmt, struct stack *stack,
+                        int threads)
+{
+    const off_t size = fmt->packed ? (off_t)RAW10_SIZE(fmt->width, fmt->height) : RG10_SIZE(fmt->width, fmt->height);
+    const size_t row = (size_t)fmt->width*RG10_COLORS*sizeof(uint16_t);
+    FILE *file;
+
+    stack->fmt = fmt;
+    for(int i = 0; i < files; i++)
+    {
+        struct stat st;
+        int fd = open(inputs[i], O_RDONLY);
+        if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size % size)
+        {
+            fprintf(stderr, "%s isn't a file of whole %dx%d frames.\n", inputs[i], fmt->width, fmt->height);
+            exit(-1);
+        }
+        int frames = st.st_size / size;
+        stack->fds = realloc(stack->fds, (stack->count + frames)*sizeof(int));
+        stack->offsets = realloc(stack->offsets, (stack->count + frames)*sizeof(off_t));
+        if(!stack->fds || !stack->offsets)
+        {
+            fprintf(stderr, "Out of memory stacking the frames.\n");
+            exit(-1);
+        }
+        for(int f = 0; f < frames; f++)
+        {
+            stack->fds[stack->count] = fd;
+            stack->offsets[stack->count++] = f*size;
+        }
+    }
+
+    // A tile of a row per frame at the least, on fewer threads if the
+    // budget can't hold one per thread
+    const size_t tile = stack->count*row;
+    if(stack->budget < tile)
+    {
+        fprintf(stderr, "Stacking %d frames needs a --stack-mb of %.2f at least.\n", stack->count,
+                (double)((tile*100 + 1048575) / 1048576) / 100);
+        exit(-1);
+    }
+    if((size_t)threads > stack->budget / tile)
+    {
+        threads = stack->budget / tile;
+        fprintf(stderr, "Stacking on %d threads within the --stack-mb budget.\n", threads);
+    }
+    stack->rows = stack->budget / threads / tile;
+    stack->rows = stack->rows > fmt->height ? fmt->height : stack->rows;
+    if(!(stack->result = malloc(RG10_SIZE(fmt->width, fmt->height))))
+    {
+        fprintf(stderr, "Out of memory stacking the frames.\n");
+        exit(-1);
+    }
+    parallel_for(threads, (fmt->height + stack->rows - 1) / stack->rows, stack_tiles, stack);
+    if(stack->gains)
+        flat_gains(stack->result, fmt, stack->dark);
+
+    file = fopen(output, "wb");
+    if(!file || fwrite(stack->result, 1, RG10_SIZE(fmt->width, fmt->height), file) != (size_t)RG10_SIZE(fmt->width, fmt->height))
+    {
+        fprintf(stderr, "Unable to write file %s.\n", output);
+        exit(-1);
+    }
+    fclose(file);
+    fprintf(stderr, "%s: %s of %d frames, in tiles of %d rows\n", output, stack_names[stack->mode], stack->count,
+            stack->rows);
+
+    for(int f = 0; f < stack->count; f++)
+        if(!f || stack->fds[f] != stack->fds[f-1])
+            close(stack->fds[f]);
+    free(stack->fds);
+    free(stack->offsets);
+    free(stack->result);
+}
+
+// Parse a WIDTHxHEIGHT geometry.
+INTERNAL int parse_size(char *text, int *width, int *height)
+{
+    return sscanf(text, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+// Find a name in a table of names, returning its index or -1.
+INTERNAL int parse_name(char *text, const char **names, int count)
+{
+    for(int i = 0; i < count; i++)
+        if(!strcmp(text, names[i]))
+            return i;
+    return -1;
+}
+
+// Parse the key=value,... description of a camera stream, over the
+// defaults already set in the stream. Returns 0 on errors.
+INTERNAL int parse_stream(char *text, struct stream *stream)
+{
+    int width = stream->fmt.width, height = stream->fmt.height;
+    int pattern = stream->fmt.pattern, value;
+
+    for(char *key = strtok(text, ","); key; key = strtok(NULL, ","))
+    {
+        char *arg = strchr(key, '=');
+        if(!arg)
+            return 0;
+        *arg++ = 0;
+        if(!strcmp(key, "in")) stream->input = arg;
+        else if(!strcmp(key, "out")) stream->output = arg;
+        else if(!strcmp(key, "size")) { if(!parse_size(arg, &width, &height)) return 0; }
+        else if(!strcmp(key, "pattern")) { if((pattern = parse_name(arg, pattern_names, PATTERNS)) < 0) return 0; }
+        else if(!strcmp(key, "packed")) stream->fmt.packed = atoi(arg) != 0;
+        else if(!strcmp(key, "norm")) { if((value = parse_name(arg, norm_names, 4)) < 0) return 0; stream->norm.mode = value; }
+        else if(!strcmp(key, "weight")) { if((stream->weight = atof(arg)) <= 0) return 0; }
+        else if(!strcmp(key, "deadline")) stream->sched.period = atof(arg) / 1e3;
+        else if(!strcmp(key, "drop")) { if((value = parse_name(arg, (const char *[]){"never", "late"}, 2)) < 0) return 0; stream->sched.drop = value; }
+        else if(!strcmp(key, "dark")) stream->dark = arg;
+        else if(!strcmp(key, "flat")) stream->flat = arg;
+        else if(!strcmp(key, "lens")) stream->lens = arg;
+        else if(!strcmp(key, "lut")) stream->lut = arg;
+        else return 0;
+    }
+    set_format(&stream->fmt, width, height, pattern);
+    return stream->input != NULL;
+}
+
+// Load the master frames, lens profile and 3D LUT of a stream from their
+// files into its options, once its format is set. Those of the same
+// files as the defaults are shared with them, the master frames and the
+// lens only when the geometry is the same too.
+INTERNAL void load_options(struct stream *stream, const struct stream *defaults)
+{
+    struct options *options = &stream->options;
+    const int same = defaults && stream->fmt.width == defaults->fmt.width &&
+                     stream->fmt.height == defaults->fmt.height;
+
+    if(!same || stream->dark != defaults->dark)
+        options->dark = stream->dark ? map_frame(stream->dark, &stream->fmt) : NULL;
+    if(!same || stream->flat != defaults->flat)
+        options->gain = stream->flat ? map_frame(stream->flat, &stream->fmt) : NULL;
+    if(!same || stream->lens != defaults->lens)
+    {
+        memset(&options->lens, 0, sizeof(options->lens));
+        if(stream->lens)
+            load_lens(stream->lens, &options->lens, &stream->fmt);
+    }
+    if(!defaults || stream->lut != defaults->lut)
+        options->lut = stream->lut ? load_lut(stream->lut) : NULL;
+}
+
+// Parse the out=FILE,... description of a fan-out output of frames in
+// the given format. Returns 0 on errors.
+INTERNAL int parse_output(char *text, const struct format *fmt, struct output *output)
+{
+    int value;
+
+    output->bin = 1;
+    for(char *key = strtok(text, ","); key; key = strtok(NULL, ","))
+    {
+        char *arg = strchr(key, '=');
+        if(!arg)
+            return 0;
+        *arg++ = 0;
+        if(!strcmp(key, "out")) output->name = arg;
+        else if(!strcmp(key, "bin")) { if((output->bin = atoi(arg)) <= 0) return 0; }
+        else if(!strcmp(key, "roi"))
+        {
+            if(sscanf(arg, "%dx%d+%d+%d", &output->width, &output->height, &output->x, &output->y) != 4)
+                return 0;
+        }
+        else if(!strcmp(key, "gray")) { if((value = parse_name(arg, gray_names, 3)) < 0) return 0; output->gray = value; }
+        else if(!strcmp(key, "plane")) output->plane = atoi(arg);
+        else return 0;
+    }
+    if(!output->width)
+    {
+        output->width = fmt->width;
+        output->height = fmt->height;
+    }
+    if(output->x < 0 || output->y < 0 || output->width < output->bin || output->height < output->bin ||
+       output->x + output->width > fmt->width || output->y + output->height > fmt->height)
+        return 0;
+    output->image = malloc(RGB_SIZE(output->width, output->height));
+    return output->name != NULL;
+}
+
+INTERNAL void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] input output\n"
+            "       %s [options] -c camera [-c camera ...]\n"
+            "       %s [options] -w CxR -c camera [-c camera ...] output\n"
+            "       %s [options] -o output [-o output ...] input\n"
+            "       %s [options] --autotune [input]\n"
+            "       %s [options] --stack MODE output input [input ...]\n"
+            "  -s, --stream        The input holds consecutive frames (\"-\" for stdin),\n"
+            "                      the output is a printf pattern for the frame number\n"
+            "  -d, --deadline MS   Per-frame deadline in milliseconds (stream mode)\n"
+            "  -D, --drop POLICY   Frames past their deadline: never (default) or late\n"
+            "  -S, --size WxH      Output geometry, %dx%d by default\n"
+            "  -p, --pattern NAME  Bayer pattern: rggb (default), grbg, gbrg or bggr\n"
+            "      --packed        The input is packed RAW10, 4 samples in 5 bytes\n"
+            "      --dark FILE     Master dark frame, subtracted from the frames\n"
+            "      --flat FILE     Master flat field gains multiplying the frames, 16 bit\n"
+            "                      fixed point with %d for a gain of 1\n"
+            "  -n, --norm MODE     Normalization: none, frame (default), smooth or fixed,\n"
+            "                      the levels %d to %d built in\n"
+            "  -c, --camera SPEC   A stream, as in=FILE,out=PATTERN followed by any of\n"
+            "                      size=, pattern=, packed=, norm=, deadline=, drop=,\n"
+            "                      weight=, dark=, flat=, lens= and lut=\n"
+            "  -t, --threads N     Worker threads shared by the streams\n"
+            "  -w, --wall CxR      Composite the cameras into a wall of C columns and R rows,\n"
+            "                      the output is a printf pattern for the refresh number\n"
+            "  -b, --bin N         Binning factor of the wall tiles, 2 by default\n"
+            "  -r, --ring SECONDS  Keep the last seconds of the stream in RAM, converting\n"
+            "                      them only on a trigger (SIGUSR1 or the options below)\n"
+            "      --post SECONDS  Also convert the seconds following a trigger\n"
+            "      --fps N         Frame rate of the stream, %d by default\n"
+            "      --ring-mb MB    Memory budget of the ring and the frames waiting\n"
+            "                      for conversion, %d by default\n"
+            "      --trigger-file PATH    Trigger when the file appears, deleting it\n"
+            "      --trigger-socket PATH  Trigger on datagrams sent to a UNIX socket\n"
+            "  -o, --output SPEC   An output, as out=FILE followed by any of bin=N,\n"
+            "                      roi=WxH+X+Y, gray=green|luma and plane=1\n"
+            "  -g, --gray MODE     Grayscale output of the green average or the luma\n"
+            "      --plane         Save the grayscale plane without a TGA header\n"
+            "  -T, --tensor WxH    Output a model input tensor of the given size\n"
+            "      --layout L      Tensor layout: nchw (default) or nhwc\n"
+            "      --dtype T       Tensor elements: f32 (default) or u8\n"
+            "      --mean R,G,B    Per channel mean subtracted from f32 tensors, 0-1 units\n"
+            "      --std R,G,B     Per channel std dividing f32 tensors, 0-1 units\n"
+            "      --pad N         Letterbox color, 0-255, 114 by default\n"
+            "      --batch N       Frames per tensor file in streaming mode\n"
+            "  -j, --jit           Compile the conversion kernels for the exact frame format\n"
+            "      --autotune      Benchmark the band size, threads and kernels on a synthetic\n"
+            "                      frame and the input frame if given, saving the fastest\n"
+            "      --profile PATH  Tuning profile loaded on start, ~/%s by default\n"
+            "      --stack MODE    Stack the frames of the inputs into a master RG10 frame,\n"
+            "                      by their mean, clip (mean of the values within the\n"
+            "                      sigma) or median, sample by sample\n"
+            "      --sigma K       Outliers of clip, K std from the mean, %.0f by default\n"
+            "      --gains         Save the stack as flat field gains for --flat, after\n"
+            "                      subtracting the --dark frame if given\n"
+            "      --stack-mb MB   Memory budget of the stacking, %d by default\n"
+            "      --flicker       Report the frequency and amplitude of the flicker of\n"
+            "                      the lighting found in every normalized frame\n"
+            "      --line-us US    Sensor line time, %.0f microseconds by default\n"
+            "      --motion T      Find the motion in the streams (-s or -c), the bins of\n"
+            "                      8x8 blocks changing from their running average by more\n"
+            "                      than T of it (%.2f for 0), reporting the share of the\n"
+            "                      bins in motion and saving the mask of each frame next to it\n"
+            "      --gate S        Only convert the frames of the streams with a motion\n"
+            "                      score of S or more, along with --motion\n"
+            "      --denoise K     Denoise the normalized RGB images, each sample becoming\n"
+            "                      the mean of its neighbours of its color within K std of\n"
+            "                      the noise estimated in the frame (%.0f for 0)\n"
+            "      --highlights    Rebuild the clipped highlights of the normalized RGB\n"
+            "                      images from the color of the blocks next to them,\n"
+            "                      instead of tinting them\n"
+            "      --clip LEVEL    Level of the clipped samples, %d by default\n"
+            "      --chroma        Suppress the false colors at the edges of the RGB images,\n"
+            "                      by the medians of the color differences over 3x3 pixels\n"
+            "      --lens FILE[:NAME]  Correct the lateral chromatic aberration of the lens\n"
+            "                      NAME of a lens profile, or of its first one\n"
+            "      --lut FILE      Grade the RGB images with the 3D LUT of a .cube file, of\n"
+            "                      up to %d nodes per axis\n"
+            "      --focus CxR     Measure the sharpness of the RGB images, as a whole and\n"
+            "                      in C columns and R rows of zones, saving it to a JSON\n"
+            "                      file next to each, of its name and .json\n"
+            "  -v, --verbose       Report the tier of every frame\n", name, name, name, name, name, name, WIDTH,
+            HEIGHT, FLAT_ONE, LEVELS_MIN, LEVELS_MAX, FPS, RING_MB, PROFILE, SIGMA, STACK_MB,
+            LINE_US, MOTION_THRESHOLD, DENOISE_STRENGTH, MAX_RG10, LUT_MAX);
+    exit(-1);
+}
+
+enum long_options                                // Options without a short version
+{
+    OPT_POST = 256,
+    OPT_FPS,
+    OPT_RING_MB,
+    OPT_TRIGGER_FILE,
+    OPT_TRIGGER_SOCKET,
+    OPT_LAYOUT,
+    OPT_DTYPE,
+    OPT_MEAN,
+    OPT_STD,
+    OPT_PAD,
+    OPT_BATCH,
+    OPT_PLANE,
+    OPT_AUTOTUNE,
+    OPT_PROFILE,
+    OPT_PACKED,
+    OPT_DARK,
+    OPT_FLAT,
+    OPT_STACK,
+    OPT_SIGMA,
+    OPT_GAINS,
+    OPT_STACK_MB,
+    OPT_FLICKER,
+    OPT_LINE_US,
+    OPT_FOCUS,
+    OPT_MOTION,
+    OPT_GATE,
+    OPT_DENOISE,
+    OPT_HIGHLIGHTS,
+    OPT_CLIP,
+    OPT_CHROMA,
+    OPT_LUT,
+    OPT_LENS
+};
+
+#ifndef BAYER2TGA_LIBRARY
+// The first argument is the input raw file name, the second is the
+// output file to save to disk.
+int main(int argc, char *argv[])
+{
+    static struct option options[] =
+    {
+        {"stream",   no_argument,       0, 's'},
+        {"deadline", required_argument, 0, 'd'},
+        {"drop",     required_argument, 0, 'D'},
+        {"size",     required_argument, 0, 'S'},
+        {"pattern",  required_argument, 0, 'p'},
+        {"packed",   no_argument,       0, OPT_PACKED},
+        {"dark",     required_argument, 0, OPT_DARK},
+        {"flat",     required_argument, 0, OPT_FLAT},
+        {"stack",    required_argument, 0, OPT_STACK},
+        {"sigma",    required_argument, 0, OPT_SIGMA},
+        {"gains",    no_argument,       0, OPT_GAINS},
+        {"stack-mb", required_argument, 0, OPT_STACK_MB},
+        {"flicker",  no_argument,       0, OPT_FLICKER},
+        {"line-us",  required_argument, 0, OPT_LINE_US},
+        {"focus",    required_argument, 0, OPT_FOCUS},
+        {"motion",   required_argument, 0, OPT_MOTION},
+        {"gate",     required_argument, 0, OPT_GATE},
+        {"denoise",  required_argument, 0, OPT_DENOISE},
+        {"highlights", no_argument,     0, OPT_HIGHLIGHTS},
+        {"clip",     required_argument, 0, OPT_CLIP},
+        {"chroma",   no_argument,       0, OPT_CHROMA},
+        {"lut",      required_argument, 0, OPT_LUT},
+        {"lens",     required_argument, 0, OPT_LENS},
+        {"norm",     required_argument, 0, 'n'},
+        {"camera",   required_argument, 0, 'c'},
+        {"threads",  required_argument, 0, 't'},
+        {"wall",     required_argument, 0, 'w'},
+        {"bin",      required_argument, 0, 'b'},
+        {"ring",     required_argument, 0, 'r'},
+        {"post",     required_argument, 0, OPT_POST},
+        {"fps",      required_argument, 0, OPT_FPS},
+        {"ring-mb",  required_argument, 0, OPT_RING_MB},
+        {"trigger-file",   required_argument, 0, OPT_TRIGGER_FILE},
+        {"trigger-socket", required_argument, 0, OPT_TRIGGER_SOCKET},
+        {"output",   required_argument, 0, 'o'},
+        {"gray",     required_argument, 0, 'g'},
+        {"plane",    no_argument,       0, OPT_PLANE},
+        {"tensor",   required_argument, 0, 'T'},
+        {"layout",   required_argument, 0, OPT_LAYOUT},
+        {"dtype",    required_argument, 0, OPT_DTYPE},
+        {"mean",     required_argument, 0, OPT_MEAN},
+        {"std",      required_argument, 0, OPT_STD},
+        {"pad",      required_argument, 0, OPT_PAD},
+        {"batch",    required_argument, 0, OPT_BATCH},
+        {"jit",      no_argument,       0, 'j'},
+        {"autotune", no_argument,       0, OPT_AUTOTUNE},
+        {"profile",  required_argument, 0, OPT_PROFILE},
+        {"verbose",  no_argument,       0, 'v'},
+        {0, 0, 0, 0}
+    };
+    struct stream defaults = {0}, streams[MAX_STREAMS];
+    char *cameras[MAX_STREAMS], *outputs[MAX_OUTPUTS];
+    struct output fan[MAX_OUTPUTS] = {0};
+    int width = WIDTH, height = HEIGHT, pattern = PATTERN;
+    int streaming = 0, verbose = 0, count = 0, threads = 0, opt, value;
+    int columns = 0, rows = 0, bin = 2, jit = 0, tune = 0, packed = 0, flicker = 0;
+    double line = LINE_US / 1e6;
+    float threshold = -1, gate = 0;
+    int highlights = 0;
+    uint16_t clip = MAX_RG10;
+    char profile[4096], *home = getenv("HOME");
+    struct trigger trigger = {0, 0, FPS, (size_t)RING_MB << 20, NULL, NULL};
+    struct tensor tensor = {0};
+    struct focus focus = {0};
+    struct stack stack = {STACK_NONE, SIGMA, 0, NULL, (size_t)STACK_MB << 20, NULL, 0, NULL, NULL, 0, NULL};
+
+    defaults.norm.mode = NORM_FRAME;
+    defaults.weight = 1;
+    tensor.std[0] = tensor.std[1] = tensor.std[2] = 1;
+    tensor.pad = 114;
+    tensor.batch = 1;
+    snprintf(profile, sizeof(profile), "%s%s%s", home ? home : "", home ? "/" : "", PROFILE);
+    while((opt = getopt_long(argc, argv, "sd:D:S:p:n:c:t:w:b:r:o:g:T:jv", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+        case 's': streaming = 1; break;
+        case 'd': defaults.sched.period = atof(optarg) / 1e3; break;
+        case 'D':
+            if((value = parse_name(optarg, (const char *[]){"never", "late"}, 2)) < 0) usage(argv[0]);
+            defaults.sched.drop = value;
+            break;
+        case 'S': if(!parse_size(optarg, &width, &height)) usage(argv[0]); break;
+        case 'p': if((pattern = parse_name(optarg, pattern_names, PATTERNS)) < 0) usage(argv[0]); break;
+        case 'n':
+            if((value = parse_name(optarg, norm_names, 4)) < 0) usage(argv[0]);
+            defaults.norm.mode = value;
+            break;
+        case 'c':
+            if(count == MAX_STREAMS) usage(argv[0]);
+            cameras[count++] = optarg;
+            break;
+        case 't': if((threads = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 'w': if(!parse_size(optarg, &columns, &rows)) usage(argv[0]); break;
+        case 'b': if((bin = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 'r': if((trigger.pre = atof(optarg)) < 0) usage(argv[0]); streaming = 1; break;
+        case OPT_POST: if((trigger.post = atof(optarg)) < 0) usage(argv[0]); break;
+        case OPT_FPS: if((trigger.fps = atof(optarg)) <= 0) usage(argv[0]); break;
+        case OPT_RING_MB: trigger.budget = (size_t)(atof(optarg)*1048576); break;
+        case OPT_TRIGGER_FILE: trigger.file = optarg; break;
+        case OPT_TRIGGER_SOCKET: trigger.socket = optarg; break;
+        case 'o':
+            if(defaults.outputs_count == MAX_OUTPUTS) usage(argv[0]);
+            outputs[defaults.outputs_count++] = optarg;
+            break;
+        case 'g':
+            if((value = parse_name(optarg, gray_names, 3)) < 0) usage(argv[0]);
+            defaults.gray = value;
+            break;
+        case OPT_PLANE: defaults.plane = 1; break;
+        case 'T': if(!parse_size(optarg, &tensor.width, &tensor.height)) usage(argv[0]); break;
+        case OPT_LAYOUT:
+            if((value = parse_name(optarg, layout_names, 2)) < 0) usage(argv[0]);
+            tensor.layout = value;
+            break;
+        case OPT_DTYPE:
+            if((value = parse_name(optarg, dtype_names, 2)) < 0) usage(argv[0]);
+            tensor.dtype = value;
+            break;
+        case OPT_MEAN:
+            if(sscanf(optarg, "%f,%f,%f", &tensor.mean[0], &tensor.mean[1], &tensor.mean[2]) != 3) usage(argv[0]);
+            break;
+        case OPT_STD:
+            if(sscanf(optarg, "%f,%f,%f", &tensor.std[0], &tensor.std[1], &tensor.std[2]) != 3 ||
+               tensor.std[0] <= 0 || tensor.std[1] <= 0 || tensor.std[2] <= 0) usage(argv[0]);
+            break;
+        case OPT_PAD: tensor.pad = atoi(optarg); break;
+        case OPT_BATCH: if((tensor.batch = atoi(optarg)) <= 0) usage(argv[0]); break;
+        case 'j': jit = 1; break;
+        case OPT_PACKED: packed = 1; break;
+        case OPT_DARK: defaults.dark = optarg; break;
+        case OPT_LUT: defaults.lut = optarg; break;
+        case OPT_LENS: defaults.lens = optarg; break;
+        case OPT_FLAT: defaults.flat = optarg; break;
+        case OPT_STACK:
+            if((value = parse_name(optarg, stack_names, 4)) <= 0) usage(argv[0]);
+            stack.mode = value;
+            break;
+        case OPT_SIGMA: if((stack.sigma = atof(optarg)) <= 0) usage(argv[0]); break;
+        case OPT_GAINS: stack.gains = 1; break;
+        case OPT_STACK_MB: if((stack.budget = (size_t)(atof(optarg)*1048576)) == 0) usage(argv[0]); break;
+        case OPT_FLICKER: flicker = 1; break;
+        case OPT_LINE_US: if((line = atof(optarg) / 1e6) <= 0) usage(argv[0]); break;
+        case OPT_FOCUS: if(!parse_size(optarg, &focus.columns, &focus.rows)) usage(argv[0]); break;
+        case OPT_MOTION:
+            if((threshold = atof(optarg)) < 0) usage(argv[0]);
+            if(!threshold) threshold = MOTION_THRESHOLD;
+            break;
+        case OPT_GATE: if((gate = atof(optarg)) < 0) usage(argv[0]); break;
+        case OPT_DENOISE:
+            if((defaults.options.denoise = atof(optarg)) < 0) usage(argv[0]);
+            if(!defaults.options.denoise) defaults.options.denoise = DENOISE_STRENGTH;
+            break;
+        case OPT_HIGHLIGHTS: highlights = 1; break;
+        case OPT_CHROMA: defaults.options.chroma = 1; break;
+        case OPT_CLIP:
+            if((value = atoi(optarg)) <= 0 || value > 65535) usage(argv[0]);
+            clip = value;
+            break;
+        case OPT_AUTOTUNE: tune = 1; break;
+        case OPT_PROFILE: snprintf(profile, sizeof(profile), "%s", optarg); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    set_format(&defaults.fmt, width, height, pattern);
+    defaults.fmt.packed = packed;
+    if(highlights)
+        defaults.options.highlights = clip;
+    load_options(&defaults, NULL);
+    if(tune)
+    {
+        if(argc - optind > 1)
+            usage(argv[0]);
+        autotune(argc > optind ? argv[optind] : NULL, &defaults.fmt, &defaults.options, profile, verbose);
+        return 0;
+    }
+
+    // The command line takes precedence over the profile, which isn't
+    // even read when the tuning is built in
+#ifndef BUILTIN_TUNING
+    load_profile(profile);
+#endif
+    if(jit)
+        tuning.jit = 1;
+    if(!threads && tuning.threads)
+        defaults.threads = tuning.threads;
+    for(int i = 0; i < defaults.outputs_count; i++)
+    {
+        if(!parse_output(outputs[i], &defaults.fmt, &fan[i]))
+        {
+            fprintf(stderr, "Bad output description: %s\n", outputs[i]);
+            exit(-1);
+        }
+    }
+    if(defaults.outputs_count)
+        defaults.outputs = fan;
+    if(!defaults.threads)
+        defaults.threads = threads ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(stack.mode)
+    {
+        if(argc - optind < 2)
+            usage(argv[0]);
+        stack.dark = defaults.options.dark;
+        run_stack(argv[optind], argv + optind + 1, argc - optind - 1, &defaults.fmt, &stack, defaults.threads);
+        return 0;
+    }
+
+    // Cameras take their defaults from the other options, whatever their order
+    for(int i = 0; i < count; i++)
+    {
+        streams[i] = defaults;
+        streams[i].id = i;
+        streams[i].threads = 1;
+        if(!parse_stream(cameras[i], &streams[i]) || (!columns && !streams[i].output))
+        {
+            fprintf(stderr, "Bad camera description: %s\n", cameras[i]);
+            exit(-1);
+        }
+        load_options(&streams[i], &defaults);
+    }
+    if(tensor.width)
+    {
+        tensor.threads = defaults.threads;
+        tensor.data = malloc(tensor_size(&tensor)*tensor.batch);
+        defaults.tensor = &tensor;
+        if(count || columns || trigger.pre > 0 || trigger.post > 0)
+        {
+            fprintf(stderr, "Tensor output is for a single stream.\n");
+            exit(-1);
+        }
+    }
+    int ring = trigger.pre > 0 || trigger.post > 0;
+    int fanning = defaults.outputs_count > 0;
+    if(argc - optind != (columns || fanning ? 1 : count ? 0 : 2) || (columns && !count) ||
+       (ring && (columns || count > 1)) || (fanning && (count || ring || tensor.width)) ||
+       ((threshold >= 0 || gate) && !streaming && !count) || (gate && threshold < 0))
+        usage(argv[0]);
+
+    if(streaming || count)
+    {
+        if(!count)
+        {
+            streams[count] = defaults;
+            streams[count].input = argv[optind];
+            streams[count++].output = fanning ? NULL : argv[optind+1];
+        }
+        for(int i = 0; i < count && flicker; i++)
+            watch_flicker(&streams[i], line);
+        for(int i = 0; i < count && threshold >= 0; i++)
+            watch_motion(&streams[i], threshold, gate);
+        for(int i = 0; i < count; i++)
+            if(streams[i].options.denoise)
+                streams[i].norm.stats = &streams[i].stats;
+        for(int i = 0; i < count; i++)
+            if(streams[i].options.highlights)
+                watch_highlights(&streams[i]);
+        for(int i = 0; i < count && focus.columns; i++)
+        {
+            streams[i].focus = malloc(sizeof(struct focus));
+            *streams[i].focus = focus;
+            streams[i].focus->zones = malloc(focus.columns*focus.rows*sizeof(struct sharpness));
+        }
+        if(!threads)
+        {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = count < cores && !ring ? count : cores > 0 ? cores : 1;
+        }
+        if(ring)
+            run_ring(&streams[0], &trigger, threads);
+        else if(columns)
+            run_wall(streams, count, columns, rows, bin, threads, argv[optind]);
+        else
+            run(streams, count, threads, verbose);
+        return 0;
+    }
+
+    struct format *fmt = &defaults.fmt;
+    if(flicker)
+        watch_flicker(&defaults, line);
+    if(defaults.options.denoise)
+        defaults.norm.stats = &defaults.stats;
+    if(defaults.options.highlights)
+        watch_highlights(&defaults);
+    if(focus.columns)
+    {
+        focus.zones = malloc(focus.columns*focus.rows*sizeof(struct sharpness));
+        defaults.focus = &focus;
+    }
+    if(fanning)
+    {
+        uint16_t *buffer = read_file(argv[optind], fmt);
+        fan_out(buffer, fmt, prepare_norm(buffer, fmt, COLORS_ALL, &defaults.norm, &defaults.options),
+                &defaults.options, fan, defaults.outputs_count, defaults.threads, -1);
+        if(flicker)
+            report_flicker(&defaults, 0);
+        free(buffer);
+        return 0;
+    }
+    if(tensor.width)
+    {
+        uint16_t *buffer = read_file(argv[optind], fmt);
+        tensor_frame(buffer, fmt, prepare_norm(buffer, fmt, COLORS_ALL, &defaults.norm, &defaults.options), &tensor,
+                     tensor.data);
+        tensor.count = 1;
+        write_tensor(argv[optind+1], &tensor);
+        if(flicker)
+            report_flicker(&defaults, 0);
+        free(buffer);
+        free(tensor.data);
+        return 0;
+    }
+    uint8_t *image = malloc(RGB_SIZE(fmt->width, fmt->height));
+    uint16_t *buffer = read_file(argv[optind], fmt);              // Read the frame
+    if(defaults.gray)
+    {
+        debayer_gray(buffer, fmt, defaults.gray, prepare_norm(buffer, fmt, defaults.gray == GRAY_GREEN ?
+                     COLORS_GREEN : COLORS_ALL, &defaults.norm, &defaults.options), image);
+        write_gray(argv[optind+1], image, fmt->width, fmt->height, !defaults.plane);
+        if(flicker)
+            report_flicker(&defaults, 0);
+        free(buffer);
+        free(image);
+        return 0;
+    }
+    const struct norm *norm = prepare_norm(buffer, fmt, COLORS_ALL, &defaults.norm, &defaults.options); // Find the normalization (optional step)
+    if(flicker)
+        report_flicker(&defaults, 0);
+    if(!debayer_focus(buffer, fmt, norm, &defaults.options, image, defaults.threads, defaults.focus, NULL)) // Normalize and debayer
+    {
+        fprintf(stderr, "Out of memory converting %s.\n", argv[optind]);
+        exit(-1);
+    }
+    write_tga(argv[optind+1], image, fmt->width, fmt->height);    // Save back to the disk
+    if(defaults.focus)
+        write_focus(argv[optind+1], defaults.focus);
+
+    free(buffer);
+    free(image);
+    return 0;
+}
+#endif
@@ -0,0 +1,252 @@
+/*
+    The converter as a library, for linking bayer2tga.c (compiled with
+    -DBAYER2TGA_LIBRARY, leaving out main) into other programs. These are
+    the frame format, the processing of the frames of a stream, and the
+    steps of converting a single frame: reading it, preparing its
+    normalization, de-Bayering it and saving it, the only names the
+    library exports. None of them exits the program, the errors are
+    returned. bayer2tga.hpp wraps them for C++.
+*/
+
+#ifndef BAYER2TGA_H
+#define BAYER2TGA_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RG10_BITS       (10)                     // Bits (max) per input RG10 color, practically will be 16 bits
+#define RGB_BITS        (8)                      // Bits per output RGB color
+#define MAX_RG10        ((1<<RG10_BITS)-1)       // Max color value
+#define MAX_RGB         ((1<<RGB_BITS)-1)        // Max color value
+
+#define RG10_COLOR_SIZE (2)                      // Bytes per RG10 color
+#define RGB_COLOR_SIZE  (1)                      // Bytes per RGB color
+#define RG10_COLORS     (4)                      // Colors in a RG10 pixel
+#define RGB_COLORS      (3)                      // Colors in an RGB pixel
+
+#define RGB_R           (2)                      // Location of the red color in an RGB pixel
+#define RGB_G           (1)                      // Location of the green color in an RGB pixel
+#define RGB_B           (0)                      // Location of the blue color in an RGB pixel
+
+#define COLOR_R         (1)                      // Bit masks selecting the RG10 colors
+#define COLOR_Gr        (2)
+#define COLOR_Gb        (4)
+#define COLOR_B         (8)
+#define COLORS_ALL      (COLOR_R|COLOR_Gr|COLOR_Gb|COLOR_B)
+#define COLORS_GREEN    (COLOR_Gr|COLOR_Gb)
+
+#define RG10_SIZE(W, H) ((W)*(H)*RG10_COLORS*RG10_COLOR_SIZE) // Total RG10 input frame size
+#define RAW10_SIZE(W, H) ((size_t)(W)*(H)*RG10_COLORS*5/4) // Total packed RAW10 input frame size
+#define RGB_SIZE(W, H)  ((W)*(H)*RGB_COLORS*RGB_COLOR_SIZE) // Total RGB output image size
+
+#define STATS_BIN       (8)                      // Blocks on each side of a bin of the statistics
+#define STATS_BINS(N)   (((N) + STATS_BIN - 1) / STATS_BIN) // Bins along N blocks
+
+#define FLAT_BITS       (12)                     // Fraction bits of the fixed point flat field gains
+#define FLAT_ONE        (1<<FLAT_BITS)           // Flat field gain of 1
+#define LUT_MAX         (65)                     // Most nodes along each axis of a 3D LUT
+#define LENS_SCALE_MAX  (0.02)                   // Largest difference of the scales of a lens profile from 1
+
+enum pattern                                     // Order of the colors in a 2x2 Bayer block, row by row
+{
+    PATTERN_RGGB,
+    PATTERN_GRBG,
+    PATTERN_GBRG,
+    PATTERN_BGGR,
+    PATTERNS
+};
+
+// The geometry and layout of an RG10 frame. Every output pixel comes
+// from one 2x2 Bayer block, so a frame has width*2 x height*2 colors.
+struct format
+{
+    int width;                                   // Output pixels width
+    int height;                                  // Output pixels height
+    int stride;                                  // Blocks from a row to the next, the width unless cropped
+    int x, y;                                    // Blocks of the region from the top left of the frame, when cropped
+    int frame_height;                            // Rows of blocks of the frame, the height unless cropped
+    enum pattern pattern;                        // Order of the colors in a Bayer block
+    int r, gr, gb, b;                            // Location of each color relative to its block
+    int packed;                                  // Whether the input is packed RAW10, 4 samples in 5 bytes
+};
+
+enum norm_mode                                   // How a stream is normalized
+{
+    NORM_NONE,                                   // Not at all
+    NORM_FRAME,                                  // To the min and max of every frame
+    NORM_SMOOTH,                                 // To a running average of the min and max, so it doesn't pump
+    NORM_FIXED                                   // To the levels built in, LEVELS_MIN and LEVELS_MAX
+};
+
+// The statistics of a frame, gathered in the pass finding its min and
+// max for the normalization, with no pass of their own.
+struct stats
+{
+    uint32_t *rows;                              // Sum of the samples of each row of blocks, height of them, or NULL
+    uint32_t *bins;                              // Sum of the samples of each bin, row by row, or NULL
+    float noise;                                 // Std of the noise of the samples, estimated on a subset of them
+    uint16_t clip;                               // Level of the clipped samples, 0 for not counting them
+    uint32_t clipped[RG10_COLORS];               // Clipped samples of each color, R, Gr, Gb and B
+    int *clipped_rows;                           // Rows of blocks holding clipped samples, in order, or NULL
+    int clipped_count;                           // Rows in clipped_rows
+    int gathered;                                // Whether they're of the last frame prepared
+};
+
+// The flicker of mains lighting found in a frame, the banding a rolling
+// shutter makes of it.
+struct flicker
+{
+    float frequency;                             // Of the light, in Hz, 0 for none found
+    float amplitude;                             // Of the banding, relative to the mean level
+};
+
+// The normalization state of a stream.
+struct norm
+{
+    enum norm_mode mode;
+    int valid;                                   // Whether min and max hold the previous frames yet
+    float min, max;
+    struct stats *stats;                         // Gathered along the search of the min and max, NULL for none
+};
+
+// The lateral chromatic aberration of a lens, from its profile: its red
+// and blue images are a little larger or smaller than the green one,
+// radially from the optical center.
+struct lens
+{
+    float scales[2];                             // Red and blue images relative to the green one, 0 for none
+    float center[2];                             // Optical center, in fractions of the width and height
+};
+
+// A 3D LUT grading the RGB images, read from a .cube file.
+struct lut;
+
+// The processing of the frames of a stream on top of their
+// normalization, all zeros for none. The master frames and the LUT are
+// the caller's, and must outlive the conversions. The denoising and the
+// highlights need the normalization, with the statistics, and the
+// highlights the clipped samples counted at their level.
+struct options
+{
+    const uint16_t *dark;                        // Master dark frame subtracted from every sample, NULL for none
+    const uint16_t *gain;                        // Flat field gains multiplying every sample, FLAT_ONE for 1, or NULL
+    float denoise;                               // Average the neighbours within this many std of the noise, 0 for not
+    uint16_t highlights;                         // Rebuild the highlights clipped at this level, 0 for not
+    int chroma;                                  // Suppress the false colors by the medians of the color differences
+    struct lens lens;                            // Correct its lateral chromatic aberration, all zeros for none
+    const struct lut *lut;                       // Grade the RGB images with it, NULL for not
+};
+
+// The sharpness of a frame or of a zone of it, measured on the plane of
+// the sums of the greens of its blocks.
+struct sharpness
+{
+    double laplacian;                            // Variance of the Laplacian
+    double tenengrad;                            // Mean squared Sobel gradient
+};
+
+// The focus of a frame, as a whole and over a grid of zones.
+struct focus
+{
+    int columns, rows;                           // Zones of the grid
+    struct sharpness frame;
+    struct sharpness *zones;                     // columns*rows of them, row by row, NULL for the frame only
+};
+
+// The motion in the frames of a stream, found on the bins of their
+// statistics against a running average of each, the background.
+struct motion
+{
+    float threshold;                             // Change of a bin from its background that is motion, relative to it
+    float score;                                 // Share of the bins in motion in the last frame
+    uint8_t *mask;                               // 1 for each bin in motion, 0 for the others
+    float *background;                           // Mean sample of each bin
+    int valid;                                   // Whether the background holds the previous frames yet
+};
+
+// Memory reused by the conversions of a stream, so they don't allocate
+// once it's large enough. Zeroed before the first conversion, with its
+// data freed after the last one, and used by a conversion at a time.
+struct workspace
+{
+    void *data;
+    size_t size;                                 // Bytes of the data
+};
+
+enum gray                                        // Grayscale output
+{
+    GRAY_NONE,                                   // RGB output
+    GRAY_GREEN,                                  // The average of the two greens
+    GRAY_LUMA                                    // BT.601 luma
+};
+
+// Set up the format of the given geometry and pattern.
+void set_format(struct format *fmt, int width, int height, enum pattern pattern);
+
+// Read a single frame from an open file. Returns 0 at the end of the
+// input, when there isn't a complete frame left.
+int read_frame(FILE *file, uint16_t *buff, const struct format *fmt);
+
+// Read a 3D LUT from a .cube file, of up to LUT_MAX nodes per axis.
+// Returns NULL when it can't be read, or isn't such a LUT.
+struct lut *read_lut(const char *name);
+
+// Free a 3D LUT of read_lut().
+void free_lut(struct lut *lut);
+
+// Read the lateral chromatic aberration of a lens from a lens profile,
+// the lens named, or the first one for NULL. Returns 0 when it can't be
+// read, or has no such lens with scales within LENS_SCALE_MAX of 1.
+int read_lens(const char *name, const char *model, struct lens *lens);
+
+// Whether the options can process frames of the format: a lens shifting
+// their colors within the reach of the conversion, and a denoising
+// strength that isn't negative. Returns 0 when they can't.
+int check_options(const struct options *options, const struct format *fmt);
+
+// Prepare the normalization of a frame of the given colors (COLORS_ALL,
+// ...), updating the state of its stream, on the frame as calibrated by
+// the options when given. Returns the state to normalize with, or NULL
+// when the frame isn't normalized.
+const struct norm *prepare_norm(uint16_t *buffer, const struct format *fmt, unsigned int colors, struct norm *norm,
+                                const struct options *options);
+
+// Find the flicker in the row sums of a frame's statistics, its rows of
+// blocks read line seconds apart. Returns 0 when they weren't gathered.
+int detect_flicker(const struct stats *stats, const struct format *fmt, double line, struct flicker *flicker);
+
+// Find the motion in the bins of a frame's statistics, the mask and the
+// background holding STATS_BINS(width)*STATS_BINS(height) bins, and
+// update the background. Returns 0 when they weren't gathered.
+int detect_motion(const struct stats *stats, const struct format *fmt, struct motion *motion);
+
+// De-Bayer a frame to a BGR image of RGB_SIZE bytes over the given
+// threads, normalizing it when given the prepared normalization, and
+// processing it by the options when given. Returns 0 for lack of
+// memory, or options check_options() refuses.
+int debayer(uint16_t *buffer, const struct format *fmt, const struct norm *norm, const struct options *options,
+            uint8_t *image, int threads);
+
+// De-Bayer a frame like debayer(), measuring its focus in the same pass
+// when given, with the memory of the conversion from the workspace when
+// given, grown as needed. Returns 0 like debayer(), the frame not
+// converted.
+int debayer_focus(uint16_t *buffer, const struct format *fmt, const struct norm *norm, const struct options *options,
+                  uint8_t *image, int threads, struct focus *focus, struct workspace *workspace);
+
+// Compute the grayscale plane of a frame, a byte per Bayer block.
+void debayer_gray(uint16_t *buffer, const struct format *fmt, enum gray gray, const struct norm *norm, uint8_t *plane);
+
+// Write an RGB image with a simple TGA header to an open file. Returns
+// 0 when it couldn't be written completely.
+int put_tga(FILE *file, const uint8_t *buff, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,512 @@
+/*
+    A header-only C++20 interface to the converter, over the C library of
+    bayer2tga.h (link with bayer2tga.c compiled with -DBAYER2TGA_LIBRARY).
+
+    Frames and images are move-only objects whose buffers come from a
+    pool of the converter, and go back to it when they're destroyed. A
+    frame_stream iterates over the frames of a multi-frame input, reading
+    each frame into the buffer of the previous one unless it was moved
+    out of the stream, so once the pools are warm the wrapper doesn't
+    allocate anything on top of the conversion itself:
+
+        bayer2tga::converter converter(1920, 1080);
+        for(auto &frame : converter.frames("capture.raw"))
+            bayer2tga::write_tga("frame.tga", converter.convert(frame));
+
+    The processing of the frames, such as the calibration, the LUT or the
+    lens, is given to the converter as its options, for all the frames of
+    its stream:
+
+        struct options options = {};
+        auto lut = bayer2tga::read_lut("look.cube");
+        options.lut = lut.get();
+        options.lens = bayer2tga::read_lens("lenses.txt", "wide");
+        bayer2tga::converter converter(1920, 1080, PATTERN_RGGB, NORM_FRAME, false, 0, options);
+
+    The errors are thrown as exceptions.
+*/
+
+#ifndef BAYER2TGA_HPP
+#define BAYER2TGA_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bayer2tga.h"
+
+namespace bayer2tga
+{
+
+template<typename T> class pool;
+
+// Closes a file, unless it was only lent.
+struct file_closer
+{
+    bool owned = true;
+    void operator()(std::FILE *file) const
+    {
+        if(owned)
+            std::fclose(file);
+    }
+};
+
+// A buffer of a pool, given back to it when destroyed.
+template<typename T>
+class buffer
+{
+public:
+    buffer() = default;
+    buffer(buffer &&other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr)), data_(std::exchange(other.data_, nullptr)) {}
+    buffer &operator=(buffer &&other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            pool_ = std::exchange(other.pool_, nullptr);
+            data_ = std::exchange(other.data_, nullptr);
+        }
+        return *this;
+    }
+    ~buffer() { reset(); }
+
+    T *data() const { return data_; }
+    std::span<T> span() const { return {data_, data_ ? pool_->size() : 0}; }
+    explicit operator bool() const { return data_ != nullptr; }
+
+    // Give the buffer back to its pool.
+    void reset()
+    {
+        if(data_)
+            pool_->release(std::exchange(data_, nullptr));
+        pool_ = nullptr;
+    }
+
+private:
+    friend class pool<T>;
+    buffer(pool<T> *pool, T *data) : pool_(pool), data_(data) {}
+
+    pool<T> *pool_ = nullptr;
+    T *data_ = nullptr;
+};
+
+// A pool of equally sized buffers, which must outlive them. A buffer is
+// only allocated when all the others are in use.
+template<typename T>
+class pool
+{
+public:
+    explicit pool(std::size_t size) : size_(size) {}
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+    ~pool()
+    {
+        for(T *data : free_)
+            delete[] data;
+    }
+
+    std::size_t size() const { return size_; }
+
+    buffer<T> acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(free_.empty())
+        {
+            free_.reserve(++count_);             // So giving the buffers back never allocates
+            return buffer<T>(this, new T[size_]);
+        }
+        T *data = free_.back();
+        free_.pop_back();
+        return buffer<T>(this, data);
+    }
+
+private:
+    friend class buffer<T>;
+    void release(T *data)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(data);
+    }
+
+    std::size_t size_, count_ = 0;
+    std::vector<T *> free_;
+    std::mutex mutex_;
+};
+
+// A raw RG10 frame, unpacked, numbered from 0 by its stream.
+class frame
+{
+public:
+    frame() = default;
+
+    std::span<uint16_t> samples() { return data_.span(); }
+    std::span<const uint16_t> samples() const { return data_.span(); }
+    unsigned long index() const { return index_; }
+    explicit operator bool() const { return bool(data_); }
+
+private:
+    friend class converter;
+    friend class frame_stream;
+    explicit frame(buffer<uint16_t> data) : data_(std::move(data)) {}
+
+    buffer<uint16_t> data_;
+    unsigned long index_ = 0;
+};
+
+// A BGR image, 8 bits per color.
+class image
+{
+public:
+    image() = default;
+
+    std::span<uint8_t> pixels() { return data_.span(); }
+    std::span<const uint8_t> pixels() const { return data_.span(); }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    explicit operator bool() const { return bool(data_); }
+
+private:
+    friend class converter;
+    image(buffer<uint8_t> data, int width, int height) : data_(std::move(data)), width_(width), height_(height) {}
+
+    buffer<uint8_t> data_;
+    int width_ = 0, height_ = 0;
+};
+
+// The normalization prepared for a frame, and the statistics gathered
+// along it, in buffers from pools of its converter. Its conversion reads
+// the statistics, so they're kept with the frame rather than in the
+// converter, which can prepare the next frame meanwhile.
+class normalization
+{
+public:
+    normalization() = default;
+
+    // Whether the frame is normalized.
+    explicit operator bool() const { return normalized_; }
+    float min() const { return norm_.min; }
+    float max() const { return norm_.max; }
+
+    // For detect_flicker() and detect_motion().
+    const struct stats &stats() const { return stats_; }
+
+private:
+    friend class converter;
+
+    struct norm norm_ = {};                      // Pointing to no statistics, only copied along with them
+    struct stats stats_ = {};
+    buffer<uint32_t> rows_, bins_;
+    buffer<int> clipped_rows_;
+    bool normalized_ = false;
+};
+
+class frame_stream;
+
+// Converts the frames of a single stream, keeping its normalization
+// state, its options and the pools of its frames, images, statistics
+// and the workspaces of the conversions. Only the pools and the
+// conversions with a prepared normalization may be used from several
+// threads at once.
+class converter
+{
+public:
+    // The threads converting a frame, 0 for one per core, and the
+    // processing of the frames, whose master frames and LUT must
+    // outlive the converter.
+    converter(int width, int height, enum pattern pattern = PATTERN_RGGB, enum norm_mode mode = NORM_FRAME,
+              bool packed = false, int threads = 0, const struct options &options = {})
+        : options_(options),
+          frames_(RG10_SIZE((std::size_t)width, height) / sizeof(uint16_t)),
+          images_(RGB_SIZE((std::size_t)width, height)),
+          rows_(std::max(height, 1)),
+          bins_((std::size_t)STATS_BINS(std::max(width, 1))*STATS_BINS(std::max(height, 1))),
+          clipped_rows_(std::max(height, 1))
+    {
+        if(width <= 0 || height <= 0 || pattern < 0 || pattern >= PATTERNS)
+            throw std::invalid_argument("bayer2tga: invalid frame format");
+        set_format(&fmt_, width, height, pattern);
+        fmt_.packed = packed;
+        norm_.mode = mode;
+        threads_ = threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency());
+        if(!check_options(&options_, &fmt_))
+            throw std::invalid_argument("bayer2tga: options that can't process the frame format");
+    }
+    converter(const converter &) = delete;
+    converter &operator=(const converter &) = delete;
+    ~converter()
+    {
+        for(struct workspace &workspace : workspaces_)
+            std::free(workspace.data);
+    }
+
+    int width() const { return fmt_.width; }
+    int height() const { return fmt_.height; }
+    const struct format &format() const { return fmt_; }
+    const struct options &options() const { return options_; }
+
+    frame make_frame() { return frame(frames_.acquire()); }
+    image make_image() { return image(images_.acquire(), fmt_.width, fmt_.height); }
+
+    // Convert a raw frame to a BGR image, of RG10_SIZE and RGB_SIZE bytes.
+    void convert(std::span<const uint16_t> raw, std::span<uint8_t> bgr)
+    {
+        convert(raw, bgr, normalize(raw));
+    }
+
+    // Prepare the normalization of the next frame of the stream, and
+    // gather its statistics.
+    normalization normalize(std::span<const uint16_t> raw)
+    {
+        check(raw.size_bytes(), RG10_SIZE((std::size_t)fmt_.width, fmt_.height));
+        normalization prepared;
+        prepared.rows_ = rows_.acquire();
+        prepared.bins_ = bins_.acquire();
+        prepared.stats_.rows = prepared.rows_.data();
+        prepared.stats_.bins = prepared.bins_.data();
+        if(options_.highlights)
+        {
+            prepared.clipped_rows_ = clipped_rows_.acquire();
+            prepared.stats_.clip = options_.highlights;
+            prepared.stats_.clipped_rows = prepared.clipped_rows_.data();
+        }
+
+        norm_.stats = &prepared.stats_;
+        const struct norm *norm = prepare_norm(const_cast<uint16_t *>(raw.data()), &fmt_, COLORS_ALL, &norm_,
+                                               &options_);
+        norm_.stats = nullptr;
+        if(norm)
+        {
+            prepared.norm_ = *norm;
+            prepared.norm_.stats = nullptr;
+            prepared.normalized_ = true;
+        }
+        return prepared;
+    }
+
+    // Convert a raw frame with the normalization normalize() prepared for
+    // it, so the frames of a stream can be converted concurrently. When
+    // given the focus, with its grid of zones set, it's measured along.
+    void convert(std::span<const uint16_t> raw, std::span<uint8_t> bgr, const normalization &prepared,
+                 struct focus *focus = nullptr) const
+    {
+        check(raw.size_bytes(), RG10_SIZE((std::size_t)fmt_.width, fmt_.height));
+        check(bgr.size(), RGB_SIZE((std::size_t)fmt_.width, fmt_.height));
+        if(focus && (focus->columns <= 0 || focus->rows <= 0))
+            throw std::invalid_argument("bayer2tga: invalid focus zones");
+
+        // The C functions only read the frame and the statistics
+        struct norm norm = prepared.norm_;
+        norm.stats = const_cast<struct stats *>(&prepared.stats_);
+        struct workspace workspace = take_workspace();
+        bool converted = ::debayer_focus(const_cast<uint16_t *>(raw.data()), &fmt_, prepared ? &norm : nullptr,
+                                         &options_, bgr.data(), threads_, focus, &workspace);
+        give_workspace(workspace);
+        if(!converted)
+            throw std::bad_alloc();
+    }
+
+    image convert(const frame &raw)
+    {
+        image bgr = make_image();
+        convert(raw.samples(), bgr.pixels());
+        return bgr;
+    }
+
+    // The frames of a file, "-" for stdin, or of an open file, which is
+    // left open.
+    frame_stream frames(const std::string &name);
+    frame_stream frames(std::FILE *file);
+
+private:
+    friend class frame_stream;
+
+    static void check(std::size_t size, std::size_t needed)
+    {
+        if(size < needed)
+            throw std::length_error("bayer2tga: buffer smaller than the frame format");
+    }
+
+    // A workspace for a conversion, an empty one when all the others are
+    // in use, and giving it back once done.
+    struct workspace take_workspace() const
+    {
+        std::lock_guard<std::mutex> lock(workspaces_mutex_);
+        if(workspaces_.empty())
+        {
+            workspaces_.reserve(++workspaces_count_);   // So giving the workspaces back never allocates
+            return {};
+        }
+        struct workspace workspace = workspaces_.back();
+        workspaces_.pop_back();
+        return workspace;
+    }
+    void give_workspace(const struct workspace &workspace) const
+    {
+        std::lock_guard<std::mutex> lock(workspaces_mutex_);
+        workspaces_.push_back(workspace);
+    }
+
+    struct format fmt_ = {};
+    struct norm norm_ = {};
+    struct options options_;
+    int threads_;
+    pool<uint16_t> frames_;
+    pool<uint8_t> images_;
+    pool<uint32_t> rows_, bins_;                 // Of the statistics of the frames
+    pool<int> clipped_rows_;
+    mutable std::vector<struct workspace> workspaces_;
+    mutable std::size_t workspaces_count_ = 0;
+    mutable std::mutex workspaces_mutex_;
+};
+
+// The frames of a multi-frame input, as an input range. The current
+// frame can be moved out of the stream to keep it, otherwise its buffer
+// is reused for reading the next one.
+class frame_stream
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = frame;
+        using difference_type = std::ptrdiff_t;
+        using reference = frame &;
+        using pointer = frame *;
+
+        iterator() = default;
+        frame &operator*() const { return stream_->frame_; }
+        frame *operator->() const { return &stream_->frame_; }
+        iterator &operator++()
+        {
+            stream_->next();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(std::default_sentinel_t) const { return !stream_->frame_; }
+
+    private:
+        friend class frame_stream;
+        explicit iterator(frame_stream *stream) : stream_(stream) {}
+
+        frame_stream *stream_ = nullptr;
+    };
+
+    frame_stream(frame_stream &&) = default;
+
+    iterator begin()
+    {
+        if(!started_)
+        {
+            started_ = true;
+            next();
+        }
+        return iterator(this);
+    }
+    std::default_sentinel_t end() const { return {}; }
+
+    // Read the next frame and move it out of the stream, instead of
+    // iterating. The frame is empty at the end of the stream.
+    frame take()
+    {
+        started_ = true;
+        next();
+        return std::move(frame_);
+    }
+
+private:
+    friend class converter;
+
+    frame_stream(converter *owner, std::FILE *file, bool owned) : converter_(owner), file_(file, file_closer{owned}) {}
+
+    // Read the next frame, leaving the current one empty at the end.
+    void next()
+    {
+        frame current = std::move(frame_);
+        if(!current)
+            current = converter_->make_frame();
+        if(!read_frame(file_.get(), current.data_.data(), &converter_->fmt_))
+        {
+            if(std::ferror(file_.get()))
+                throw std::system_error(errno, std::generic_category(), "bayer2tga: reading a frame");
+            return;
+        }
+        current.index_ = index_++;
+        frame_ = std::move(current);
+    }
+
+    converter *converter_;
+    std::unique_ptr<std::FILE, file_closer> file_;
+    frame frame_;
+    unsigned long index_ = 0;
+    bool started_ = false;
+};
+
+inline frame_stream converter::frames(const std::string &name)
+{
+    if(name == "-")
+        return frame_stream(this, stdin, false);
+    std::FILE *file = std::fopen(name.c_str(), "rb");
+    if(!file)
+        throw std::system_error(errno, std::generic_category(), "bayer2tga: " + name);
+    return frame_stream(this, file, true);
+}
+
+inline frame_stream converter::frames(std::FILE *file)
+{
+    return frame_stream(this, file, false);
+}
+
+// Frees a 3D LUT of read_lut().
+struct lut_deleter
+{
+    void operator()(struct lut *lut) const { free_lut(lut); }
+};
+
+// Read a 3D LUT from a .cube file, for the options of a converter.
+inline std::unique_ptr<struct lut, lut_deleter> read_lut(const std::string &name)
+{
+    std::unique_ptr<struct lut, lut_deleter> lut(::read_lut(name.c_str()));
+    if(!lut)
+        throw std::runtime_error("bayer2tga: no 3D LUT read from " + name);
+    return lut;
+}
+
+// Read the lateral chromatic aberration of a lens from a lens profile,
+// the lens named, or the first one when empty.
+inline struct lens read_lens(const std::string &name, const std::string &model = {})
+{
+    struct lens lens;
+    if(!::read_lens(name.c_str(), model.empty() ? nullptr : model.c_str(), &lens))
+        throw std::runtime_error("bayer2tga: no lens " + (model.empty() ? "" : model + " ") + "read from " + name);
+    return lens;
+}
+
+// Save an image as a TGA file.
+inline void write_tga(const std::string &name, const image &image)
+{
+    std::unique_ptr<std::FILE, file_closer> file(std::fopen(name.c_str(), "wb"));
+    if(!file)
+        throw std::system_error(errno, std::generic_category(), "bayer2tga: " + name);
+    if(!put_tga(file.get(), image.pixels().data(), image.width(), image.height()))
+        throw std::system_error(errno, std::generic_category(), "bayer2tga: writing " + name);
+}
+
+}
+
+#endif
@@ -0,0 +1,461 @@
+/*
+    An asynchronous pipeline over the C++ interface of bayer2tga.hpp, with
+    C++20 coroutines. Reading, converting and writing a frame are
+    awaitable tasks: the conversions run on a pool of worker threads, and
+    the reading and writing on an I/O thread of their own, so the disk
+    and the pipe never hold up a worker. The frames are read and their
+    normalization prepared in order, and converted and written
+    concurrently, at most depth frames at a time (backpressure, which
+    also bounds the frame and image pools). Once its stop token is
+    triggered a run stops reading, drops the frames not yet converted and
+    waits for the rest.
+
+        bayer2tga::converter converter(1920, 1080, PATTERN_RGGB, NORM_FRAME, false, 1);
+        bayer2tga::pipeline pipeline(converter);
+        unsigned long frames = bayer2tga::sync_wait(pipeline.run("-", "frame%05d.tga"));
+
+    Each conversion uses the threads of the converter, so it's usually
+    made with a single one and the pipeline gets one worker per core.
+*/
+
+#ifndef BAYER2TGA_ASYNC_HPP
+#define BAYER2TGA_ASYNC_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stop_token>
+#include <type_traits>
+
+#include "bayer2tga.hpp"
+
+namespace bayer2tga
+{
+
+template<typename T = void> class task;
+
+namespace detail
+{
+
+// The result of a task, a value or an exception.
+template<typename T>
+struct result
+{
+    std::optional<T> value;
+    std::exception_ptr error;
+
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T get()
+    {
+        if(error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct result<void>
+{
+    std::exception_ptr error;
+
+    void return_void() {}
+    void get()
+    {
+        if(error)
+            std::rethrow_exception(error);
+    }
+};
+
+// Whether a printf pattern takes a single int, the number of a frame,
+// and nothing else.
+inline bool frame_pattern(const std::string &pattern)
+{
+    int conversions = 0;
+
+    for(std::size_t i = 0; i < pattern.size(); i++)
+    {
+        if(pattern[i] != '%')
+            continue;
+        if(++i < pattern.size() && pattern[i] == '%')
+            continue;
+        i = pattern.find_first_not_of("-+ #0123456789.", i);
+        if(i == std::string::npos || (pattern[i] != 'd' && pattern[i] != 'i'))
+            return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// A coroutine started right away and destroyed when it's done, for the
+// tasks nobody awaits.
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+}
+
+// A coroutine started when awaited, resuming its caller when it's done.
+template<typename T>
+class task
+{
+public:
+    struct promise_type : detail::result<T>
+    {
+        std::coroutine_handle<> caller = std::noop_coroutine();
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> done) noexcept
+                {
+                    return done.promise().caller;
+                }
+                void await_resume() noexcept {}
+            };
+            return awaiter{};
+        }
+        void unhandled_exception() { this->error = std::current_exception(); }
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        if(this != &other)
+        {
+            if(handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~task()
+    {
+        if(handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle_.promise().caller = caller;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().get(); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Threads resuming the coroutines scheduled on them, in order.
+class executor
+{
+public:
+    explicit executor(int threads)
+    {
+        for(int i = 0; i < threads; i++)
+            threads_.emplace_back([this] { work(); });
+    }
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+    ~executor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for(auto &thread : threads_)
+            thread.join();
+    }
+
+    // Continue the awaiting coroutine on one of the threads.
+    auto schedule()
+    {
+        struct awaiter
+        {
+            executor *owner;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { owner->post(handle); }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this};
+    }
+
+    // Notified under the lock, the last coroutine may let the executor be
+    // destroyed as soon as it runs.
+    void post(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(handle);
+        ready_.notify_one();
+    }
+
+private:
+    void work()
+    {
+        for(;;)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if(queue_.empty())
+                return;
+            std::coroutine_handle<> handle = queue_.front();
+            queue_.pop_front();
+            lock.unlock();
+            handle.resume();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::coroutine_handle<>> queue_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+};
+
+// A counting semaphore whose waiters are suspended coroutines instead of
+// blocked threads. A released slot resumes its waiter on the releasing
+// thread.
+class async_semaphore
+{
+public:
+    explicit async_semaphore(int count) : count_(count) {}
+
+    auto acquire()
+    {
+        struct awaiter
+        {
+            async_semaphore *owner;
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                std::lock_guard<std::mutex> lock(owner->mutex_);
+                if(owner->count_ > 0)
+                {
+                    owner->count_--;
+                    return false;
+                }
+                owner->waiters_.push_back(handle);
+                return true;
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this};
+    }
+
+    void release()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if(waiters_.empty())
+        {
+            count_++;
+            return;
+        }
+        std::coroutine_handle<> waiter = waiters_.front();
+        waiters_.pop_front();
+        lock.unlock();
+        waiter.resume();
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<std::coroutine_handle<>> waiters_;
+    int count_;
+};
+
+namespace detail
+{
+
+// Signals a thread blocked waiting. Notified under the lock, so the
+// waiter can't return and destroy it while it's still being notified.
+struct signal
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+
+    void notify()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return done; });
+    }
+};
+
+template<typename T>
+detached wait_for(task<T> &work, result<T> &out, signal &done)
+{
+    try
+    {
+        if constexpr(std::is_void_v<T>)
+            co_await work;
+        else
+            out.return_value(co_await work);
+    }
+    catch(...)
+    {
+        out.error = std::current_exception();
+    }
+    done.notify();
+}
+
+}
+
+// Run a task to its end, blocking the calling thread. Returns its value,
+// or throws its exception.
+template<typename T>
+T sync_wait(task<T> work)
+{
+    detail::result<T> out;
+    detail::signal done;
+    detail::wait_for(work, out, done);
+    done.wait();
+    return out.get();
+}
+
+// Converts the frames of a stream of a converter asynchronously.
+class pipeline
+{
+public:
+    // The worker threads, 0 for one per core, and the frames in flight,
+    // 0 for two per worker.
+    explicit pipeline(converter &converter, int threads = 0, int depth = 0)
+        : converter_(converter),
+          threads_(threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency())),
+          depth_(depth > 0 ? depth : 2*threads_),
+          slots_(depth_),
+          workers_(threads_),
+          io_(1) {}
+    pipeline(const pipeline &) = delete;
+    pipeline &operator=(const pipeline &) = delete;
+
+    // Read the next frame of a stream on the I/O thread. The frame is
+    // empty at the end of the stream.
+    task<frame> read(frame_stream &stream)
+    {
+        co_await io_.schedule();
+        co_return stream.take();
+    }
+
+    // Convert a frame on a worker, with the normalization prepared for it.
+    task<image> convert(frame raw, normalization norm)
+    {
+        co_await workers_.schedule();
+        image bgr = converter_.make_image();
+        converter_.convert(raw.samples(), bgr.pixels(), norm);
+        co_return bgr;
+    }
+
+    // Save an image as a TGA file on the I/O thread.
+    task<> write(std::string name, image bgr)
+    {
+        co_await io_.schedule();
+        write_tga(name, bgr);
+    }
+
+    // Convert the frames of the input, "-" for stdin, to TGA files named
+    // by the printf pattern output after their number, until the end of
+    // the input or a stop request. Returns the frames written, or throws
+    // the first error once the frames in flight are done. The pattern
+    // must have a single integer conversion, such as %05d.
+    task<unsigned long> run(std::string input, std::string output, std::stop_token stop = {})
+    {
+        if(!detail::frame_pattern(output))
+            throw std::invalid_argument("bayer2tga: the output pattern needs a single integer conversion");
+        failed_ = false;
+        written_ = 0;
+        error_ = nullptr;
+
+        co_await io_.schedule();
+        frame_stream stream = converter_.frames(input);
+        for(;;)
+        {
+            co_await slots_.acquire();           // Backpressure, at most depth frames in flight
+            frame raw;
+            if(!stop.stop_requested() && !failed_)
+                raw = co_await read(stream);
+            if(!raw)
+            {
+                slots_.release();
+                break;
+            }
+            normalization norm = converter_.normalize(raw.samples());
+            process(std::move(raw), std::move(norm), output, stop);
+        }
+
+        // Wait for the frames in flight
+        for(int i = 0; i < depth_; i++)
+            co_await slots_.acquire();
+        for(int i = 0; i < depth_; i++)
+            slots_.release();
+        if(error_)
+            std::rethrow_exception(error_);
+        co_return written_;
+    }
+
+private:
+    // Convert and write a frame, giving its slot back when it's done.
+    detail::detached process(frame raw, normalization norm, std::string output, std::stop_token stop)
+    {
+        try
+        {
+            frame owned = std::move(raw);        // Back to their pools before the slot, not with the coroutine
+            normalization prepared = std::move(norm);
+            const int length = std::snprintf(nullptr, 0, output.c_str(), (int)owned.index());
+            if(length < 0)
+                throw std::invalid_argument("bayer2tga: unable to name the output of frame " +
+                                            std::to_string(owned.index()));
+            std::vector<char> name(length + 1);
+            std::snprintf(name.data(), name.size(), output.c_str(), (int)owned.index());
+            if(!stop.stop_requested() && !failed_)
+            {
+                image bgr = co_await convert(std::move(owned), std::move(prepared));
+                co_await write(name.data(), std::move(bgr));
+                written_++;
+            }
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(!error_)
+                error_ = std::current_exception();
+            failed_ = true;
+        }
+        slots_.release();
+    }
+
+    converter &converter_;
+    int threads_, depth_;
+    async_semaphore slots_;
+    std::mutex mutex_;
+    std::exception_ptr error_;
+    std::atomic<bool> failed_ = false;
+    std::atomic<unsigned long> written_ = 0;
+    executor workers_, io_;                      // Last, so their threads are joined first
+};
+
+}
+
+#endif
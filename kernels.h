@@ -0,0 +1,662 @@
+/*
+    The SIMD kernels, written once against simd.h and compiled for every
+    instruction set by including this file after it. Each one handles
+    the values left over from the vectors one by one, and gives exactly
+    the same results as the plain C code it replaces, but focus_kernel:
+    its float sums are added in another order on every vector width, so
+    they may differ in their last bits (about 1e-7 of them).
+*/
+
+// Find the min and max of the given colors of a frame. The samples of
+// the colors that aren't counted are replaced by the neutral value. When
+// given sums, the sum of all the samples of each row of blocks is saved
+// to it along the way, and when given bins, the sums of the blocks are
+// added to the bins of STATS_BIN x STATS_BIN blocks they're in. When
+// given clipped, the samples of each row of blocks at or over clip are
+// counted into it, by their position in the block.
+INTERNAL void SIMD(min_max_kernel)(const uint16_t *buffer, const struct format *fmt, unsigned int colors,
+                                   uint16_t *min, uint16_t *max, uint32_t *sums, uint32_t *bins, uint16_t clip,
+                                   uint32_t *clipped)
+{
+    const int *position = pattern_positions[fmt->pattern];
+    const int samples = fmt->width*RG10_COLOR_SIZE;
+    int counted[RG10_COLORS] = {0};
+    int32_t blocks[bins ? fmt->width : 1];
+    v_u16 keep[2], low = v_set_u16(65535), high = v_set_u16(0), level = v_set_u16(clip);
+
+    for(int color = 0; color < RG10_COLORS; color++)
+        counted[position[color]] = (colors >> color) & 1;
+    for(int row = 0; row < 2; row++)
+        for(int i = 0; i < V_LANES(uint16_t); i++)
+            keep[row][i] = counted[row*2 + (i & 1)] ? 0xffff : 0;
+
+    *min = 65535;
+    *max = 0;
+    for(int y = 0; y < fmt->height; y++)
+    {
+        v_u32 total = v_set_u32(0);
+        uint32_t tail = 0;
+        if(bins)
+            memset(blocks, 0, fmt->width*sizeof(int32_t));
+        for(int row = 0; row < 2; row++)
+        {
+            const uint16_t *src = buffer + RG10_LOCATION(0, y, fmt->stride, 0) + row*fmt->stride*RG10_COLOR_SIZE;
+            v_u16 hits = v_set_u16(0);
+            uint32_t *count = clipped ? clipped + (size_t)y*RG10_COLORS + row*2 : NULL;
+            int i = 0;
+            for(; i + V_LANES(uint16_t) <= samples; i += V_LANES(uint16_t))
+            {
+                v_u16 v = v_load_u16(src + i);
+                low = v_min_u16(low, v | ~keep[row]);
+                high = v_max_u16(high, v & keep[row]);
+                if(clipped)
+                    hits -= (v_u16)(v >= level);
+                if(sums || bins)
+                {
+                    v_i32 pairs = v_even_u16(v) + v_odd_u16(v);
+                    total += (v_u32)pairs;
+                    if(bins)
+                        v_store_i32(blocks + i/2, v_load_i32(blocks + i/2) + pairs);
+                }
+            }
+            if(clipped)
+            {
+                count[0] = v_hsum_u32((v_u32)v_even_u16(hits));
+                count[1] = v_hsum_u32((v_u32)v_odd_u16(hits));
+            }
+            for(; i < samples; i++)
+            {
+                tail += src[i];
+                if(bins)
+                    blocks[i/2] += src[i];
+                if(clipped && src[i] >= clip)
+                    count[i & 1]++;
+                if(!counted[row*2 + (i & 1)])
+                    continue;
+                if(*max < src[i]) *max = src[i];
+                if(*min > src[i]) *min = src[i];
+            }
+        }
+        if(sums)
+            sums[y] = v_hsum_u32(total) + tail;
+        if(bins)
+        {
+            uint32_t *bin = bins + (size_t)(y / STATS_BIN)*STATS_BINS(fmt->width);
+            for(int x = 0; x < fmt->width; x++)
+                bin[x / STATS_BIN] += blocks[x];
+        }
+    }
+    if(*min > v_hmin_u16(low)) *min = v_hmin_u16(low);
+    if(*max < v_hmax_u16(high)) *max = v_hmax_u16(high);
+}
+
+// Normalize count samples like stage_normalize. ROUND_CLIP rounds halves
+// up, so the ties the vector rounding takes to even are moved up.
+INTERNAL void SIMD(normalize_kernel)(const uint16_t *src, uint16_t *dst, int count, float min, float mult)
+{
+    int i = 0;
+
+    for(; i + V_LANES(uint16_t) <= count; i += V_LANES(uint16_t))
+    {
+        v_u16 v = v_load_u16(src + i);
+        v_i32 pair[2] = {v_even_u16(v), v_odd_u16(v)};
+        for(int half = 0; half < 2; half++)
+        {
+            v_f32 x = v_clamp_f32((v_float(pair[half]) - min) * mult, -1, MAX_RG10 + 1);
+            v_i32 rounded = v_round(x);
+            rounded -= x - v_float(rounded) == 0.5f;
+            pair[half] = v_clamp_i32(rounded, 0, MAX_RG10);
+        }
+        v_store_u16(dst + i, v_pair_u16(pair[0], pair[1]));
+    }
+    for(; i < count; i++)
+    {
+        int normalized = ROUND_CLIP((src[i] - min) * mult);
+        dst[i] = normalized > MAX_RG10 ? MAX_RG10 : normalized;
+    }
+}
+
+// Calibrate count samples: subtract the dark frame, clipping at 0, and
+// multiply by the flat field gains, rounding and saturating to 16 bits.
+// Either of them is NULL when not given.
+INTERNAL void SIMD(calibrate_kernel)(const uint16_t *src, uint16_t *dst, const uint16_t *dark, const uint16_t *gain,
+                                     int count)
+{
+    int i = 0;
+
+    for(; i + V_LANES(uint16_t) <= count; i += V_LANES(uint16_t))
+    {
+        v_u16 v = v_load_u16(src + i);
+        if(dark)
+            v -= v_min_u16(v, v_load_u16(dark + i));
+        if(gain)
+        {
+            v_u16 g = v_load_u16(gain + i);
+            v_u32 even = ((v_u32)v_even_u16(v) * (v_u32)v_even_u16(g) + FLAT_ONE/2) >> FLAT_BITS;
+            v_u32 odd = ((v_u32)v_odd_u16(v) * (v_u32)v_odd_u16(g) + FLAT_ONE/2) >> FLAT_BITS;
+            v = v_pair_u16((v_i32)v_min_u32(even, v_set_u32(65535)), (v_i32)v_min_u32(odd, v_set_u32(65535)));
+        }
+        v_store_u16(dst + i, v);
+    }
+    for(; i < count; i++)
+    {
+        uint32_t value = src[i];
+        if(dark)
+            value = value > dark[i] ? value - dark[i] : 0;
+        if(gain)
+            value = (value*gain[i] + FLAT_ONE/2) >> FLAT_BITS;
+        dst[i] = value > 65535 ? 65535 : value;
+    }
+}
+
+// Add a vector of neighbours to the sums and counts of the samples of
+// the center, the even and the odd ones, they're within the threshold of.
+static inline void SIMD(add_neighbours)(v_u16 v, v_i32 even, v_i32 odd, int threshold, v_i32 *sums, v_i32 *counts)
+{
+    v_i32 a = v_even_u16(v), b = v_odd_u16(v);
+    v_i32 keep_a = (a - even <= threshold) & (even - a <= threshold);
+    v_i32 keep_b = (b - odd <= threshold) & (odd - b <= threshold);
+    sums[0] += a & keep_a;
+    sums[1] += b & keep_b;
+    counts[0] -= keep_a;
+    counts[1] -= keep_b;
+}
+
+// Denoise a sample of a sensor row with a sigma filter, one by one.
+static inline uint16_t SIMD(denoise_sample)(const uint16_t *const *rows, int i, int samples, int threshold)
+{
+    int sum = 0, count = 0;
+
+    for(int r = 0; r < 3; r++)
+        for(int j = i - 2; j <= i + 2; j += 2)
+            if(j >= 0 && j < samples && abs(rows[r][j] - rows[1][i]) <= threshold)
+            {
+                sum += rows[r][j];
+                count++;
+            }
+    return lrintf((float)sum/count);
+}
+
+// Denoise the row of blocks in rows[1] with a sigma filter: every sample
+// becomes the mean of the samples of its color around it, the 3x3 of
+// them in its sensor row and those of the blocks above and below, 2
+// samples apart, that are within the threshold of it. Noise is averaged
+// out while edges, further apart than the threshold, are kept. At the
+// ends of the rows only the neighbours there are count.
+INTERNAL void SIMD(denoise_kernel)(const uint16_t *const *rows, uint16_t *out, int width, int threshold)
+{
+    const int samples = width*RG10_COLOR_SIZE;
+
+    for(int half = 0; half < 2; half++)
+    {
+        const uint16_t *row[3] = {rows[0] + half*samples, rows[1] + half*samples, rows[2] + half*samples};
+        uint16_t *dst = out + half*samples;
+        int i = 0;
+
+        for(; i < 2 && i < samples; i++)
+            dst[i] = SIMD(denoise_sample)(row, i, samples, threshold);
+        for(; i + V_LANES(uint16_t) + 2 <= samples; i += V_LANES(uint16_t))
+        {
+            v_u16 center = v_load_u16(row[1] + i);
+            v_i32 even = v_even_u16(center), odd = v_odd_u16(center);
+            v_i32 sums[2] = {v_set_i32(0), v_set_i32(0)}, counts[2] = {v_set_i32(0), v_set_i32(0)};
+            for(int r = 0; r < 3; r++)
+            {
+                SIMD(add_neighbours)(v_load_u16(row[r] + i - 2), even, odd, threshold, sums, counts);
+                SIMD(add_neighbours)(v_load_u16(row[r] + i), even, odd, threshold, sums, counts);
+                SIMD(add_neighbours)(v_load_u16(row[r] + i + 2), even, odd, threshold, sums, counts);
+            }
+            v_store_u16(dst + i, v_pair_u16(v_round(v_float(sums[0]) / v_float(counts[0])),
+                                            v_round(v_float(sums[1]) / v_float(counts[1]))));
+        }
+        for(; i < samples; i++)
+            dst[i] = SIMD(denoise_sample)(row, i, samples, threshold);
+    }
+}
+
+// Resample a red or blue of a row of blocks, at the location loc in the
+// blocks, from the position it's taken from along the rows and its
+// weight fy between the rows above and below, one by one. Past the ends
+// of the rows the blocks there are repeated.
+static inline uint16_t SIMD(lateral_sample)(const uint16_t *above, const uint16_t *below, int loc, int width,
+                                            int32_t position, int fy)
+{
+    const int ix = position >> LATERAL_FRACTION, fx = position >> (LATERAL_FRACTION - LATERAL_BITS) & (LATERAL_ONE - 1);
+    const int x0 = ix < 0 ? 0 : ix >= width ? width - 1 : ix;
+    const int x1 = ix + 1 < 0 ? 0 : ix + 1 >= width ? width - 1 : ix + 1;
+    const int top = above[2*x0 + loc]*(LATERAL_ONE - fx) + above[2*x1 + loc]*fx;
+    const int bottom = below[2*x0 + loc]*(LATERAL_ONE - fx) + below[2*x1 + loc]*fx;
+
+    return (top*(LATERAL_ONE - fy) + bottom*fy + (1 << (2*LATERAL_BITS - 1))) >> 2*LATERAL_BITS;
+}
+
+// Interpolate a vector of the samples of a color of a sensor row, the
+// even or the odd ones, each with the next one by the weights fx.
+static inline v_i32 SIMD(lateral_interpolate)(const uint16_t *row, int odd, v_i32 fx)
+{
+    v_u16 a = v_load_u16(row), b = v_load_u16(row + 2);
+
+    return (odd ? v_odd_u16(a) : v_even_u16(a))*(LATERAL_ONE - fx) + (odd ? v_odd_u16(b) : v_even_u16(b))*fx;
+}
+
+// Correct the lateral chromatic aberration of the row of blocks in
+// rows[halo]: its reds and blues are taken from where the lens put them
+// by the resampling of lateral, while the greens stay. The scaling is
+// separable, so each color of a row is interpolated between the same
+// two rows, and where the blocks it's taken from are as far apart as
+// the ones they go to, nearly everywhere, a vector of them is two loads
+// of each row.
+INTERNAL void SIMD(lateral_kernel)(const uint16_t *const *rows, uint16_t *out, const struct format *fmt,
+                                   const struct lateral *lateral, int y)
+{
+    const int locations[2] = {fmt->r, fmt->b}, width = fmt->width, halo = lateral->halo;
+    v_i32 lanes;
+
+    for(int k = 0; k < V_LANES(uint32_t); k++)
+        lanes[k] = k;
+    memcpy(out, rows[halo], (size_t)width*RG10_COLORS*sizeof(uint16_t));
+    for(int c = 0; c < 2; c++)
+    {
+        const int loc = locations[c], even = loc & ~1;
+        const int32_t step = lateral->steps[c], origin = lateral->origins[c][0];
+        const int32_t position = y*step + lateral->origins[c][1];
+        const int row = (position >> LATERAL_FRACTION) - y;
+        const int fy = position >> (LATERAL_FRACTION - LATERAL_BITS) & (LATERAL_ONE - 1);
+        const uint16_t *above = rows[halo + (row < -halo ? -halo : row > halo ? halo : row)];
+        const uint16_t *below = rows[halo + (row + 1 < -halo ? -halo : row + 1 > halo ? halo : row + 1)];
+        int x = 0;
+
+        for(; x + V_LANES(uint32_t) <= width; x += V_LANES(uint32_t))
+        {
+            v_i32 positions = (lanes + x)*step + origin;
+            const int first = positions[0] >> LATERAL_FRACTION;
+            const int last = positions[V_LANES(uint32_t) - 1] >> LATERAL_FRACTION;
+            if(first < 0 || last + 1 >= width || last - first != V_LANES(uint32_t) - 1)
+            {
+                for(int k = 0; k < V_LANES(uint32_t); k++)
+                    out[2*(x + k) + loc] = SIMD(lateral_sample)(above, below, loc, width, positions[k], fy);
+                continue;
+            }
+            v_i32 fx = positions >> (LATERAL_FRACTION - LATERAL_BITS) & (LATERAL_ONE - 1);
+            v_i32 top = SIMD(lateral_interpolate)(above + even + 2*first, loc & 1, fx);
+            v_i32 bottom = SIMD(lateral_interpolate)(below + even + 2*first, loc & 1, fx);
+            v_i32 value = (top*(LATERAL_ONE - fy) + bottom*fy + (1 << (2*LATERAL_BITS - 1))) >> 2*LATERAL_BITS;
+            v_u16 kept = v_load_u16(out + even + 2*x);
+            v_store_u16(out + even + 2*x, loc & 1 ? v_pair_u16(v_even_u16(kept), value)
+                                                  : v_pair_u16(value, v_odd_u16(kept)));
+        }
+        for(; x < width; x++)
+            out[2*x + loc] = SIMD(lateral_sample)(above, below, loc, width, x*step + origin, fy);
+    }
+}
+
+// Demosaic a row of blocks into the planes of the chroma stage, like
+// demosaic_pixel normalizing it first when given the levels: the greens,
+// and the reds and blues less the greens, offset by MAX_RG10 so they're
+// positive.
+INTERNAL void SIMD(chroma_planes_kernel)(const uint16_t *src, uint16_t *dst, const struct format *fmt,
+                                         const struct levels *levels)
+{
+    const int locations[RG10_COLORS] = {fmt->r, fmt->gr, fmt->gb, fmt->b};
+    const int width = fmt->width;
+    int x = 0;
+
+    for(; x + V_LANES(uint32_t) <= width; x += V_LANES(uint32_t))
+    {
+        v_i32 colors[RG10_COLORS];
+        for(int color = 0; color < RG10_COLORS; color++)
+        {
+            v_u16 v = v_load_u16(src + (locations[color] & ~1) + 2*x);
+            v_i32 value = (locations[color] & 1) ? v_odd_u16(v) : v_even_u16(v);
+            if(levels == &fixed_levels)
+            {
+                value = v_min_i32(value, v_set_i32(MAX_RG10));
+                for(int k = 0; k < V_LANES(uint32_t); k++)
+                    value[k] = fixed_table[value[k]];
+            }
+            else if(levels)
+            {
+                v_f32 scaled = v_clamp_f32((v_float(value) - levels->min) * levels->mult, -1, MAX_RG10 + 1);
+                value = v_round(scaled);
+                value -= scaled - v_float(value) == 0.5f;
+            }
+            colors[color] = v_clamp_i32(value, 0, MAX_RG10);
+        }
+        v_i32 green = (colors[1] + colors[2]) >> 1;
+        v_store_narrow_u16(dst + x, green);
+        v_store_narrow_u16(dst + width + x, colors[0] - green + MAX_RG10);
+        v_store_narrow_u16(dst + 2*width + x, colors[3] - green + MAX_RG10);
+    }
+    for(; x < width; x++)
+    {
+        int rgb[RGB_COLORS];
+        demosaic_pixel(src, x, fmt, levels, rgb);
+        dst[x] = rgb[RGB_G];
+        dst[width + x] = rgb[RGB_R] - rgb[RGB_G] + MAX_RG10;
+        dst[2*width + x] = rgb[RGB_B] - rgb[RGB_G] + MAX_RG10;
+    }
+}
+
+// The median of the 3x3 values of a plane of three rows around x, the
+// values at the ends of the rows repeated past them, one by one.
+static inline int SIMD(chroma_median)(const uint16_t *const *rows, int x, int width)
+{
+    int values[9], count = 0;
+
+    for(int r = 0; r < 3; r++)
+        for(int i = x - 1; i <= x + 1; i++)
+        {
+            int value = rows[r][i < 0 ? 0 : i >= width ? width - 1 : i], j = count++;
+            for(; j > 0 && values[j-1] > value; j--)
+                values[j] = values[j-1];
+            values[j] = value;
+        }
+    return values[4];
+}
+
+// Sort 3 vectors lane by lane, into the smallest, middle and largest.
+static inline void SIMD(sort3_u16)(v_u16 *a, v_u16 *b, v_u16 *c)
+{
+    v_u16 low = v_min_u16(*a, *b), high = v_max_u16(*a, *b);
+    *a = v_min_u16(low, *c);
+    *b = v_max_u16(low, v_min_u16(high, *c));
+    *c = v_max_u16(high, *c);
+}
+
+// The medians of the 3x3 values of a plane of three rows around the
+// lanes from x, by sorting networks: the columns of 3 are sorted, and the
+// median of 3 sorted columns is the middle of the largest of their
+// smallest values, the middle of their middle ones and the smallest of
+// their largest ones.
+static inline v_u16 SIMD(chroma_medians)(const uint16_t *const *rows, int x)
+{
+    v_u16 columns[3][3];
+
+    for(int i = 0; i < 3; i++)
+    {
+        for(int r = 0; r < 3; r++)
+            columns[i][r] = v_load_u16(rows[r] + x - 1 + i);
+        SIMD(sort3_u16)(&columns[i][0], &columns[i][1], &columns[i][2]);
+    }
+    v_u16 low = v_max_u16(v_max_u16(columns[0][0], columns[1][0]), columns[2][0]);
+    v_u16 middle = columns[0][1], next = columns[1][1], high = columns[2][1];
+    SIMD(sort3_u16)(&middle, &next, &high);
+    high = v_min_u16(v_min_u16(columns[0][2], columns[1][2]), columns[2][2]);
+    SIMD(sort3_u16)(&low, &next, &high);
+    return next;
+}
+
+// Filter a pixel of the chroma stage back to RGB, one by one, into out
+// or packed to 8 bits into packed.
+static inline void SIMD(chroma_pixel)(uint16_t *out, uint8_t *packed, const uint16_t *greens,
+                                      const uint16_t *const *reds, const uint16_t *const *blues, int x, int width)
+{
+    int red = greens[x] + SIMD(chroma_median)(reds, x, width) - MAX_RG10;
+    int blue = greens[x] + SIMD(chroma_median)(blues, x, width) - MAX_RG10;
+    int colors[RGB_COLORS];
+
+    colors[RGB_R] = red < 0 ? 0 : red > MAX_RG10 ? MAX_RG10 : red;
+    colors[RGB_G] = greens[x];
+    colors[RGB_B] = blue < 0 ? 0 : blue > MAX_RG10 ? MAX_RG10 : blue;
+    for(int c = 0; c < RGB_COLORS; c++)
+        if(packed)
+            packed[RGB_LOCATION(x, 0, 0, c)] = pack_table[colors[c]];
+        else
+            out[RGB_LOCATION(x, 0, 0, c)] = colors[c];
+}
+
+// Filter the pixels of the chroma stage from x, a vector of them, as
+// chroma_pixel does.
+static inline void SIMD(chroma_pixels)(uint16_t *out, uint8_t *packed, const uint16_t *greens,
+                                       const uint16_t *const *reds, const uint16_t *const *blues, int x)
+{
+    const v_u16 green = v_load_u16(greens + x), max = v_set_u16(MAX_RG10);
+    uint16_t colors[RGB_COLORS][V_LANES(uint16_t)];
+
+    v_store_u16(colors[RGB_R], v_min_u16(v_max_u16(green + SIMD(chroma_medians)(reds, x), max) - max, max));
+    v_store_u16(colors[RGB_G], green);
+    v_store_u16(colors[RGB_B], v_min_u16(v_max_u16(green + SIMD(chroma_medians)(blues, x), max) - max, max));
+    if(packed)
+        for(int k = 0; k < V_LANES(uint16_t); k++)
+            for(int c = 0; c < RGB_COLORS; c++)
+                packed[RGB_LOCATION(x + k, 0, 0, c)] = pack_table[colors[c][k]];
+    else
+        for(int k = 0; k < V_LANES(uint16_t); k++)
+            for(int c = 0; c < RGB_COLORS; c++)
+                out[RGB_LOCATION(x + k, 0, 0, c)] = colors[c][k];
+}
+
+// Suppress the false colors of the row of pixels in rows[1], at the
+// edges where the demosaic misplaces the reds and blues, into RGB: the
+// differences of its reds and blues from its greens, in the planes of
+// chroma_planes_kernel, become their medians over the 3x3 pixels around,
+// and the greens are kept. The RGB pixels are written to out, or packed
+// to 8 bits to packed. Only the pixels at the ends of a row are filtered
+// one by one, the last vector overlapping the one before.
+INTERNAL void SIMD(chroma_kernel)(const uint16_t *const *rows, uint16_t *out, uint8_t *packed, int width)
+{
+    const uint16_t *reds[3] = {rows[0] + width, rows[1] + width, rows[2] + width};
+    const uint16_t *blues[3] = {rows[0] + 2*width, rows[1] + 2*width, rows[2] + 2*width};
+
+    if(width < V_LANES(uint16_t) + 2)
+    {
+        for(int x = 0; x < width; x++)
+            SIMD(chroma_pixel)(out, packed, rows[1], reds, blues, x, width);
+        return;
+    }
+    SIMD(chroma_pixel)(out, packed, rows[1], reds, blues, 0, width);
+    for(int x = 1; x + V_LANES(uint16_t) + 1 <= width; x += V_LANES(uint16_t))
+        SIMD(chroma_pixels)(out, packed, rows[1], reds, blues, x);
+    SIMD(chroma_pixels)(out, packed, rows[1], reds, blues, width - 1 - V_LANES(uint16_t));
+    SIMD(chroma_pixel)(out, packed, rows[1], reds, blues, width - 1, width);
+}
+
+// Convert a row of blocks to gray levels, the weighted sum of the colors
+// at the 4 positions of a block plus the offset, rounded like lrintf.
+INTERNAL void SIMD(gray_kernel)(const uint16_t *top, const uint16_t *bottom, uint8_t *out, int width,
+                                const float *weights, float offset)
+{
+    int x = 0;
+
+    for(; x + V_LANES(uint32_t) <= width; x += V_LANES(uint32_t))
+    {
+        v_u16 t = v_load_u16(top + 2*x), b = v_load_u16(bottom + 2*x);
+        v_f32 sum = offset + weights[0]*v_float(v_even_u16(t));
+        sum = sum + weights[1]*v_float(v_odd_u16(t));
+        sum = sum + weights[2]*v_float(v_even_u16(b));
+        sum = sum + weights[3]*v_float(v_odd_u16(b));
+        v_store_u8(out + x, v_clamp_i32(v_round(v_clamp_f32(sum, -1, MAX_RGB + 1)), 0, MAX_RGB));
+    }
+    for(; x < width; x++)
+    {
+        long value = lrintf(offset + weights[0]*top[2*x] + weights[1]*top[2*x+1] +
+                            weights[2]*bottom[2*x] + weights[3]*bottom[2*x+1]);
+        out[x] = value < 0 ? 0 : value > MAX_RGB ? MAX_RGB : value;
+    }
+}
+
+// Add the Laplacian, its square and the squared Sobel gradient of the
+// blocks at the 3 rows of greens to the sums, of the lanes kept.
+static inline void SIMD(add_sharpness)(const int32_t *above, const int32_t *here, const int32_t *below, v_i32 keep,
+                                       v_f32 *sums)
+{
+    v_i32 a0 = v_load_i32(above - 1), a1 = v_load_i32(above), a2 = v_load_i32(above + 1);
+    v_i32 h0 = v_load_i32(here - 1), h1 = v_load_i32(here), h2 = v_load_i32(here + 1);
+    v_i32 b0 = v_load_i32(below - 1), b1 = v_load_i32(below), b2 = v_load_i32(below + 1);
+    v_f32 l = v_float((4*h1 - h0 - h2 - a1 - b1) & keep);
+    v_f32 gx = v_float((a2 + 2*h2 + b2 - a0 - 2*h0 - b0) & keep);
+    v_f32 gy = v_float((b0 + 2*b1 + b2 - a0 - 2*a1 - a2) & keep);
+    sums[0] += l;
+    sums[1] += l*l;
+    sums[2] += gx*gx + gy*gy;
+}
+
+// Measure the sharpness of the row of blocks in rows[1], on the plane of
+// the sums of its greens: the sum of the Laplacian, of its square and of
+// the squared Sobel gradient (Tenengrad), over the blocks of each of the
+// columns of zones, leaving out the edge blocks. The sums are in
+// floats, so the instruction sets may differ in their last bits.
+INTERNAL void SIMD(focus_kernel)(const uint16_t *const *rows, const struct format *fmt, int columns, double *sums)
+{
+    const int width = fmt->width;
+    int32_t green[3][width];
+    v_i32 lanes;
+
+    for(int i = 0; i < V_LANES(uint32_t); i++)
+        lanes[i] = i;
+
+    // The plane of the greens of the 3 rows
+    for(int r = 0; r < 3; r++)
+    {
+        const uint16_t *gr = rows[r] + (fmt->gr & ~1), *gb = rows[r] + (fmt->gb & ~1);
+        int x = 0;
+        for(; x + V_LANES(uint32_t) <= width; x += V_LANES(uint32_t))
+        {
+            v_u16 a = v_load_u16(gr + 2*x), b = v_load_u16(gb + 2*x);
+            v_store_i32(green[r] + x, ((fmt->gr & 1) ? v_odd_u16(a) : v_even_u16(a)) +
+                                      ((fmt->gb & 1) ? v_odd_u16(b) : v_even_u16(b)));
+        }
+        for(; x < width; x++)
+            green[r][x] = rows[r][2*x + fmt->gr] + rows[r][2*x + fmt->gb];
+    }
+
+    for(int zone = 0; zone < columns; zone++)
+    {
+        const int begin = width*zone / columns, end = width*(zone + 1) / columns;
+        const int first = begin > 1 ? begin : 1, last = end < width - 1 ? end : width - 1;
+        v_f32 vector[FOCUS_SUMS] = {v_set_f32(0), v_set_f32(0), v_set_f32(0)};
+        double tail[FOCUS_SUMS] = {0};
+        int x = first;
+
+        for(; x + V_LANES(uint32_t) <= last; x += V_LANES(uint32_t))
+            SIMD(add_sharpness)(green[0] + x, green[1] + x, green[2] + x, v_set_i32(-1), vector);
+
+        // The rest in a vector ending at the last block, without the blocks done
+        if(x < last && last - V_LANES(uint32_t) >= 1)
+        {
+            const int start = last - V_LANES(uint32_t);
+            SIMD(add_sharpness)(green[0] + start, green[1] + start, green[2] + start, start + lanes >= x, vector);
+            x = last;
+        }
+        for(; x < last; x++)
+        {
+            const int32_t *above = green[0] + x, *here = green[1] + x, *below = green[2] + x;
+            double l = 4*here[0] - here[-1] - here[1] - above[0] - below[0];
+            double gx = above[1] + 2*here[1] + below[1] - above[-1] - 2*here[-1] - below[-1];
+            double gy = below[-1] + 2*below[0] + below[1] - above[-1] - 2*above[0] - above[1];
+            tail[0] += l;
+            tail[1] += l*l;
+            tail[2] += gx*gx + gy*gy;
+        }
+        for(int i = 0; i < FOCUS_SUMS; i++)
+            sums[zone*FOCUS_SUMS + i] = v_hsum_f32(vector[i]) + tail[i];
+    }
+}
+
+// Demosaic a row of blocks and grade it with the 3D LUT into the 8 bits
+// output, normalizing it first when given the levels, like lut_pixel on
+// the colors of demosaic_pixel. The colors are normalized and the
+// tetrahedra found and their corners weighted in vectors, while the
+// cells of the colors and the corners are gathered lane by lane.
+INTERNAL void SIMD(lut_kernel)(const uint16_t *src, uint8_t *dst, const struct format *fmt, const struct levels *levels,
+                               const struct lut *lut)
+{
+    const int locations[RG10_COLORS] = {fmt->r, fmt->gr, fmt->gb, fmt->b};
+    const int n = lut->size;
+    int x = 0;
+
+    for(; x + V_LANES(uint32_t) <= fmt->width; x += V_LANES(uint32_t))
+    {
+        v_i32 colors[RG10_COLORS];
+        for(int color = 0; color < RG10_COLORS; color++)
+        {
+            v_u16 v = v_load_u16(src + (locations[color] & ~1) + 2*x);
+            v_i32 value = (locations[color] & 1) ? v_odd_u16(v) : v_even_u16(v);
+            if(levels == &fixed_levels)
+            {
+                value = v_min_i32(value, v_set_i32(MAX_RG10));
+                for(int k = 0; k < V_LANES(uint32_t); k++)
+                    value[k] = fixed_table[value[k]];
+            }
+            else if(levels)
+            {
+                v_f32 scaled = v_clamp_f32((v_float(value) - levels->min) * levels->mult, -1, MAX_RG10 + 1);
+                value = v_round(scaled);
+                value -= scaled - v_float(value) == 0.5f;
+            }
+            colors[color] = v_clamp_i32(value, 0, MAX_RG10);
+        }
+        v_i32 rgb[RGB_COLORS] = {colors[3], (colors[1] + colors[2]) >> 1, colors[0]};   // In the order of RGB_LOCATION
+
+        v_i32 r, g, b;
+        for(int k = 0; k < V_LANES(uint32_t); k++)
+        {
+            r[k] = lut->cells[RGB_R][rgb[RGB_R][k]];
+            g[k] = lut->cells[RGB_G][rgb[RGB_G][k]];
+            b[k] = lut->cells[RGB_B][rgb[RGB_B][k]];
+        }
+        v_i32 fr = r & ((1 << LUT_CELL) - 1), fg = g & ((1 << LUT_CELL) - 1), fb = b & ((1 << LUT_CELL) - 1);
+        v_i32 base = (r >> LUT_CELL) + (g >> LUT_CELL) + (b >> LUT_CELL);
+
+        // The axes of the largest and the smallest positions
+        v_i32 rg = fr >= fg, gb = fg >= fb, rb = fr >= fb;
+        v_i32 along_r = rg & rb, along_g = ~rg & gb;
+        v_i32 first = (along_r & 1) | (along_g & n) | (~(along_r | along_g) & (n*n));
+        v_i32 across_b = rb & gb, across_g = rg & ~gb;
+        v_i32 last = (across_b & (n*n)) | (across_g & n) | (~(across_b | across_g) & 1);
+        v_i32 high = v_max_i32(v_max_i32(fr, fg), fb), low = v_min_i32(v_min_i32(fr, fg), fb);
+        v_i32 middle = fr + fg + fb - high - low;
+        v_i32 corners[4] = {base, base + first, base + 1 + n + n*n - last, base + 1 + n + n*n};
+        v_i32 weights[4] = {LUT_ONE - high, high - middle, middle - low, low};
+
+        // The red and green of a node in a lane, and its blue
+        v_i32 sums[3] = {v_set_i32(0), v_set_i32(0), v_set_i32(0)};
+        for(int corner = 0; corner < 4; corner++)
+        {
+            v_i32 red_green, blue;
+            for(int k = 0; k < V_LANES(uint32_t); k++)
+            {
+                const uint16_t *node = lut->nodes[corners[corner][k]];
+                red_green[k] = node[0] | node[1] << 16;
+                blue[k] = node[2];
+            }
+            sums[0] += weights[corner]*(red_green & 0xffff);
+            sums[1] += weights[corner]*(v_i32)((v_u32)red_green >> 16);
+            sums[2] += weights[corner]*blue;
+        }
+        for(int c = 0; c < 3; c++)
+            sums[c] = (sums[c] + (1 << (LUT_FRACTION + LUT_BITS - 1))) >> (LUT_FRACTION + LUT_BITS);
+        for(int k = 0; k < V_LANES(uint32_t); k++)
+        {
+            uint8_t *pixel = dst + RGB_LOCATION(x + k, 0, 0, 0);
+            pixel[RGB_R] = sums[0][k];
+            pixel[RGB_G] = sums[1][k];
+            pixel[RGB_B] = sums[2][k];
+        }
+    }
+    for(; x < fmt->width; x++)
+    {
+        int rgb[RGB_COLORS];
+        demosaic_pixel(src, x, fmt, levels, rgb);
+        lut_pixel(lut, rgb, dst + RGB_LOCATION(x, 0, 0, 0));
+    }
+}
+
+// The kernels of the instruction set, and the plain C ones for the
+// stages that only have dedicated versions.
+INTERNAL const struct simd SIMD(simd) =
+{
+    SIMD_NAME,
+    SIMD(min_max_kernel),
+    SIMD(normalize_kernel),
+    SIMD(calibrate_kernel),
+    SIMD(denoise_kernel),
+    SIMD(lateral_kernel),
+    SIMD(chroma_planes_kernel),
+    SIMD(chroma_kernel),
+    SIMD(gray_kernel),
+    SIMD(focus_kernel),
+    demosaic_pack_row,
+    SIMD(lut_kernel),
+    unpack_raw10
+};
@@ -0,0 +1,257 @@
+/*
+    A thin layer over the GCC vector extensions, so every SIMD kernel is
+    written once and compiled for each instruction set. Include it (and
+    the kernels after it) with SIMD_BYTES set to the vector width of the
+    target, and SIMD(NAME) adding the target's suffix to the names, e.g.
+    under #pragma GCC target("avx2") with SIMD_BYTES 32.
+
+    The kernels use the short names (v_u16, v_min_u16, ...), which are
+    redefined by every inclusion.
+*/
+
+#define V_LANES(T)      (SIMD_BYTES / (int)sizeof(T)) // Lanes of a vector of T
+#define V_MAGIC         (12582912.0f)            // 1.5 * 2^23, adding and subtracting it rounds to nearest
+
+typedef uint8_t  SIMD(v_u8)  __attribute__((vector_size(SIMD_BYTES / 4))); // Narrowed from 32 bits
+typedef uint16_t SIMD(v_u16) __attribute__((vector_size(SIMD_BYTES)));
+typedef uint16_t SIMD(v_u16n) __attribute__((vector_size(SIMD_BYTES / 2))); // Narrowed from 32 bits
+typedef uint32_t SIMD(v_u32) __attribute__((vector_size(SIMD_BYTES)));
+typedef int32_t  SIMD(v_i32) __attribute__((vector_size(SIMD_BYTES)));
+typedef float    SIMD(v_f32) __attribute__((vector_size(SIMD_BYTES)));
+
+#undef v_u8
+#undef v_u16
+#undef v_u16n
+#undef v_u32
+#undef v_i32
+#undef v_f32
+#define v_u8    SIMD(v_u8)
+#define v_u16   SIMD(v_u16)
+#define v_u16n  SIMD(v_u16n)
+#define v_u32   SIMD(v_u32)
+#define v_i32   SIMD(v_i32)
+#define v_f32   SIMD(v_f32)
+
+// Load a vector of 16 bit values from unaligned memory.
+static inline v_u16 SIMD(v_load_u16)(const uint16_t *p)
+{
+    v_u16 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Store a vector of 16 bit values to unaligned memory.
+static inline void SIMD(v_store_u16)(uint16_t *p, v_u16 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+// Load and store a vector of 32 bit values, unaligned.
+static inline v_i32 SIMD(v_load_i32)(const int32_t *p)
+{
+    v_i32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void SIMD(v_store_i32)(int32_t *p, v_i32 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+// Store a vector of 32 bit values, 0 to 255, as bytes.
+static inline void SIMD(v_store_u8)(uint8_t *p, v_i32 v)
+{
+    v_u8 bytes = __builtin_convertvector(v, v_u8);
+    memcpy(p, &bytes, sizeof(bytes));
+}
+
+// Store a vector of 32 bit values, 0 to 65535, as 16 bit values.
+static inline void SIMD(v_store_narrow_u16)(uint16_t *p, v_i32 v)
+{
+    v_u16n narrow = __builtin_convertvector(v, v_u16n);
+    memcpy(p, &narrow, sizeof(narrow));
+}
+
+// A vector with all the lanes set to a value.
+static inline v_u16 SIMD(v_set_u16)(uint16_t value)
+{
+    return (v_u16){0} + value;
+}
+
+static inline v_u32 SIMD(v_set_u32)(uint32_t value)
+{
+    return (v_u32){0} + value;
+}
+
+static inline v_i32 SIMD(v_set_i32)(int32_t value)
+{
+    return (v_i32){0} + value;
+}
+
+static inline v_f32 SIMD(v_set_f32)(float value)
+{
+    return (v_f32){0} + value;
+}
+
+// Lane-wise min and max.
+static inline v_u16 SIMD(v_min_u16)(v_u16 a, v_u16 b)
+{
+    v_u16 less = (v_u16)(a < b);
+    return (a & less) | (b & ~less);
+}
+
+static inline v_u16 SIMD(v_max_u16)(v_u16 a, v_u16 b)
+{
+    v_u16 less = (v_u16)(a < b);
+    return (b & less) | (a & ~less);
+}
+
+static inline v_u32 SIMD(v_min_u32)(v_u32 a, v_u32 b)
+{
+    v_u32 less = (v_u32)(a < b);
+    return (a & less) | (b & ~less);
+}
+
+static inline v_i32 SIMD(v_min_i32)(v_i32 a, v_i32 b)
+{
+    v_i32 less = a < b;
+    return (a & less) | (b & ~less);
+}
+
+static inline v_i32 SIMD(v_max_i32)(v_i32 a, v_i32 b)
+{
+    v_i32 less = a < b;
+    return (b & less) | (a & ~less);
+}
+
+static inline v_i32 SIMD(v_clamp_i32)(v_i32 v, int32_t low, int32_t high)
+{
+    v_i32 below = v < low, above = v > high;
+    v = (v & ~below) | (low & below);
+    return (v & ~above) | (high & above);
+}
+
+static inline v_f32 SIMD(v_clamp_f32)(v_f32 v, float low, float high)
+{
+    v_i32 below = v < low, above = v > high, bits = (v_i32)v;
+    bits = (bits & ~below) | ((v_i32)SIMD(v_set_f32)(low) & below);
+    return (v_f32)((bits & ~above) | ((v_i32)SIMD(v_set_f32)(high) & above));
+}
+
+// Split the pairs of 16 bit values into 32 bit lanes, the first value of
+// each pair and the second one.
+static inline v_i32 SIMD(v_even_u16)(v_u16 v)
+{
+    return (v_i32)((v_u32)v & 0xffff);
+}
+
+static inline v_i32 SIMD(v_odd_u16)(v_u16 v)
+{
+    return (v_i32)((v_u32)v >> 16);
+}
+
+// Join the 32 bit lanes, 0 to 65535, of the first and second values of
+// each pair back into pairs of 16 bit values.
+static inline v_u16 SIMD(v_pair_u16)(v_i32 even, v_i32 odd)
+{
+    return (v_u16)((v_u32)even | (v_u32)odd << 16);
+}
+
+// Lane-wise conversions between 32 bit integers and floats, the float
+// ones rounded to nearest even like lrintf. Valid up to 2^22.
+static inline v_f32 SIMD(v_float)(v_i32 v)
+{
+    return __builtin_convertvector(v, v_f32);
+}
+
+static inline v_i32 SIMD(v_round)(v_f32 v)
+{
+    return __builtin_convertvector(v + V_MAGIC - V_MAGIC, v_i32);
+}
+
+// The smallest and largest lane, and the sum of the lanes.
+static inline uint16_t SIMD(v_hmin_u16)(v_u16 v)
+{
+    uint16_t min = v[0];
+    for(int i = 1; i < V_LANES(uint16_t); i++)
+        if(min > v[i]) min = v[i];
+    return min;
+}
+
+static inline uint16_t SIMD(v_hmax_u16)(v_u16 v)
+{
+    uint16_t max = v[0];
+    for(int i = 1; i < V_LANES(uint16_t); i++)
+        if(max < v[i]) max = v[i];
+    return max;
+}
+
+static inline uint32_t SIMD(v_hsum_u32)(v_u32 v)
+{
+    uint32_t sum = 0;
+    for(int i = 0; i < V_LANES(uint32_t); i++)
+        sum += v[i];
+    return sum;
+}
+
+static inline double SIMD(v_hsum_f32)(v_f32 v)
+{
+    double sum = 0;
+    for(int i = 0; i < V_LANES(float); i++)
+        sum += v[i];
+    return sum;
+}
+
+#undef v_load_u16
+#undef v_store_u16
+#undef v_load_i32
+#undef v_store_i32
+#undef v_store_u8
+#undef v_store_narrow_u16
+#undef v_set_u16
+#undef v_set_u32
+#undef v_set_i32
+#undef v_set_f32
+#undef v_min_u16
+#undef v_max_u16
+#undef v_min_u32
+#undef v_min_i32
+#undef v_max_i32
+#undef v_clamp_i32
+#undef v_clamp_f32
+#undef v_even_u16
+#undef v_odd_u16
+#undef v_pair_u16
+#undef v_float
+#undef v_round
+#undef v_hmin_u16
+#undef v_hmax_u16
+#undef v_hsum_u32
+#undef v_hsum_f32
+#define v_load_u16  SIMD(v_load_u16)
+#define v_store_u16 SIMD(v_store_u16)
+#define v_load_i32  SIMD(v_load_i32)
+#define v_store_i32 SIMD(v_store_i32)
+#define v_store_u8  SIMD(v_store_u8)
+#define v_store_narrow_u16 SIMD(v_store_narrow_u16)
+#define v_set_u16   SIMD(v_set_u16)
+#define v_set_u32   SIMD(v_set_u32)
+#define v_set_i32   SIMD(v_set_i32)
+#define v_set_f32   SIMD(v_set_f32)
+#define v_min_u16   SIMD(v_min_u16)
+#define v_max_u16   SIMD(v_max_u16)
+#define v_min_u32   SIMD(v_min_u32)
+#define v_min_i32   SIMD(v_min_i32)
+#define v_max_i32   SIMD(v_max_i32)
+#define v_clamp_i32 SIMD(v_clamp_i32)
+#define v_clamp_f32 SIMD(v_clamp_f32)
+#define v_even_u16  SIMD(v_even_u16)
+#define v_odd_u16   SIMD(v_odd_u16)
+#define v_pair_u16  SIMD(v_pair_u16)
+#define v_float     SIMD(v_float)
+#define v_round     SIMD(v_round)
+#define v_hmin_u16  SIMD(v_hmin_u16)
+#define v_hmax_u16  SIMD(v_hmax_u16)
+#define v_hsum_u32  SIMD(v_hsum_u32)
+#define v_hsum_f32  SIMD(v_hsum_f32)